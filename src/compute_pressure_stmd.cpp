@@ -61,6 +61,11 @@ void ComputePressureStmd::init()
 
   if (scale_stmd == NULL || dim != 0)
     error->all(FLERR,"Cannot extract STMD scale factor from fix stmd");
+
+  // Shift of the 2D (E,V) mode, 0 otherwise
+  pshift_stmd = (double *)modify->fix[ifix]->extract("pressure_shift",dim);
+  if (pshift_stmd == NULL || dim != 0)
+    error->all(FLERR,"Cannot extract STMD pressure shift from fix stmd");
 }
 
 /* ----------------------------------------------------------------------
@@ -100,6 +105,7 @@ double ComputePressureStmd::compute_scalar()
       scalar = (virial[0] + virial[1]) / 2.0 * inv_volume * nktv2p;
   }
 
+  scalar -= *pshift_stmd;
   return scalar;
 }
 
@@ -152,5 +158,7 @@ void ComputePressureStmd::compute_vector()
       vector[2] = vector[4] = vector[5] = 0.0;
     }
   }
+
+  for (int i = 0; i < dimension; i++) vector[i] -= *pshift_stmd;
 }
 
@@ -36,6 +36,7 @@ class ComputePressureStmd : public ComputePressure {
   // Access to STMD fix scale factor
   char   *fix_stmd;
   double *scale_stmd;
+  double *pshift_stmd;     // pressure shift of the 2D (E,V) mode
 };
 
 }
@@ -56,6 +57,10 @@ E: Compute pressure must use group all
 Virial contributions computed by potentials (pair, bond, etc) are
 computed on all atoms.
 
+E: Cannot extract STMD pressure shift from fix stmd
+
+The fix ID given to compute pressure/stmd is not a fix stmd.
+
 E: Could not find compute pressure temperature ID
 
 The compute ID for calculating temperature does not exist.
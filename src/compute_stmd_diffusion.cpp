@@ -0,0 +1,124 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   Energy-space diffusion of an STMD/RESTMD walker.
+
+   compute ID group stmd/diffusion fixID
+
+   Requires fix_modify fixID diffusion yes.  The global vector holds
+   the integrated autocorrelation time of E, the mean first passage
+   times low->high and high->low between the ends of the [T1,T2]
+   window, their sum as the mean round-trip time, the number of round
+   trips, the number of transitions, the fraction of them longer than
+   the band and the diffusion coefficient in bins^2/step.
+
+   The global array has one row per energy bin with columns E, the
+   transitions out of the bin, the local diffusion coefficient and the
+   counts of jumps by -band ... +band bins.
+------------------------------------------------------------------------- */
+
+#include <cstring>
+#include "compute_stmd_diffusion.h"
+#include "fix_stmd.h"
+#include "update.h"
+#include "modify.h"
+#include "fix.h"
+#include "comm.h"
+#include "memory.h"
+#include "error.h"
+
+using namespace LAMMPS_NS;
+
+/* ---------------------------------------------------------------------- */
+
+ComputeStmdDiffusion::ComputeStmdDiffusion(LAMMPS *lmp, int narg, char **arg) :
+  Compute(lmp, narg, arg)
+{
+  if (narg != 4) error->all(FLERR,"Illegal compute stmd/diffusion command");
+
+  vector_flag = 1;
+  array_flag = 1;
+  extvector = 0;
+  extarray = 0;
+
+  int n = strlen(arg[3]) + 1;
+  id_fix = new char[n];
+  strcpy(id_fix,arg[3]);
+
+  fix_stmd = find_fix();
+  if (!fix_stmd->diff_flag)
+    error->all(FLERR,"Compute stmd/diffusion requires fix_modify diffusion yes");
+
+  size_vector = 8;
+  size_array_rows = fix_stmd->N;
+  size_array_cols = 3 + 2*fix_stmd->diff_band + 1;
+  memory->create(vector,size_vector,"stmd/diffusion:vector");
+  memory->create(array,size_array_rows,size_array_cols,"stmd/diffusion:array");
+}
+
+/* ---------------------------------------------------------------------- */
+
+ComputeStmdDiffusion::~ComputeStmdDiffusion()
+{
+  delete [] id_fix;
+  memory->destroy(vector);
+  memory->destroy(array);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void ComputeStmdDiffusion::init()
+{
+  fix_stmd = find_fix();
+  if (!fix_stmd->diff_flag)
+    error->all(FLERR,"Compute stmd/diffusion requires fix_modify diffusion yes");
+  if ((fix_stmd->N != size_array_rows) ||
+      (3 + 2*fix_stmd->diff_band + 1 != size_array_cols))
+    error->all(FLERR,"Fix stmd diffusion settings changed after "
+               "compute stmd/diffusion");
+}
+
+/* ---------------------------------------------------------------------- */
+
+FixStmd *ComputeStmdDiffusion::find_fix()
+{
+  int ifix = modify->find_fix(id_fix);
+  if (ifix < 0)
+    error->all(FLERR,"Fix stmd ID for compute stmd/diffusion does not exist");
+  if (strcmp(modify->fix[ifix]->style,"stmd") != 0)
+    error->all(FLERR,"Compute stmd/diffusion fix is not stmd");
+  return (FixStmd *) modify->fix[ifix];
+}
+
+/* ----------------------------------------------------------------------
+   statistics are only accumulated on the world root
+------------------------------------------------------------------------- */
+
+void ComputeStmdDiffusion::compute_vector()
+{
+  invoked_vector = update->ntimestep;
+
+  if (comm->me == 0) fix_stmd->diffusion_vector(vector);
+  MPI_Bcast(vector,size_vector,MPI_DOUBLE,0,world);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void ComputeStmdDiffusion::compute_array()
+{
+  invoked_array = update->ntimestep;
+
+  if (comm->me == 0) fix_stmd->diffusion_array(array);
+  MPI_Bcast(&array[0][0],size_array_rows*size_array_cols,MPI_DOUBLE,0,world);
+}
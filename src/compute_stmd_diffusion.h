@@ -0,0 +1,73 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef COMPUTE_CLASS
+
+ComputeStyle(stmd/diffusion,ComputeStmdDiffusion)
+
+#else
+
+#ifndef LMP_COMPUTE_STMD_DIFFUSION_H
+#define LMP_COMPUTE_STMD_DIFFUSION_H
+
+#include "compute.h"
+
+namespace LAMMPS_NS {
+
+class ComputeStmdDiffusion : public Compute {
+ public:
+  ComputeStmdDiffusion(class LAMMPS *, int, char **);
+  virtual ~ComputeStmdDiffusion();
+  virtual void init();
+  virtual void compute_vector();
+  virtual void compute_array();
+
+ protected:
+  char *id_fix;             // ID of the fix stmd tracking the diffusion
+  class FixStmd *fix_stmd;
+
+  class FixStmd *find_fix();
+};
+
+}
+
+#endif
+#endif
+
+/* ERROR/WARNING messages:
+
+E: Illegal ... command
+
+Self-explanatory.  Check the input script syntax and compare to the
+documentation for the command.  You can use -echo screen as a
+command-line option when running LAMMPS to see the offending line.
+
+E: Fix stmd ID for compute stmd/diffusion does not exist
+
+Compute stmd/diffusion was passed an invalid fix id.
+
+E: Compute stmd/diffusion fix is not stmd
+
+The fix ID passed to compute stmd/diffusion must be a fix stmd.
+
+E: Compute stmd/diffusion requires fix_modify diffusion yes
+
+The fix stmd must track the diffusion statistics before the compute
+is defined, so that the size of the transition array is known.
+
+E: Fix stmd diffusion settings changed after compute stmd/diffusion
+
+The number of bins and the transition band must stay as they were
+when the compute was defined.
+
+*/
@@ -0,0 +1,394 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   Canonical reweighting of STMD/RESTMD production sampling.
+
+   compute ID group stmd/reweight fixID Ntemp T1 ... Tn value1 value2 ...
+                                  [cv value lo hi Nbin]
+
+   Every production step (STG >= 3) fix stmd hands the sampled energy bin
+   to this compute, which adds the current values to per-bin sums.  With
+   the entropy S(E)/k = int dE/(k Ts(E)) of fix stmd from the current Ts
+   estimate, the canonical average at temperature T is
+
+     <A>(T) = sum_E <A>_E exp(S(E)/k - E/kT) / sum_E exp(S(E)/k - E/kT)
+
+   The optional cv keyword also bins the samples along a collective
+   variable and returns the free energy F(T,cv) = -kT ln P(T,cv).
+
+   Output is a global array with one row per (T, cv bin) and columns
+   T, cv bin centre, F(T,cv), <value1>, <value2>, ...
+
+   Under temper/stmd each world samples a sequence of Ts windows, which
+   one S(E) cannot reweight, so only a single world or walkers sharing
+   one Ts estimate (fix_modify shared_ts) are supported.
+------------------------------------------------------------------------- */
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include "compute_stmd_reweight.h"
+#include "fix_stmd.h"
+#include "update.h"
+#include "modify.h"
+#include "fix.h"
+#include "force.h"
+#include "input.h"
+#include "variable.h"
+#include "memory.h"
+#include "error.h"
+#include "universe.h"
+#include "comm.h"
+
+using namespace LAMMPS_NS;
+
+enum{COMPUTE,FIX,VARIABLE};
+
+#define INVOKED_SCALAR 1
+#define INVOKED_VECTOR 2
+
+/* ---------------------------------------------------------------------- */
+
+ComputeStmdReweight::ComputeStmdReweight(LAMMPS *lmp, int narg, char **arg) :
+  Compute(lmp, narg, arg)
+{
+  if (narg < 7) error->all(FLERR,"Illegal compute stmd/reweight command");
+
+  array_flag = 1;
+  extarray = 0;
+
+  int n = strlen(arg[3]) + 1;
+  id_fix = new char[n];
+  strcpy(id_fix,arg[3]);
+  fix_stmd = NULL;
+
+  ntemp = force->inumeric(FLERR,arg[4]);
+  if ((ntemp < 1) || (narg < 5+ntemp+1))
+    error->all(FLERR,"Illegal compute stmd/reweight command");
+  temps = new double[ntemp];
+  for (int i = 0; i < ntemp; i++) {
+    temps[i] = force->numeric(FLERR,arg[5+i]);
+    if (temps[i] <= 0.0) error->all(FLERR,"Illegal compute stmd/reweight command");
+  }
+
+  // values up to the optional cv keyword
+
+  int iarg = 5 + ntemp;
+  int nmax = narg - iarg;
+  which = new int[nmax];
+  argindex = new int[nmax];
+  value2index = new int[nmax];
+  ids = new char*[nmax];
+
+  nvalues = 0;
+  cvflag = 0;
+  cv_id = NULL;
+  ncv = 1;
+  cvlo = cvhi = cvdelta = 0.0;
+
+  while (iarg < narg) {
+    if (strcmp(arg[iarg],"cv") == 0) {
+      if (iarg+5 != narg) error->all(FLERR,"Illegal compute stmd/reweight command");
+      cvflag = 1;
+      int *tmpwhich = &cv_which;
+      int *tmpindex = &cv_argindex;
+      char *suffix = NULL;
+      if (strncmp(arg[iarg+1],"c_",2) == 0) *tmpwhich = COMPUTE;
+      else if (strncmp(arg[iarg+1],"f_",2) == 0) *tmpwhich = FIX;
+      else if (strncmp(arg[iarg+1],"v_",2) == 0) *tmpwhich = VARIABLE;
+      else error->all(FLERR,"Illegal compute stmd/reweight command");
+      n = strlen(arg[iarg+1]);
+      suffix = new char[n];
+      strcpy(suffix,&arg[iarg+1][2]);
+      char *ptr = strchr(suffix,'[');
+      if (ptr) {
+        if (suffix[strlen(suffix)-1] != ']')
+          error->all(FLERR,"Illegal compute stmd/reweight command");
+        *tmpindex = atoi(ptr+1);
+        *ptr = '\0';
+      } else *tmpindex = 0;
+      cv_id = suffix;
+
+      cvlo = force->numeric(FLERR,arg[iarg+2]);
+      cvhi = force->numeric(FLERR,arg[iarg+3]);
+      ncv = force->inumeric(FLERR,arg[iarg+4]);
+      if ((cvhi <= cvlo) || (ncv < 1))
+        error->all(FLERR,"Illegal compute stmd/reweight command");
+      cvdelta = (cvhi - cvlo) / ncv;
+      iarg += 5;
+      continue;
+    }
+
+    if (strncmp(arg[iarg],"c_",2) == 0) which[nvalues] = COMPUTE;
+    else if (strncmp(arg[iarg],"f_",2) == 0) which[nvalues] = FIX;
+    else if (strncmp(arg[iarg],"v_",2) == 0) which[nvalues] = VARIABLE;
+    else error->all(FLERR,"Illegal compute stmd/reweight command");
+
+    n = strlen(arg[iarg]);
+    char *suffix = new char[n];
+    strcpy(suffix,&arg[iarg][2]);
+
+    char *ptr = strchr(suffix,'[');
+    if (ptr) {
+      if (suffix[strlen(suffix)-1] != ']')
+        error->all(FLERR,"Illegal compute stmd/reweight command");
+      argindex[nvalues] = atoi(ptr+1);
+      *ptr = '\0';
+    } else argindex[nvalues] = 0;
+
+    ids[nvalues] = suffix;
+    nvalues++;
+    iarg++;
+  }
+
+  if (nvalues == 0 && !cvflag)
+    error->all(FLERR,"Illegal compute stmd/reweight command");
+
+  size_array_rows = ntemp * ncv;
+  size_array_cols = 3 + nvalues;
+  memory->create(array,size_array_rows,size_array_cols,"stmd/reweight:array");
+
+  nbins = 0;
+  e0 = bin = 0.0;
+  count = sum = sbin = logw = NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+
+ComputeStmdReweight::~ComputeStmdReweight()
+{
+  delete [] id_fix;
+  delete [] temps;
+  delete [] which;
+  delete [] argindex;
+  delete [] value2index;
+  for (int i = 0; i < nvalues; i++) delete [] ids[i];
+  delete [] ids;
+  delete [] cv_id;
+
+  memory->destroy(array);
+  memory->destroy(count);
+  memory->destroy(sum);
+  memory->destroy(sbin);
+  memory->destroy(logw);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void ComputeStmdReweight::init()
+{
+  int ifix = modify->find_fix(id_fix);
+  if (ifix < 0)
+    error->all(FLERR,"Fix stmd ID for compute stmd/reweight does not exist");
+  if (strcmp(modify->fix[ifix]->style,"stmd") != 0)
+    error->all(FLERR,"Compute stmd/reweight fix is not stmd");
+  fix_stmd = (FixStmd *) modify->fix[ifix];
+
+  if ((universe->nworlds > 1) && !fix_stmd->shared_flag)
+    error->all(FLERR,"Compute stmd/reweight cannot be used with temper/stmd");
+
+  // sums are kept across runs, only allocated on first use,
+  // a redefined fix stmd must keep the energy grid they are binned on
+
+  int dim;
+  const double bin_now = *((double *) fix_stmd->extract("bin",dim));
+  const double e0_now = fix_stmd->bin_energy(0);
+  if (count == NULL) {
+    nbins = fix_stmd->N;
+    e0 = e0_now;
+    bin = bin_now;
+    memory->create(count,nbins*ncv,"stmd/reweight:count");
+    memory->create(sum,nbins*ncv*(nvalues > 0 ? nvalues : 1),"stmd/reweight:sum");
+    memory->create(sbin,nbins,"stmd/reweight:sbin");
+    memory->create(logw,nbins,"stmd/reweight:logw");
+    for (int i = 0; i < nbins*ncv; i++) count[i] = 0.0;
+    for (int i = 0; i < nbins*ncv*nvalues; i++) sum[i] = 0.0;
+  } else if ((nbins != fix_stmd->N) || (e0 != e0_now) || (bin != bin_now))
+    error->all(FLERR,"Compute stmd/reweight energy grid of fix stmd changed");
+
+  // set indices and check validity of all computes, fixes, variables
+  // the cv is treated as value nvalues
+
+  for (int i = 0; i <= nvalues; i++) {
+    int kind,index;
+    const char *name;
+    if (i < nvalues) {
+      kind = which[i]; index = argindex[i]; name = ids[i];
+    } else if (cvflag) {
+      kind = cv_which; index = cv_argindex; name = cv_id;
+    } else break;
+
+    int m = -1;
+    if (kind == COMPUTE) {
+      m = modify->find_compute(name);
+      if (m < 0)
+        error->all(FLERR,"Compute ID for compute stmd/reweight does not exist");
+      Compute *c = modify->compute[m];
+      if (index == 0 && c->scalar_flag == 0)
+        error->all(FLERR,"Compute stmd/reweight compute does not calculate a scalar");
+      if (index && c->vector_flag == 0)
+        error->all(FLERR,"Compute stmd/reweight compute does not calculate a vector");
+      if (index && index > c->size_vector)
+        error->all(FLERR,"Compute stmd/reweight compute vector is accessed out-of-range");
+    } else if (kind == FIX) {
+      m = modify->find_fix(name);
+      if (m < 0)
+        error->all(FLERR,"Fix ID for compute stmd/reweight does not exist");
+      if (modify->fix[m]->global_freq != 1)
+        error->all(FLERR,"Fix for compute stmd/reweight not computed at compatible time");
+    } else if (kind == VARIABLE) {
+      m = input->variable->find((char *) name);
+      if (m < 0)
+        error->all(FLERR,"Variable name for compute stmd/reweight does not exist");
+      if (input->variable->equalstyle(m) == 0)
+        error->all(FLERR,"Compute stmd/reweight variable is not equal-style variable");
+    }
+
+    if (i < nvalues) value2index[i] = m;
+    else cv_index = m;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   current value of a compute, fix or variable
+------------------------------------------------------------------------- */
+
+double ComputeStmdReweight::evaluate(int kind, int m, int index)
+{
+  if (kind == COMPUTE) {
+    Compute *c = modify->compute[m];
+    if (index == 0) {
+      if (!(c->invoked_flag & INVOKED_SCALAR)) {
+        c->compute_scalar();
+        c->invoked_flag |= INVOKED_SCALAR;
+      }
+      return c->scalar;
+    }
+    if (!(c->invoked_flag & INVOKED_VECTOR)) {
+      c->compute_vector();
+      c->invoked_flag |= INVOKED_VECTOR;
+    }
+    return c->vector[index-1];
+  }
+
+  if (kind == FIX) {
+    if (index == 0) return modify->fix[m]->compute_scalar();
+    return modify->fix[m]->compute_vector(index-1);
+  }
+
+  return input->variable->compute_equal(m);
+}
+
+/* ----------------------------------------------------------------------
+   add the current values to energy bin ibin of fix stmd
+------------------------------------------------------------------------- */
+
+void ComputeStmdReweight::accumulate(FixStmd *fix, int ibin)
+{
+  if ((fix != fix_stmd) || (ibin < 0) || (ibin >= nbins)) return;
+
+  modify->clearstep_compute();
+
+  int icv = 0;
+  if (cvflag) {
+    const double cv = evaluate(cv_which,cv_index,cv_argindex);
+    icv = static_cast<int> (floor((cv - cvlo) / cvdelta));
+    if ((icv < 0) || (icv >= ncv)) {
+      modify->addstep_compute(update->ntimestep + 1);
+      return;
+    }
+  }
+
+  const int k = ibin*ncv + icv;
+  count[k] += 1.0;
+  for (int m = 0; m < nvalues; m++)
+    sum[k*nvalues+m] += evaluate(which[m],value2index[m],argindex[m]);
+
+  modify->addstep_compute(update->ntimestep + 1);
+}
+
+/* ----------------------------------------------------------------------
+   reweight the accumulated sums to each target temperature
+------------------------------------------------------------------------- */
+
+void ComputeStmdReweight::compute_array()
+{
+  invoked_array = update->ntimestep;
+
+  const double boltz = force->boltz;
+
+  // S(E)/k of fix stmd, Ts is only maintained on the world root
+  if (comm->me == 0)
+    for (int b = 0; b < nbins; b++)
+      sbin[b] = fix_stmd->entropy_at(fix_stmd->bin_energy(b));
+  MPI_Bcast(sbin,nbins,MPI_DOUBLE,0,world);
+
+  for (int it = 0; it < ntemp; it++) {
+    const double beta = 1.0 / (boltz * temps[it]);
+
+    // log of Omega(E) exp(-E/kT)
+
+    double wmax = -HUGE_VAL;
+    for (int b = 0; b < nbins; b++) {
+      logw[b] = sbin[b] - beta * fix_stmd->bin_energy(b);
+      double ctot = 0.0;
+      for (int c = 0; c < ncv; c++) ctot += count[b*ncv+c];
+      if (ctot > 0.0) { if (logw[b] > wmax) wmax = logw[b]; }
+      else logw[b] = -HUGE_VAL;
+    }
+
+    double fmin = HUGE_VAL;
+    for (int c = 0; c < ncv; c++) {
+      double *row = array[it*ncv+c];
+      row[0] = temps[it];
+      row[1] = cvflag ? cvlo + (c+0.5)*cvdelta : 0.0;
+      for (int m = 0; m < nvalues; m++) row[3+m] = 0.0;
+
+      double P = 0.0;
+      for (int b = 0; b < nbins; b++) {
+        if (logw[b] == -HUGE_VAL) continue;
+        double ctot = 0.0;
+        for (int cc = 0; cc < ncv; cc++) ctot += count[b*ncv+cc];
+        const double w = exp(logw[b] - wmax) / ctot;
+        const int k = b*ncv + c;
+        P += w * count[k];
+        for (int m = 0; m < nvalues; m++) row[3+m] += w * sum[k*nvalues+m];
+      }
+
+      if (P > 0.0) {
+        for (int m = 0; m < nvalues; m++) row[3+m] /= P;
+        row[2] = -log(P) / beta;
+        if (row[2] < fmin) fmin = row[2];
+      } else row[2] = HUGE_VAL;
+    }
+
+    // free energy relative to the most probable cv bin, 0 if unsampled
+
+    for (int c = 0; c < ncv; c++) {
+      double *row = array[it*ncv+c];
+      if (row[2] == HUGE_VAL) row[2] = 0.0;
+      else row[2] -= fmin;
+    }
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+double ComputeStmdReweight::memory_usage()
+{
+  double bytes = (double) nbins*ncv * (1+nvalues) * sizeof(double);
+  bytes += 2.0 * nbins * sizeof(double);
+  bytes += (double) size_array_rows * size_array_cols * sizeof(double);
+  return bytes;
+}
@@ -0,0 +1,130 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef COMPUTE_CLASS
+
+ComputeStyle(stmd/reweight,ComputeStmdReweight)
+
+#else
+
+#ifndef LMP_COMPUTE_STMD_REWEIGHT_H
+#define LMP_COMPUTE_STMD_REWEIGHT_H
+
+#include "compute.h"
+
+namespace LAMMPS_NS {
+
+class ComputeStmdReweight : public Compute {
+ public:
+  ComputeStmdReweight(class LAMMPS *, int, char **);
+  virtual ~ComputeStmdReweight();
+  virtual void init();
+  virtual void compute_array();
+  virtual double memory_usage();
+
+  // Called by fix stmd every step of a production (STG >= 3) run
+  void accumulate(class FixStmd *, int);
+
+ protected:
+  char *id_fix;             // ID of the fix stmd providing Ts(E)
+  class FixStmd *fix_stmd;
+
+  int nbins;                // number of energy bins of fix stmd
+  double e0,bin;            // energy of bin 0 and bin size of that grid
+  int ntemp;                // number of target temperatures
+  double *temps;            // target temperatures
+
+  int nvalues;              // number of accumulated quantities
+  int *which,*argindex,*value2index;
+  char **ids;
+
+  int cvflag;               // 1 if binning along a collective variable
+  int cv_which,cv_argindex,cv_index;
+  char *cv_id;
+  int ncv;                  // number of CV bins (1 without cv)
+  double cvlo,cvhi,cvdelta;
+
+  double *count;            // samples per (energy bin, cv bin)
+  double *sum;              // sum of each value per (energy bin, cv bin)
+  double *sbin;             // S(E)/k of each bin from the world root
+  double *logw;             // per-bin canonical log weight at one T
+
+  double evaluate(int, int, int);
+};
+
+}
+
+#endif
+#endif
+
+/* ERROR/WARNING messages:
+
+E: Illegal ... command
+
+Self-explanatory.  Check the input script syntax and compare to the
+documentation for the command.  You can use -echo screen as a
+command-line option when running LAMMPS to see the offending line.
+
+E: Fix stmd ID for compute stmd/reweight does not exist
+
+Compute stmd/reweight was passed an invalid fix id.
+
+E: Compute stmd/reweight fix is not stmd
+
+The fix ID passed to compute stmd/reweight must be a fix stmd.
+
+E: Compute stmd/reweight cannot be used with temper/stmd
+
+Each world visits many Ts windows during a tempering run, so its
+samples cannot be reweighted with the S(E) of its current window.
+Walkers sharing one Ts estimate with fix_modify shared_ts are allowed.
+
+E: Compute stmd/reweight energy grid of fix stmd changed
+
+The sums are binned on the energy grid of the first run.  A fix stmd
+redefined with other Emin, Emax or bin needs a new compute.
+
+E: Compute ID for compute stmd/reweight does not exist
+
+Self-explanatory.
+
+E: Compute stmd/reweight compute does not calculate a scalar
+
+Values without a bracketed index must be global scalars.
+
+E: Compute stmd/reweight compute does not calculate a vector
+
+Values with a bracketed index must come from a global vector.
+
+E: Compute stmd/reweight compute vector is accessed out-of-range
+
+Self-explanatory.
+
+E: Fix ID for compute stmd/reweight does not exist
+
+Self-explanatory.
+
+E: Fix for compute stmd/reweight not computed at compatible time
+
+Fixes generate their values on specific timesteps.  Compute
+stmd/reweight is accumulated every step of the production run.
+
+E: Variable name for compute stmd/reweight does not exist
+
+Self-explanatory.
+
+E: Compute stmd/reweight variable is not equal-style variable
+
+Self-explanatory.
+
+*/
@@ -30,8 +30,10 @@
     
 ------------------------------------------------------------------------- */
 
+#include <cmath>
 #include <cstring>
 #include <cstdlib>
+#include <cctype>
 #include "fix_stmd.h"
 #include "atom.h"
 #include "update.h"
@@ -44,9 +46,20 @@
 #include "memory.h"
 #include "error.h"
 #include "force.h"
+#include "pair.h"
+#include "bond.h"
+#include "angle.h"
+#include "dihedral.h"
+#include "improper.h"
+#include "kspace.h"
+#include "integrate.h"
 #include "comm.h"
+#include "neighbor.h"
+#include "neigh_list.h"
+#include "neigh_request.h"
 #include "group.h"
 #include "compute.h"
+#include "compute_stmd_reweight.h"
 #include "output.h"
 #include "universe.h"
 #include <fstream>
@@ -56,8 +69,14 @@ using namespace LAMMPS_NS;
 using namespace FixConst;
 
 enum{NONE,CONSTANT,EQUAL,ATOM};
+enum{IMPORT_OREST,IMPORT_WT,IMPORT_STWHAM};
 
 #define INVOKED_SCALAR 1
+#define INVOKED_PERATOM 8
+
+#define MIN(A,B) ((A) < (B) ? (A) : (B))
+#define MAX(A,B) ((A) > (B) ? (A) : (B))
+#define BIG 1.0e20
 
 /* ---------------------------------------------------------------------- */
 
@@ -97,6 +116,8 @@ FixStmd::FixStmd(LAMMPS *lmp, int narg, char **arg) :
     f_flag = 3;
   else if (strcmp(arg[4],"constant_df") == 0)
     f_flag = 4;
+  else if (strcmp(arg[4],"inv_t") == 0)
+    f_flag = 5;
   else
     error->all(FLERR,"STMD: invalid f-reduction scheme");
   if (f_flag == -1)
@@ -155,21 +176,124 @@ FixStmd::FixStmd(LAMMPS *lmp, int narg, char **arg) :
     strcpy(dir_output,"./");
   
   // Init arrays
-  Y2 = Prob = NULL;
+  Y2 = Prob = Y2old = NULL;
   Hist = Htot = PROH = NULL;
+  stmd_array = NULL;
+  array_step = -1;
+  hcoef = NULL;
+  ent_inc = ent_sum = NULL;
+  sdirty_lo = 0;
+  sdirty_hi = -1;
+  cv_valid = 0;
 
   // STMD_specific flags
   hist_flag = 0; // 0=read from restart, 1=reset
   freset_flag = 0; // 0=read from restart, 1=reset
 
+  // Ts is private to this walker unless shared_ts is set
+  shared_flag = 0;
+  shared_group = 0;
+  shared_every = 1;
+  shared_rank = 0;
+  shared_comm = MPI_COMM_NULL;
+#ifdef STMD_MPI3
+  shared_win = MPI_WIN_NULL;
+#endif
+  shared_buf = NULL;
+  Y2sync = Hsync = shared_delta = shared_result = NULL;
+
+  // Default to piecewise linear Gamma(E)
+  interp_flag = 0;
+  dirty_lo = 0;
+  dirty_hi = -1;
+
+  // Default to the original two-bin Ts update
+  kernel_flag = 0;
+  nkernel = 1;
+  kernel_width = 0.0;
+  kw = NULL;
+
+  nreweight = 0;
+  reweight_list = NULL;
+
+  // Sample the total potential energy unless fix_modify energy is used
+  energy_group = -1;
+  energy_bit = 0;
+  energy_lambda = 0.5;
+  id_peatom = NULL;
+  peatom_compute = -1;
+  list = NULL;
+  ncross = maxcross = nmax_cross = 0;
+  cross = NULL;
+  fcross = NULL;
+  comm_reverse = 3;
+
+  // 2D (E,V) mode is off until fix_modify volume
+  vol_flag = 0;
+  NV = N2 = 0;
+  Vmin = Vmax = vbin = Plo = Phi = 0.0;
+  sampledU = sampledV = pshift = 0.0;
+  Ts2 = Pi2 = NULL;
+  fp_wt2 = NULL;
+
+  // Ts convergence tolerance for inv_t, 0 = use f-tolerance only
+  ts_tol = 0.0;
+
   // Setup communication flags
   stmd_logfile = stmd_debug = stmd_screen = 0;
   if ((comm->me == 0) && (logfile)) stmd_logfile = 1;
   if ((comm->me == 0) && (screen)) stmd_screen = 1;
+  fp_screen = stmd_screen ? screen : NULL;
+  fp_log = stmd_logfile ? logfile : NULL;
+  debug_flag = stmd_debug;
 
   // Init file pointers
   fp_wtnm = fp_whnm = fp_whpnm = fp_orest = NULL;
 
+  // temper/stmd may take over WT, WH and oREST output for all walkers
+  aggregate_flag = 0;
+
+  // neighbor list settings are left alone until fix_modify neigh_adapt
+  neigh_flag = 0;
+  neigh_saved = 0;
+  neigh_every0 = neigh_delay0 = 0;
+  neigh_min = neigh_max = 1;
+  neigh_safety = 0.5;
+  neigh_disp = 0.0;
+
+  // fixed timestep until fix_modify dt_adapt
+  dt_flag = 0;
+  dt_every = 1;
+  dt_min = dt_max = dt_xmax = 0.0;
+
+  // blocking energy reduction until fix_modify overlap
+  overlap_flag = overlap_pending = 0;
+
+  // no Ts(E) import until fix_modify ts_import
+  import_flag = 0;
+  import_file = NULL;
+
+  // energy-space diffusion is not tracked until fix_modify diffusion
+  diff_flag = 0;
+  diff_band = 10;
+  diff_lag = 1000;
+  trans = NULL;
+  ac_buf = ac_sum = NULL;
+
+  // one walker per fix until fix_modify molecule
+  mol_flag = 0;
+  id_mol = NULL;
+  mol_compute = -1;
+  nwalk = 0;
+  mol_current = -1;
+  molmax = 0;
+  molmap = NULL;
+  mollist = NULL;
+  ymol = y2oldmol = probmol = NULL;
+  hmol = htotmol = prohmol = NULL;
+  emol = emol_local = gmol = NULL;
+  mstate = NULL;
+
   
   // Energy bin setup
   BinMin = round(Emin / bin);
@@ -227,8 +351,8 @@ FixStmd::FixStmd(LAMMPS *lmp, int narg, char **arg) :
   }
   
   // Setup size of global vector/arrays
-  size_vector = 9;
-  size_array_cols = 4;
+  size_vector = 13;
+  size_array_cols = 5;
   size_array_rows = N;
 
   // DEBUG FLAG
@@ -240,14 +364,54 @@ FixStmd::FixStmd(LAMMPS *lmp, int narg, char **arg) :
 
 FixStmd::~FixStmd()
 {
+  restore_neighbor();
   memory->destroy(Y2);
   memory->destroy(Hist);
   memory->destroy(Htot);
   memory->destroy(PROH);
   memory->destroy(Prob);
+  memory->destroy(Y2old);
+  memory->destroy(stmd_array);
+  memory->destroy(kw);
+  memory->destroy(hcoef);
+  memory->destroy(ent_inc);
+  memory->destroy(ent_sum);
+  delete [] reweight_list;
+#ifdef STMD_MPI3
+  if (shared_win != MPI_WIN_NULL) MPI_Win_free(&shared_win);
+#endif
+  if (shared_comm != MPI_COMM_NULL) MPI_Comm_free(&shared_comm);
+  memory->destroy(Y2sync);
+  memory->destroy(Hsync);
+  memory->destroy(shared_delta);
+  memory->destroy(shared_result);
   modify->delete_compute(id_temp);
   modify->delete_compute(id_press);
+  if (id_peatom) modify->delete_compute(id_peatom);
   delete [] id_nh;
+  delete [] id_peatom;
+  memory->destroy(cross);
+  memory->destroy(fcross);
+  delete [] import_file;
+  memory->destroy(trans);
+  memory->destroy(ac_buf);
+  memory->destroy(ac_sum);
+  delete [] id_mol;
+  memory->destroy(molmap);
+  memory->destroy(mollist);
+  memory->destroy(ymol);
+  memory->destroy(y2oldmol);
+  memory->destroy(probmol);
+  memory->destroy(hmol);
+  memory->destroy(htotmol);
+  memory->destroy(prohmol);
+  memory->destroy(emol);
+  memory->destroy(emol_local);
+  memory->destroy(gmol);
+  delete [] mstate;
+  memory->destroy(Ts2);
+  memory->destroy(Pi2);
+  if (fp_wt2) fclose(fp_wt2);
   delete [] id_temp;
   delete [] id_press;
 }
@@ -257,6 +421,7 @@ FixStmd::~FixStmd()
 int FixStmd::setmask()
 {
   int mask = 0;
+  mask |= PRE_REVERSE;
   mask |= POST_FORCE;
   mask |= MIN_POST_FORCE;
   mask |= END_OF_STEP;
@@ -273,7 +438,7 @@ void FixStmd::init()
   char walker[256]; 
   sprintf(walker,"%i",iworld);
 
-  if (comm->me == 0) {
+  if ((comm->me == 0) && !aggregate_flag) {
     char filename[256];
     if (!fp_wtnm) {
       strcpy(filename,dir_output);
@@ -301,6 +466,14 @@ void FixStmd::init()
       fp_whpnm = fopen(filename,"w");
     }
     */
+    if (vol_flag && !fp_wt2) {
+      strcpy(filename,dir_output);
+      strcat(filename,"/WT2.");
+      strcat(filename,walker);
+      strcat(filename,".d");
+      strcpy(filename_wt2,filename);
+      fp_wt2 = fopen(filename,"w");
+    }
     if ((!fp_orest) && (!OREST)) {
       strcpy(filename,dir_output);
       strcat(filename,"/oREST.");
@@ -410,6 +583,15 @@ void FixStmd::init()
   memory->grow(Htot, N, "FixSTMD:Htot");
   memory->grow(PROH, N, "FixSTMD:PROH");
   memory->grow(Prob, N, "FixSTMD:Prob");
+  memory->grow(Y2old, N, "FixSTMD:Y2old");
+  memory->grow(stmd_array, N, 5, "FixSTMD:stmd_array");
+  if (interp_flag) memory->grow(hcoef, N, 4, "FixSTMD:hcoef");
+  if (vol_flag) setup_volume();
+  memory->grow(ent_inc, N, "FixSTMD:ent_inc");
+  memory->grow(ent_sum, N, "FixSTMD:ent_sum");
+  if (diff_flag) setup_diffusion();
+  array_step = -1;
+  cv_valid = 0;
 
   for (int i=0; i<N; i++) {
     Y2[i] = T2;
@@ -417,11 +599,35 @@ void FixStmd::init()
     Htot[i] = 0;
     PROH[i] = 0;
     Prob[i] = 0.0;
+    ent_inc[i] = ent_sum[i] = 0.0;
   }
+  ts_change = 0.0;
 
-  // Search for pe compute, otherwise create a new one
+  // Solute energy: the solute-solvent pairs are evaluated with
+  // Pair::single() on a half list of my own, as in compute group/group,
+  // so that Gamma only scales the forces the sampled energy derives from
   pe_compute_id = -1;
-  for (int i=0; i<modify->ncompute; i++) {
+  if (energy_group >= 0) {
+    peatom_compute = modify->find_compute(id_peatom);
+    if (peatom_compute < 0)
+      error->all(FLERR,"Could not find fix_modify energy pe/atom compute");
+    if (igroup != 0)
+      error->all(FLERR,"Fix_modify energy requires fix stmd group all");
+    if (pressflag || vol_flag)
+      error->all(FLERR,"Fix_modify energy cannot be used with a barostat "
+                 "or volume");
+    if (force->kspace)
+      error->all(FLERR,"Fix_modify energy cannot be used with kspace");
+    if ((force->pair == NULL) || (force->pair->single_enable == 0))
+      error->all(FLERR,"Fix_modify energy requires a pair style with single()");
+
+    int irequest = neighbor->request(this,instance_me);
+    neighbor->requests[irequest]->pair = 0;
+    neighbor->requests[irequest]->fix = 1;
+  }
+
+  // Search for pe compute, otherwise create a new one
+  for (int i=0; (pe_compute_id < 0) && (i<modify->ncompute); i++) {
     if (strcmp(modify->compute[i]->style,"pe") == 0) {
       pe_compute_id = i;
       break;
@@ -447,15 +653,49 @@ void FixStmd::init()
     pe_compute_id = modify->ncompute - 1;
   }
 
+  // the overlapped reduction rebuilds the total pe from the force styles,
+  // every rank then runs MAIN on identical state and Gamma needs no Bcast
+  if (overlap_flag) {
+    if ((energy_group >= 0) ||
+        strcmp(modify->compute[pe_compute_id]->id,"thermo_pe"))
+      error->all(FLERR,"Fix_modify overlap requires the default pe compute");
+    for (int i=0; i<modify->nfix; i++)
+      if (modify->fix[i]->thermo_energy)
+        error->all(FLERR,"Fix_modify overlap does not support fixes "
+                   "contributing to the energy");
+    if (vol_flag || shared_flag)
+      error->all(FLERR,"Fix_modify overlap cannot be used with volume "
+                 "or shared_ts");
+  }
+
+  // Reweighting computes accumulated from end_of_step
+  delete [] reweight_list;
+  nreweight = 0;
+  for (int i=0; i<modify->ncompute; i++)
+    if (strcmp(modify->compute[i]->style,"stmd/reweight") == 0) nreweight++;
+  reweight_list = new int[nreweight];
+  nreweight = 0;
+  for (int i=0; i<modify->ncompute; i++)
+    if (strcmp(modify->compute[i]->style,"stmd/reweight") == 0)
+      reweight_list[nreweight++] = i;
+
   if (domain->triclinic)
     error->all(FLERR,"Triclinic cells are not supported");
 
-  if (OREST) { // Read oREST.d into variables
+  // Molecule walkers restart from oMOL instead of oREST
+  int mol_restart = OREST;
+
+  // Diffusion statistics and 2D grids are kept in their own files
+  // next to oREST
+  if (OREST && diff_flag && (comm->me == 0)) read_diffusion();
+  if (OREST && vol_flag && (comm->me == 0)) read_volume();
+
+  // Read oREST.d into variables
+  // with aggregated output temper/stmd restores the walker instead
+  if (OREST && !aggregate_flag) {
+    double *list = NULL;
     if (comm->me == 0) {
-      int k = 0;
-      int numb = 13;
-      int nsize = 3*N + numb;
-      double *list;
+      int nsize = orest_size();
       memory->create(list,nsize,"stmd:list");
 
       char filename[256];
@@ -479,39 +719,41 @@ void FixStmd::init()
 
       for (int i=0; i<nsize; i++) 
         file >> list[i];
+    }
+    restore_orest(list);
+    memory->destroy(list);
+  } else {
+    // inv_t switches to ln(f) = N/t when entering STG3
+    invt_flag = ((f_flag == 5) && (STG >= 3)) ? 1 : 0;
+    for (int i=0; i<N; i++) Y2old[i] = Y2[i];
+    ts_changed();
+  }
 
-      STG = static_cast<int> (list[k++]);
-      if (!freset_flag)
-        f = list[k++];
-      CountH = static_cast<int> (list[k++]);
-      SWf = static_cast<int> (list[k++]);
-      SWfold = static_cast<int> (list[k++]);
-      SWchk = static_cast<int> (list[k++]);
-      Count = static_cast<int> (list[k++]);
-      totCi = static_cast<int> (list[k++]);
-      CountPH = static_cast<int> (list[k++]);
-      //TSC1 = static_cast<int> (list[k++]);
-      //TSC2 = static_cast<int> (list[k++]);
-      T1 = list[k++];
-      T2 = list[k++];
-      CTmin = list[k++];
-      CTmax = list[k++];
-
-      for (int i=0; i<N; i++)
-        Y2[i] = list[k++];
-      for (int i=0; i<N; i++)
-        Htot[i] = list[k++];
-      if (!hist_flag) {
-        for (int i=0; i<N; i++)
-          PROH[i] = list[k++];
-      }
-
-      memory->destroy(list);
+  // Seed Ts(E) from a previous run, overrides the restart file
+  if (import_flag) import_temperature();
+
+  // Every walker starts from the state above unless restarted
+  if (mol_flag) setup_molecule(mol_restart);
+
+  // Ts may only be known on proc 0 after a restart or import
+  if (overlap_flag) sync_state();
+
+  // the interval only spaces the displacement checks, rebuilds
+  // themselves stay driven by the check
+  if (neigh_flag) {
+    if (!neighbor->dist_check)
+      error->all(FLERR,"Fix_modify neigh_adapt requires neigh_modify "
+                 "check yes");
+    if (!neigh_saved) {
+      neigh_every0 = neighbor->every;
+      neigh_delay0 = neighbor->delay;
+      neigh_saved = 1;
     }
-    if (!freset_flag)
-      df = log(f) * 0.5 / bin;
-    OREST = 0;
+    neighbor->delay = 0;
   }
+
+  // Join the shared Ts estimate, collective over the universe
+  if (shared_flag) setup_shared();
 }
 
 /* ---------------------------------------------------------------------- */
@@ -546,6 +788,9 @@ void FixStmd::setup(int vflag)
   }
     // Force computation of energies
     modify->compute[pe_compute_id]->invoked_flag |= INVOKED_SCALAR;
+    if (mol_flag) modify->compute[mol_compute]->invoked_flag |= INVOKED_PERATOM;
+    if (energy_group >= 0)
+      modify->compute[peatom_compute]->invoked_flag |= INVOKED_PERATOM;
     modify->addstep_compute(update->ntimestep + 1);
   } else
     error->all(FLERR,"Currently expecting run_style verlet");
@@ -560,17 +805,83 @@ void FixStmd::min_setup(int vflag)
 
 /* ---------------------------------------------------------------------- */
 
+void FixStmd::pre_reverse(int eflag, int vflag)
+{
+  // start the reduction of the local pe, it completes while ghost
+  // forces are communicated; only steps that tally global energies
+  // without MPI-3 the reduction is blocking, the result is the same
+  overlap_pending = 0;
+  if (!overlap_flag || !(eflag % 2)) return;
+
+  double one = 0.0;
+  if (force->pair)
+    one += force->pair->eng_vdwl + force->pair->eng_coul;
+  if (atom->molecular) {
+    if (force->bond) one += force->bond->energy;
+    if (force->angle) one += force->angle->energy;
+    if (force->dihedral) one += force->dihedral->energy;
+    if (force->improper) one += force->improper->energy;
+  }
+  overlap_local = one;
+#ifdef STMD_MPI3
+  MPI_Iallreduce(&overlap_local,&overlap_pe,1,MPI_DOUBLE,MPI_SUM,world,
+                 &overlap_request);
+#else
+  MPI_Allreduce(&overlap_local,&overlap_pe,1,MPI_DOUBLE,MPI_SUM,world);
+#endif
+  overlap_pending = 1;
+}
+
+/* ---------------------------------------------------------------------- */
+
 void FixStmd::post_force(int vflag)
 {
+  if (mol_flag) {
+    post_force_molecule();
+    return;
+  }
+
   double **f = atom->f;
   int *mask = atom->mask;
   int nlocal = atom->nlocal;
 
+  // pair and bond lists only change on reneighboring
+  if ((energy_group >= 0) && (neighbor->ago == 0)) {
+    check_interactions();
+    build_cross();
+  }
+
   // Get current value of potential energy from compute/pe
-  double tmp_pe = modify->compute[pe_compute_id]->compute_scalar();
+  // or finish the reduction started in pre_reverse, same terms as compute pe
+  double tmp_pe;
   double tmp_vol = domain->xprd * domain->yprd * domain->zprd;
-
-  sampledE = tmp_pe + (pressref*tmp_vol/(force->nktv2p));
+  if (overlap_pending) {
+#ifdef STMD_MPI3
+    MPI_Wait(&overlap_request,MPI_STATUS_IGNORE);
+#endif
+    overlap_pending = 0;
+    tmp_pe = overlap_pe;
+    if (force->kspace) tmp_pe += force->kspace->energy;
+    if (force->pair && force->pair->tail_flag)
+      tmp_pe += force->pair->etail / tmp_vol;
+  } else if (energy_group >= 0) tmp_pe = solute_energy();
+  else tmp_pe = modify->compute[pe_compute_id]->compute_scalar();
+
+  sampledU = tmp_pe;
+  sampledV = tmp_vol;
+
+  // In 2D mode the volume is its own coordinate
+  if (vol_flag) {
+    sampledE = tmp_pe;
+    if ((sampledV < Vmin) || (sampledV > Vmax)) {
+      if (stmd_screen && (comm->me == 0))
+        fprintf(screen,"STMD: Sampled volume %f\n", sampledV);
+      if (stmd_logfile && (comm->me == 0))
+        fprintf(logfile,"STMD: Sampled volume %f\n", sampledV);
+      error->all(FLERR,"Volume out of range\n");
+    }
+  } else
+    sampledE = tmp_pe + (pressref*tmp_vol/(force->nktv2p));
 
   // Check if sampledE is outside of bounds before continuing
   if ((sampledE < Emin) || (sampledE > Emax)) {
@@ -582,10 +893,51 @@ void FixStmd::post_force(int vflag)
   }
 
   // Master rank will compute scaling factor and then Bcast to world
-  MAIN(update->ntimestep,sampledE);
+  // together with the status of MAIN, so that all ranks fail together
+  int status = MAIN(update->ntimestep,sampledE);
 
   // Gamma(U) = T_0 / T(U)
-  MPI_Bcast(&Gamma, 1, MPI_DOUBLE, 0, world); 
+  if (vol_flag) {
+    double gp[3];
+    if (comm->me == 0) {
+      if (status == STMD_OK) MAIN2(sampledE,sampledV);
+      gp[0] = Gamma;
+      gp[1] = pshift;
+      gp[2] = status;
+    }
+    MPI_Bcast(gp, 3, MPI_DOUBLE, 0, world);
+    Gamma = gp[0];
+    pshift = gp[1];
+    status = static_cast<int> (gp[2]);
+  } else if (!overlap_flag) {
+    double gp[2];
+    gp[0] = Gamma;
+    gp[1] = status;
+    MPI_Bcast(gp, 2, MPI_DOUBLE, 0, world);
+    Gamma = gp[0];
+    status = static_cast<int> (gp[1]);
+  }
+  if (status != STMD_OK) status_error(status);
+
+  // Scale forces, with fix_modify energy only the gradient of the solute
+  // energy: all of the solute force but 1-lambda of the solute-solvent
+  // pairs, and lambda of those pairs on the solvent
+  if (energy_group >= 0) {
+    const double g = Gamma - 1.0;
+    const double w = 1.0 - energy_lambda;
+    for (int i = 0; i < nlocal; i++) {
+      if (mask[i] & energy_bit) {
+        f[i][0] += g * (f[i][0] - w*fcross[i][0]);
+        f[i][1] += g * (f[i][1] - w*fcross[i][1]);
+        f[i][2] += g * (f[i][2] - w*fcross[i][2]);
+      } else {
+        f[i][0] += g * energy_lambda * fcross[i][0];
+        f[i][1] += g * energy_lambda * fcross[i][1];
+        f[i][2] += g * energy_lambda * fcross[i][2];
+      }
+    }
+    return;
+  }
 
   // Scale forces
   for (int i = 0; i < nlocal; i++)
@@ -600,15 +952,38 @@ void FixStmd::post_force(int vflag)
 
 void FixStmd::end_of_step()
 {
+  // Production sampling feeds canonical reweighting
+  // accumulate() invokes collective computes, but STG and the bin are
+  // only authoritative on proc 0, e.g. after a restart, so take those
+  if (nreweight) {
+    int production[2];
+    production[0] = (STG >= 3) ? 1 : 0;
+    production[1] = curbin;
+    MPI_Bcast(production,2,MPI_INT,0,world);
+    if (production[0])
+      for (int i = 0; i < nreweight; i++)
+        ((ComputeStmdReweight *) modify->compute[reweight_list[i]])->
+          accumulate(this,production[1]);
+  }
+
+  // Timestep for the Gamma-scaled forces, then the displacement
+  // estimate at the current effective temperature
+  if (dt_flag && (update->ntimestep % dt_every == 0)) adapt_timestep();
+  adapt_neighbor();
+
   // Force computation of energies on next step
   modify->compute[pe_compute_id]->invoked_flag |= INVOKED_SCALAR;
+  if (mol_flag) modify->compute[mol_compute]->invoked_flag |= INVOKED_PERATOM;
+  if (energy_group >= 0)
+    modify->compute[peatom_compute]->invoked_flag |= INVOKED_PERATOM;
   modify->addstep_compute(update->ntimestep + 1);
 
   // If stmd, write output, otherwise let temper/stmd handle it
-  if (universe->nworlds == 1) {
+  if ((universe->nworlds == 1) || shared_flag) {
     write_temperature();
     write_orest();
   }
+  if (vol_flag) write_temperature2();
 }
 
 /* ---------------------------------------------------------------------- */
@@ -625,10 +1000,194 @@ void FixStmd::min_post_force(int vflag)
 double FixStmd::memory_usage()
 {
   double bytes = 0.0;
-  bytes+= 7 * N * sizeof(double);
+  bytes+= 8 * N * sizeof(double);
+  bytes+= 5 * N * sizeof(double);
+  bytes+= 2 * N * sizeof(double);
+  if (kernel_flag) bytes+= (nkernel+1) * sizeof(double);
+  if (interp_flag) bytes+= 4 * N * sizeof(double);
+  if (vol_flag) bytes+= 2 * N * NV * sizeof(double);
+  if (vol_flag) bytes+= (hist2.size() + hist2f.size()) * 4 * sizeof(int);
+  if (diff_flag) bytes+= (N * (2*diff_band+1) + 2*diff_lag) * sizeof(double);
+  if (mol_flag) bytes+= nwalk * (3*N*sizeof(double) + 3*N*sizeof(int));
+  if (mol_flag) bytes+= nwalk * (3*sizeof(double) + sizeof(MolState));
+  if (mol_flag) bytes+= (molmax+1) * sizeof(int);
+  bytes+= 2 * maxcross * sizeof(int);
+  bytes+= 3 * nmax_cross * sizeof(double);
   return bytes;
 }
 
+/* ----------------------------------------------------------------------
+   2D (E,V) grids, kept across runs unless the grid changed
+   Ts2[iv][iu] = Ts(E,V) scaled like Y2
+   Pi2[iv][iu] = effective barostat pressure, T0 Ps(E,V)/Ts(E,V)
+   starting from the 1D enthalpy weight, Pi = pressref/T2
+------------------------------------------------------------------------- */
+
+void FixStmd::setup_volume()
+{
+  if (!pressflag)
+    error->all(FLERR,"Fix stmd volume requires a barostat");
+
+  const int nv = static_cast<int> (round((Vmax - Vmin) / vbin)) + 1;
+  if (Ts2 && (nv == NV) && (N == N2)) return;
+
+  NV = nv;
+  N2 = N;
+  memory->destroy(Ts2);
+  memory->destroy(Pi2);
+  memory->create(Ts2, NV, N, "FixSTMD:Ts2");
+  memory->create(Pi2, NV, N, "FixSTMD:Pi2");
+  for (int j=0; j<NV; j++)
+    for (int i=0; i<N; i++) {
+      Ts2[j][i] = T2;
+      Pi2[j][i] = MAX(Plo, MIN(Phi, pressref / T2));
+    }
+  hist2.clear();
+  hist2f.clear();
+}
+
+/* ----------------------------------------------------------------------
+   2D analogue of Yval() and GammaE(), on proc 0 only
+   visiting (iu,iv) raises S there by ln f: 1/Ts of the E neighbours and
+   Ps/Ts of the V neighbours change by df as in Yval(), with the same
+   unit convention for f, so Pi changes by nktv2p*df*bin/vbin
+   Gamma is interpolated in E along the row of the sampled volume, Pi
+   in V along the column of the sampled energy; the pressure shift makes
+   compute pressure/stmd present Pi to the barostat as pressref
+------------------------------------------------------------------------- */
+
+void FixStmd::MAIN2(double e, double v)
+{
+  const int iu = MAX(0, MIN(N-1, static_cast<int> (round(e / bin)) - BinMin + 1));
+  const double xv = (v - Vmin) / vbin;
+  const int iv = MAX(0, MIN(NV-1, static_cast<int> (round(xv))));
+
+  hist2[iv*N + iu]++;
+
+  double *ts = Ts2[iv];
+  if (iu+1 < N) {
+    ts[iu+1] = ts[iu+1] / (1.0 - df * ts[iu+1]);
+    if (ts[iu+1] > T2) ts[iu+1] = T2;
+  }
+  if (iu > 0) {
+    ts[iu-1] = ts[iu-1] / (1.0 + df * ts[iu-1]);
+    if (ts[iu-1] < T1) ts[iu-1] = T1;
+  }
+
+  const double dpi = force->nktv2p * df * bin / vbin;
+  if (iv+1 < NV) Pi2[iv+1][iu] = MAX(Plo, Pi2[iv+1][iu] - dpi);
+  if (iv > 0) Pi2[iv-1][iu] = MIN(Phi, Pi2[iv-1][iu] + dpi);
+
+  // Ts linear in E within the row, as in GammaE()
+  const double de = e - double( round(e / double(bin)) * bin );
+  if ((de > 0.0) && (iu+1 < N)) T = ts[iu] + (ts[iu+1] - ts[iu]) / bin * de;
+  else if ((de < 0.0) && (iu > 0)) T = ts[iu] + (ts[iu] - ts[iu-1]) / bin * de;
+  else T = ts[iu];
+  Gamma = 1.0 / T;
+
+  // Pi linear in V within the column
+  const int j = MAX(0, MIN(NV-2, static_cast<int> (floor(xv))));
+  const double t = (NV > 1) ? MAX(0.0, MIN(1.0, xv - j)) : 0.0;
+  const double pi = (NV > 1) ? (1.0-t)*Pi2[j][iu] + t*Pi2[j+1][iu] : Pi2[0][iu];
+  pshift = pi / Gamma - pressref;
+}
+
+/* ----------------------------------------------------------------------
+   write 2D Ts and Pi grids with the sparse histogram to WT2.N.d
+------------------------------------------------------------------------- */
+
+void FixStmd::write_temperature2()
+{
+  int istep = update->ntimestep;
+  int m = istep % RSTFRQ;
+  if ((m == 0) && (comm->me == 0) && fp_wt2) {
+    fprintf(fp_wt2,"### STMD Step %i: ibin jbin E V Ts(E,V) Pi(E,V) H(E,V)\n",istep);
+    std::map<int,int>::const_iterator it;
+    for (int j=0; j<NV; j++)
+      for (int i=0; i<N; i++) {
+        it = hist2.find(j*N + i);
+        fprintf(fp_wt2,"%i %i %f %f %f %f %i\n", i, j, bin_energy(i),
+                Vmin+(j*vbin), Ts2[j][i]*ST, Pi2[j][i],
+                (it == hist2.end()) ? 0 : it->second);
+      }
+    fprintf(fp_wt2,"\n\n");
+    fflush(fp_wt2);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   write 2D grids and histogram to oREST2.<walker>.d, proc 0 only
+   oREST holds STG and f, which belong to these grids in 2D mode
+------------------------------------------------------------------------- */
+
+void FixStmd::write_volume()
+{
+  char filename[256];
+  sprintf(filename,"%s/oREST2.%i.d",dir_output,universe->iworld);
+  FILE *fp = fopen(filename,"w");
+  if (fp == NULL)
+    error->one(FLERR,"Cannot open STMD restart file");
+
+  fprintf(fp,"%d %d %.17g %.17g %.17g\n",NV,N,Vmin,Vmax,vbin);
+  for (int j=0; j<NV; j++) {
+    for (int i=0; i<N; i++)
+      fprintf(fp,"%.15g ",Ts2[j][i]);
+    fprintf(fp,"\n");
+  }
+  for (int j=0; j<NV; j++) {
+    for (int i=0; i<N; i++)
+      fprintf(fp,"%.15g ",Pi2[j][i]);
+    fprintf(fp,"\n");
+  }
+  fprintf(fp,"%d\n",static_cast<int> (hist2.size()));
+  std::map<int,int>::const_iterator it;
+  for (it = hist2.begin(); it != hist2.end(); ++it)
+    fprintf(fp,"%d %d\n",it->first,it->second);
+  fclose(fp);
+}
+
+/* ----------------------------------------------------------------------
+   restore 2D grids and histogram from oREST2.<walker>.d, proc 0 only
+   a missing file keeps the grids of setup_volume(), e.g. when volume
+   was only switched on for the restarted run
+------------------------------------------------------------------------- */
+
+void FixStmd::read_volume()
+{
+  char filename[256];
+  sprintf(filename,"%s/oREST2.%i.d",dir_output,universe->iworld);
+  std::ifstream file(filename);
+  if (!file.good()) {
+    char str[512];
+    sprintf(str,"Fix stmd volume restart file %s not found, "
+            "2D grids start from the enthalpy weight",filename);
+    error->warning(FLERR,str);
+    return;
+  }
+
+  int nv,n;
+  double vlo,vhi,vb;
+  file >> nv >> n >> vlo >> vhi >> vb;
+  if (!file || (nv != NV) || (n != N) || (vlo != Vmin) || (vhi != Vmax) ||
+      (vb != vbin))
+    error->one(FLERR,"Fix stmd volume restart file does not match the grid");
+
+  for (int j=0; j<NV; j++)
+    for (int i=0; i<N; i++) file >> Ts2[j][i];
+  for (int j=0; j<NV; j++)
+    for (int i=0; i<N; i++) file >> Pi2[j][i];
+  int nh;
+  file >> nh;
+  hist2.clear();
+  for (int k=0; file && (k<nh); k++) {
+    int key,count;
+    file >> key >> count;
+    hist2[key] = count;
+  }
+  if (!file)
+    error->one(FLERR,"Fix stmd volume restart file does not match the grid");
+}
+
 /* ----------------------------------------------------------------------
    write temperature to external file
 ------------------------------------------------------------------------- */
@@ -637,10 +1196,21 @@ void FixStmd::write_temperature()
 {
   int istep = update->ntimestep;
   int m = istep % RSTFRQ;
-  if ((m == 0) && (comm->me == 0)) {
+  if ((m == 0) && (comm->me == 0) && !aggregate_flag) {
+    if (mol_flag) {
+      for (int w=0; w<nwalk; w++) {
+        fprintf(fp_wtnm,"### STMD Step %i walker %i molecule " TAGINT_FORMAT
+                ": bin E Ts(E)\n",istep,w,mollist[w]);
+        for (int i=0; i<N; i++)
+          fprintf(fp_wtnm,"%i %f %f\n", i,bin_energy(i),ymol[w][i]*ST);
+        fprintf(fp_wtnm,"\n\n");
+      }
+      fflush(fp_wtnm);
+      return;
+    }
     fprintf(fp_wtnm,"### STMD Step %i: bin E Ts(E)\n",istep);
     for (int i=0; i<N; i++) 
-      fprintf(fp_wtnm,"%i %f %f\n", i,(i*bin)+Emin,Y2[i]*ST);
+      fprintf(fp_wtnm,"%i %f %f\n", i,bin_energy(i),Y2[i]*ST);
     fprintf(fp_wtnm,"\n\n");
     fflush(fp_wtnm);
   }
@@ -654,40 +1224,22 @@ void FixStmd::write_orest()
 {
   // Write restart info to external file
   int m = (update->ntimestep) % RSTFRQ;
-  if ((m == 0) && (comm->me == 0)) {
-    int k = 0;
-    int numb = 13;
-    int nsize = 3*N + numb;
-    double *list;
-    memory->create(list,nsize,"stmd:list");
-
-    list[k++] = STG;
-    list[k++] = f;
-    list[k++] = CountH;
-    list[k++] = SWf;
-    list[k++] = SWfold;
-    list[k++] = SWchk;
-    list[k++] = Count;
-    list[k++] = totCi;
-    list[k++] = CountPH;
 
-    // Control these by LAMMPS input file
-    //list[k++] = TSC1; 
-    //list[k++] = TSC2;
+  // Diffusion statistics also with aggregated output, one file per walker
+  if ((m == 0) && (comm->me == 0) && diff_flag) write_diffusion();
 
-    list[k++] = T1;
-    list[k++] = T2;
+  // 2D grids, oREST below holds STG and f that go with them
+  if ((m == 0) && (comm->me == 0) && vol_flag) write_volume();
 
-    // only used for chk_hist
-    list[k++] = CTmin;
-    list[k++] = CTmax;
+  // All molecule walkers, oREST below holds the first one
+  if ((m == 0) && (comm->me == 0) && mol_flag) write_molecule();
 
-    for (int i=0; i<N; i++) 
-      list[k++] = Y2[i];
-    for (int i=0; i<N; i++) 
-      list[k++] = Htot[i];
-    for (int i=0; i<N; i++) 
-      list[k++] = PROH[i];
+  if ((m == 0) && (comm->me == 0) && !aggregate_flag) {
+    int numb = 13;
+    int nsize = orest_size();
+    double *list;
+    memory->create(list,nsize,"stmd:list");
+    pack_orest(list);
 
     // wipe file contents...
     char filename[256];
@@ -761,429 +1313,1676 @@ void FixStmd::write_orest()
 }
 
 /* ----------------------------------------------------------------------
-   Translation of stmd.f subroutines
+   length of the oREST record
 ------------------------------------------------------------------------- */
 
-void FixStmd::dig()
+int FixStmd::orest_size()
 {
-  int nkeepmin = 0;
-  double keepmin = Y2[nkeepmin];
+  return 3*N + 13;
+}
 
-  for (int i=0; i<N; i++) {
-    if (Y2[i] <= keepmin) {
-      keepmin = Y2[i];
-      nkeepmin = i;
-    }
-  }
+/* ----------------------------------------------------------------------
+   pack the oREST record: 13 counters and limits, then Y2, Htot, PROH
+   only valid on proc 0 of the world
+------------------------------------------------------------------------- */
 
-  for (int i=0; i<nkeepmin; i++) 
-    Y2[i] = keepmin;
+void FixStmd::pack_orest(double *list)
+{
+  int k = 0;
+  list[k++] = STG;
+  list[k++] = f;
+  list[k++] = CountH;
+  list[k++] = SWf;
+  list[k++] = SWfold;
+  list[k++] = SWchk;
+  list[k++] = Count;
+  list[k++] = totCi;
+  list[k++] = CountPH;
+
+  // Control these by LAMMPS input file
+  //list[k++] = TSC1; 
+  //list[k++] = TSC2;
+
+  list[k++] = T1;
+  list[k++] = T2;
+
+  // only used for chk_hist
+  list[k++] = CTmin;
+  list[k++] = CTmax;
+
+  for (int i=0; i<N; i++) 
+    list[k++] = Y2[i];
+  for (int i=0; i<N; i++) 
+    list[k++] = Htot[i];
+  for (int i=0; i<N; i++) 
+    list[k++] = PROH[i];
 }
 
-/* ---------------------------------------------------------------------- */
+/* ----------------------------------------------------------------------
+   restore walker state from an oREST record
+   list is only read on proc 0 of the world, called by all procs
+------------------------------------------------------------------------- */
 
-int FixStmd::Yval(double sampledE)
+void FixStmd::restore_orest(const double *list)
 {
-  curbin = round(sampledE / double(bin)) - BinMin + 1;
-  int i = curbin;
-
-  if ((i<1) || (i>N-1)) {
-    if ((stmd_logfile) && (comm->me == 0))
-      fprintf(logfile,"Error in Yval: pe=%f  bin=%f  i=%i\n",sampledE,bin,i);
-    if ((stmd_screen) && (comm->me == 0))
-      fprintf(screen,"Error in Yval: pe=%f  bin=%f  i=%i\n",sampledE,bin,i);
-    error->all(FLERR,"STMD: Histogram index out of range");
+  if (comm->me == 0) {
+    int k = 0;
+    STG = static_cast<int> (list[k++]);
+    if (!freset_flag)
+      f = list[k];
+    k++;
+    CountH = static_cast<int> (list[k++]);
+    SWf = static_cast<int> (list[k++]);
+    SWfold = static_cast<int> (list[k++]);
+    SWchk = static_cast<int> (list[k++]);
+    Count = static_cast<int> (list[k++]);
+    totCi = static_cast<int> (list[k++]);
+    CountPH = static_cast<int> (list[k++]);
+    //TSC1 = static_cast<int> (list[k++]);
+    //TSC2 = static_cast<int> (list[k++]);
+    T1 = list[k++];
+    T2 = list[k++];
+    CTmin = list[k++];
+    CTmax = list[k++];
+
+    for (int i=0; i<N; i++)
+      Y2[i] = list[k++];
+    for (int i=0; i<N; i++)
+      Htot[i] = static_cast<int> (list[k++]);
+    if (!hist_flag) {
+      for (int i=0; i<N; i++)
+        PROH[i] = static_cast<int> (list[k++]);
+    }
   }
+  if (!freset_flag)
+    df = log(f) * 0.5 / bin;
+  OREST = 0;
+
+  // inv_t switches to ln(f) = N/t when entering STG3
+  invt_flag = ((f_flag == 5) && (STG >= 3)) ? 1 : 0;
+  for (int i=0; i<N; i++) Y2old[i] = Y2[i];
+  ts_changed();
 
-  double Yhi = Y2[i+1];
-  double Ylo = Y2[i-1];
+  // temper/stmd restores after init
+  if (overlap_flag) sync_state();
+}
 
-  Y2[i+1] = Y2[i+1] / (1.0 - df * Y2[i+1]);
-  Y2[i-1] = Y2[i-1] / (1.0 + df * Y2[i-1]);
+/* ----------------------------------------------------------------------
+   with molecule walkers Gamma scales the full force on each molecule,
+   which is the gradient of its energy only if no pair within the force
+   cutoff and no bonded term couples atoms of different owners, see
+   energy_owner(); with fix_modify energy only bonded terms are checked,
+   the solute-solvent pairs are split in solute_energy()
+   pairs removed by neigh_modify exclude are not in the list
+------------------------------------------------------------------------- */
 
-  if (stmd_debug && stmd_logfile) {
-    fprintf(screen,"  STMD T-UPDATE: sampledE= %f  sampledbin= %i  df=%f\n",sampledE,i,df);
-    fprintf(logfile,"  STMD T-UPDATE: sampledE= %f  sampledbin= %i  df=%f\n",sampledE,i,df);
-    fprintf(screen,"    bin %d+1: T'= %f  T=%f  delta= %f\n",i,Y2[i+1],Yhi,Y2[i+1]-Yhi);
-    fprintf(logfile,"    bin %d+1: T'= %f  T=%f  delta= %f\n",i,Y2[i+1],Yhi,Y2[i+1]-Yhi);
-    fprintf(screen,"    bin %d-1: T'=%f  T=%f  delta= %f\n",i,Y2[i-1],Ylo,Y2[i-1]-Ylo);
-    fprintf(logfile,"    bin %d-1: T'=%f  T=%f  delta= %f\n",i,Y2[i-1],Ylo,Y2[i-1]-Ylo);
+void FixStmd::check_interactions()
+{
+  if (!mol_flag && (energy_group < 0)) return;
+
+  double **x = atom->x;
+  int flag = 0;
+
+  if (force->pair && mol_flag) {
+    NeighList *plist = force->pair->list;
+    if (plist == NULL)
+      error->all(FLERR,"Fix stmd molecule requires a pair style with "
+                 "a single neighbor list");
+    const double cutsq = force->pair->cutforce * force->pair->cutforce;
+    for (int ii = 0; (ii < plist->inum) && !flag; ii++) {
+      const int i = plist->ilist[ii];
+      const int *jlist = plist->firstneigh[i];
+      const tagint owner = energy_owner(i);
+      for (int jj = 0; jj < plist->numneigh[i]; jj++) {
+        const int j = jlist[jj] & NEIGHMASK;
+        if (energy_owner(j) == owner) continue;
+        const double dx = x[i][0] - x[j][0];
+        const double dy = x[i][1] - x[j][1];
+        const double dz = x[i][2] - x[j][2];
+        if (dx*dx + dy*dy + dz*dz < cutsq) {
+          flag = 1;
+          break;
+        }
+      }
+    }
   }
 
-  if (Y2[i-1] < T1) 
-    Y2[i-1] = T1;
-  if (Y2[i+1] > T2) 
-    Y2[i+1] = T2;
+  if (atom->molecular) {
+    const int natoms[4] = {2, 3, 4, 4};
+    const int nterm[4] = {neighbor->nbondlist, neighbor->nanglelist,
+                          neighbor->ndihedrallist, neighbor->nimproperlist};
+    int **term[4] = {neighbor->bondlist, neighbor->anglelist,
+                     neighbor->dihedrallist, neighbor->improperlist};
+    for (int k = 0; (k < 4) && !flag; k++)
+      for (int n = 0; (n < nterm[k]) && !flag; n++) {
+        const tagint owner = energy_owner(term[k][n][0]);
+        for (int m = 1; m < natoms[k]; m++)
+          if (energy_owner(term[k][n][m]) != owner) flag = 1;
+      }
+  }
 
-  return i;
+  int any;
+  MPI_Allreduce(&flag,&any,1,MPI_INT,MPI_MAX,world);
+  if (any && mol_flag)
+    error->all(FLERR,"Fix stmd molecule requires non-interacting molecules");
+  if (any)
+    error->all(FLERR,"Fix_modify energy solute is bonded to atoms "
+               "outside its group");
 }
 
-/* ---------------------------------------------------------------------- */
+/* ----------------------------------------------------------------------
+   -1 outside the fix group or the solute, else the molecule ID with
+   molecule walkers and 0 for the solute
+------------------------------------------------------------------------- */
 
-void FixStmd::GammaE(double sampledE, int indx)
+tagint FixStmd::energy_owner(int i)
 {
-  const int i  = indx;
-  const int im = indx - 1;
-  const int ip = indx + 1;
-
-  const double e = sampledE - double( round(sampledE / double(bin)) * bin );
-
-  //double T;  // made this public to share with RESTMD
-  if (e > 0.0) {
-    const double lam = (Y2[ip] - Y2[i]) / double(bin);
-    T = Y2[i] + lam * e;
-  } else if (e < 0.0) {
-    const double lam = (Y2[i] - Y2[im]) / double(bin);
-    T = Y2[i] + lam * e;
-  } else T = Y2[i];
-
-  Gamma = 1.0 / T;
+  if (mol_flag)
+    return (atom->mask[i] & groupbit) ? atom->molecule[i] : -1;
+  return (atom->mask[i] & energy_bit) ? 0 : -1;
 }
 
 /* ---------------------------------------------------------------------- */
 
-void FixStmd::AddedEHis(int i)
+void FixStmd::init_list(int id, NeighList *ptr)
 {
-  Hist[i] = Hist[i] + 1;
-  Htot[i] = Htot[i] + 1;
+  list = ptr;
 }
 
-/* ---------------------------------------------------------------------- */
+/* ----------------------------------------------------------------------
+   solute-solvent pairs of my half list, j keeps its special bits
+   the list only changes on reneighboring
+------------------------------------------------------------------------- */
 
-void FixStmd::EPROB(int icycle)
+void FixStmd::build_cross()
 {
-  int sw, m;
-  const int indx = icycle;
-  m = indx % TSC1;
-  if ((m == 0) && (indx != 0)) sw = 1;
-
-  m = indx % TSC2;
-  if ((m == 0) && (indx != 0)) sw = 2;
+  int *mask = atom->mask;
 
-  if (sw == 1) 
-    for (int i=0; i<N; i++) 
-      Prob[i] = Prob[i] / double(TSC1);
-  else if (sw == 2)
-    for (int i=0; i<N; i++) 
-      Prob[i] = Prob[i] / double(TSC2);
-  sw = 0;
+  ncross = 0;
+  for (int ii = 0; ii < list->inum; ii++) {
+    const int i = list->ilist[ii];
+    const int *jlist = list->firstneigh[i];
+    const int isolute = (mask[i] & energy_bit) ? 1 : 0;
+    for (int jj = 0; jj < list->numneigh[i]; jj++) {
+      const int j = jlist[jj];
+      const int jsolute = (mask[j & NEIGHMASK] & energy_bit) ? 1 : 0;
+      if (isolute == jsolute) continue;
+      if (ncross == maxcross) {
+        maxcross += 1024;
+        memory->grow(cross,maxcross,2,"stmd:cross");
+      }
+      cross[ncross][0] = i;
+      cross[ncross][1] = j;
+      ncross++;
+    }
+  }
 }
 
-/* ---------------------------------------------------------------------- */
+/* ----------------------------------------------------------------------
+   REST2-style solute energy E_ss + lambda E_sw
+   pe/atom of the solute holds the solute-solute terms and half of each
+   solute-solvent pair, the cross pairs from Pair::single() supply the
+   rest; their force on each atom goes to fcross for post_force()
+------------------------------------------------------------------------- */
 
-void FixStmd::ResetPH()
+double FixStmd::solute_energy()
 {
-  for (int i=0; i<N; i++) Hist[i] = 0;
+  double **x = atom->x;
+  int *type = atom->type;
+  int *mask = atom->mask;
+  int nlocal = atom->nlocal;
+  int nall = nlocal + atom->nghost;
+  int newton_pair = force->newton_pair;
+  double *special_lj = force->special_lj;
+  double *special_coul = force->special_coul;
+  Pair *pair = force->pair;
+  double **cutsq = pair->cutsq;
+
+  if (atom->nmax > nmax_cross) {
+    memory->destroy(fcross);
+    nmax_cross = atom->nmax;
+    memory->create(fcross,nmax_cross,3,"stmd:fcross");
+  }
+  const int nclear = newton_pair ? nall : nlocal;
+  for (int i = 0; i < nclear; i++)
+    fcross[i][0] = fcross[i][1] = fcross[i][2] = 0.0;
+
+  // with newton off, pairs with a ghost are seen by both procs
+  double one[2] = {0.0, 0.0};
+  for (int m = 0; m < ncross; m++) {
+    const int i = cross[m][0];
+    int j = cross[m][1];
+    const double factor_lj = special_lj[sbmask(j)];
+    const double factor_coul = special_coul[sbmask(j)];
+    j &= NEIGHMASK;
+
+    const double delx = x[i][0] - x[j][0];
+    const double dely = x[i][1] - x[j][1];
+    const double delz = x[i][2] - x[j][2];
+    const double rsq = delx*delx + dely*dely + delz*delz;
+    const int itype = type[i];
+    const int jtype = type[j];
+    if (rsq >= cutsq[itype][jtype]) continue;
+
+    double fpair;
+    const double eng = pair->single(i,j,itype,jtype,rsq,factor_coul,
+                                    factor_lj,fpair);
+    fcross[i][0] += delx*fpair;
+    fcross[i][1] += dely*fpair;
+    fcross[i][2] += delz*fpair;
+    if (newton_pair || (j < nlocal)) {
+      fcross[j][0] -= delx*fpair;
+      fcross[j][1] -= dely*fpair;
+      fcross[j][2] -= delz*fpair;
+      one[1] += eng;
+    } else one[1] += 0.5*eng;
+  }
+  if (newton_pair) comm->reverse_comm_fix(this);
+
+  // invoked_flag is only cleared on output steps, so always recompute
+  Compute *c = modify->compute[peatom_compute];
+  c->compute_peratom();
+  c->invoked_flag |= INVOKED_PERATOM;
+  double *eatom = c->vector_atom;
+  for (int i = 0; i < nlocal; i++)
+    if (mask[i] & energy_bit) one[0] += eatom[i];
+
+  double all[2];
+  MPI_Allreduce(one,all,2,MPI_DOUBLE,MPI_SUM,world);
+  return all[0] + (energy_lambda - 0.5) * all[1];
 }
 
 /* ---------------------------------------------------------------------- */
 
-void FixStmd::TCHK()
+int FixStmd::pack_reverse_comm(int n, int first, double *buf)
 {
-  if ((stmd_logfile) && (stmd_debug)) {
-    fprintf(logfile,"  STMD TCHK: T1= %f (%f K)  Y2[0]= %f (%f K)\n",T1,T1*ST,Y2[0],Y2[0]*ST);
-    fprintf(screen,"  STMD TCHK: T1= %f (%f K)  Y2[0]= %f (%f K)\n",T1,T1*ST,Y2[0],Y2[0]*ST);
+  int m = 0;
+  int last = first + n;
+  for (int i = first; i < last; i++) {
+    buf[m++] = fcross[i][0];
+    buf[m++] = fcross[i][1];
+    buf[m++] = fcross[i][2];
   }
-  if (Y2[0] == T1) STG = 2;
+  return m;
 }
 
 /* ---------------------------------------------------------------------- */
 
-void FixStmd::HCHK()
+void FixStmd::unpack_reverse_comm(int n, int *list, double *buf)
 {
-  SWfold = SWf;
-
-  int ichk = 0;
-  int icnt = 0;
-  double aveH = 0.0;
-
-  // check CTmin and CTmax
-  // average histogram
-  for (int i=0; i<N; i++) {
-    if ((Y2[i] > CTmin) && (Y2[i] < CTmax)) {
-      aveH = aveH + double(Hist[i]);
-      icnt++;
-    }
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    const int j = list[i];
+    fcross[j][0] += buf[m++];
+    fcross[j][1] += buf[m++];
+    fcross[j][2] += buf[m++];
   }
+}
 
-  if ((stmd_logfile) && (stmd_debug)) {
-    fprintf(logfile,"  STMD CHK HIST: icnt= %i  aveH= %f  N= %i\n",icnt,aveH,N);
-    fprintf(screen,"  STMD CHK HIST: icnt= %i  aveH= %f  N= %i\n",icnt,aveH,N);
-  }
-  if (icnt==0) return;
+/* ----------------------------------------------------------------------
+   choose dt as fix dt/reset does, from the forces after Gamma scaling,
+   so that no atom of the group moves further than dt_xmax in one step
+   Ts, histograms, output and RESTMD exchanges all count steps, so only
+   the physical time per step changes
+------------------------------------------------------------------------- */
 
-  aveH = aveH / double(icnt);
+void FixStmd::adapt_timestep()
+{
+  double **v = atom->v;
+  double **f = atom->f;
+  double *rmass = atom->rmass;
+  double *mass = atom->mass;
+  int *type = atom->type;
+  int *mask = atom->mask;
+  int nlocal = atom->nlocal;
+  const double ftm2v = force->ftm2v;
 
-  double eval;
-  for (int i=0; i<N; i++) {
-    if ((Y2[i] > CTmin) && (Y2[i] < CTmax) ) {
-      eval = abs(double(Hist[i] - aveH) / aveH);
-      if (eval > HCKtol) ichk++;
-      if ((stmd_logfile) && (stmd_debug)) {
-        fprintf(logfile,"  STMD CHK HIST: totCi= %i  i= %i  eval= %f  HCKtol= %f  " 
-            "ichk= %i  Hist[i]= %i\n",totCi,i,eval,HCKtol,ichk,Hist[i]);
-        fprintf(screen,"  STMD CHK HIST: totCi= %i  i= %i  eval= %f  HCKtol= %f  " 
-            "ichk= %i  Hist[i]= %i\n",totCi,i,eval,HCKtol,ichk,Hist[i]);
-      }
+  double dtmin = BIG;
+  for (int i = 0; i < nlocal; i++)
+    if (mask[i] & groupbit) {
+      const double massinv = rmass ? 1.0/rmass[i] : 1.0/mass[type[i]];
+      const double vsq = v[i][0]*v[i][0] + v[i][1]*v[i][1] + v[i][2]*v[i][2];
+      const double fsq = f[i][0]*f[i][0] + f[i][1]*f[i][1] + f[i][2]*f[i][2];
+      double dtv = BIG;
+      double dtf = BIG;
+      if (vsq > 0.0) dtv = dt_xmax/sqrt(vsq);
+      if (fsq > 0.0) dtf = sqrt(2.0*dt_xmax/(ftm2v*sqrt(fsq)*massinv));
+      double dt = MIN(dtv,dtf);
+      const double dtsq = dt*dt;
+      const double delx = dt*v[i][0] + 0.5*dtsq*massinv*f[i][0]*ftm2v;
+      const double dely = dt*v[i][1] + 0.5*dtsq*massinv*f[i][1]*ftm2v;
+      const double delz = dt*v[i][2] + 0.5*dtsq*massinv*f[i][2]*ftm2v;
+      const double delr = sqrt(delx*delx + dely*dely + delz*delz);
+      if (delr > dt_xmax) dt *= dt_xmax/delr;
+      dtmin = MIN(dtmin,dt);
     }
-  }
 
-  if (ichk < 1) SWf = SWf + 1;
+  double dt;
+  MPI_Allreduce(&dtmin,&dt,1,MPI_DOUBLE,MPI_MIN,world);
+  dt = MAX(dt,dt_min);
+  dt = MIN(dt,dt_max);
+  if (dt == update->dt) return;
+
+  // same bookkeeping as fix dt/reset
+  update->update_time();
+  update->dt = dt;
+  if (strstr(update->integrate_style,"respa"))
+    update->integrate->reset_dt();
+  if (force->pair) force->pair->reset_dt();
+  for (int i = 0; i < modify->nfix; i++) modify->fix[i]->reset_dt();
 }
 
-/* ---------------------------------------------------------------------- */
+/* ----------------------------------------------------------------------
+   with neigh_adapt, bound the displacement of any atom from the largest
+   speed and acceleration measured after Gamma scaling,
+   d(n) = vmax n dt + amax (n dt)^2 / 2, published per step as neigh_disp,
+   and space the displacement checks so that d(n) stays below
+   neigh_safety times skin/2
+------------------------------------------------------------------------- */
 
-void FixStmd::MAIN(int istep, double sampledE)
+void FixStmd::adapt_neighbor()
 {
-  Count = istep;
-  totCi++;
+  if (!neigh_flag) return;
 
-  if (STG >= 3) CountPH++;
+  double **v = atom->v;
+  double **f = atom->f;
+  double *rmass = atom->rmass;
+  double *mass = atom->mass;
+  int *type = atom->type;
+  int nlocal = atom->nlocal;
 
-  if ((stmd_logfile) && (stmd_debug)) {
-    fprintf(logfile,"STMD DEBUG: STAGE %i\n",STG);
-    fprintf(screen,"STMD DEBUG: STAGE %i\n",STG);
-    fprintf(logfile,"  STMD: Count=%i, f=%f\n",Count,f);
-    fprintf(screen,"  STMD: Count=%i, f=%f\n",Count,f);
+  double one[2] = {0.0, 0.0};
+  for (int i = 0; i < nlocal; i++) {
+    const double massinv = rmass ? 1.0/rmass[i] : 1.0/mass[type[i]];
+    const double vsq = v[i][0]*v[i][0] + v[i][1]*v[i][1] + v[i][2]*v[i][2];
+    const double fsq = f[i][0]*f[i][0] + f[i][1]*f[i][1] + f[i][2]*f[i][2];
+    one[0] = MAX(one[0],vsq);
+    one[1] = MAX(one[1],fsq*massinv*massinv);
   }
+  double all[2];
+  MPI_Allreduce(one,all,2,MPI_DOUBLE,MPI_MAX,world);
+
+  const double dt = update->dt;
+  const double vmax = sqrt(all[0]);
+  const double amax = force->ftm2v * sqrt(all[1]);
+  neigh_disp = vmax*dt + 0.5*amax*dt*dt;
+
+  const double dmax = neigh_safety * 0.5 * neighbor->skin;
+  double steps = neigh_max;
+  if (amax > 0.0)
+    steps = (sqrt(vmax*vmax + 2.0*amax*dmax) - vmax) / (amax*dt);
+  else if (vmax > 0.0)
+    steps = dmax / (vmax*dt);
+
+  int n = neigh_max;
+  if (steps < neigh_max) n = MAX(neigh_min,static_cast<int> (steps));
+  neighbor->every = n;
+}
 
-  // Statistical Temperature Update
-  int stmdi = Yval(sampledE);
+/* ----------------------------------------------------------------------
+   hand the rebuild settings back once neigh_adapt is switched off
+------------------------------------------------------------------------- */
+
+void FixStmd::restore_neighbor()
+{
+  if (!neigh_saved) return;
+  neighbor->every = neigh_every0;
+  neighbor->delay = neigh_delay0;
+  neigh_saved = 0;
+}
 
-  // Gamma Update
-  GammaE(sampledE,stmdi);
+/* ----------------------------------------------------------------------
+   copy the STMD state of proc 0 to all procs of the world, so that MAIN
+   advances identically everywhere and Gamma can be used without a Bcast
+------------------------------------------------------------------------- */
 
-  if ((stmd_logfile) && (stmd_debug)) {
-    fprintf(logfile,"  STMD: totCi= %i Gamma= %f Hist[%i]= %i "
-        "T= %f\n",totCi,Gamma,stmdi,Hist[stmdi],T);
-    fprintf(screen,"  STMD: totCi= %i Gamma= %f Hist[%i]= %i "
-        "T= %f\n",totCi,Gamma,stmdi,Hist[stmdi],T);
+void FixStmd::sync_state()
+{
+  int ivalues[11];
+  double dvalues[8];
+  if (comm->me == 0) {
+    ivalues[0] = STG;
+    ivalues[1] = Count;
+    ivalues[2] = CountH;
+    ivalues[3] = CountPH;
+    ivalues[4] = totC;
+    ivalues[5] = totCi;
+    ivalues[6] = SWf;
+    ivalues[7] = SWchk;
+    ivalues[8] = SWfold;
+    ivalues[9] = invt_flag;
+    ivalues[10] = curbin;
+    dvalues[0] = f;
+    dvalues[1] = df;
+    dvalues[2] = T;
+    dvalues[3] = T1;
+    dvalues[4] = T2;
+    dvalues[5] = CTmin;
+    dvalues[6] = CTmax;
+    dvalues[7] = ts_change;
   }
+  MPI_Bcast(ivalues,11,MPI_INT,0,world);
+  MPI_Bcast(dvalues,8,MPI_DOUBLE,0,world);
+  MPI_Bcast(Y2,N,MPI_DOUBLE,0,world);
+  MPI_Bcast(Y2old,N,MPI_DOUBLE,0,world);
+  MPI_Bcast(Prob,N,MPI_DOUBLE,0,world);
+  MPI_Bcast(Hist,N,MPI_INT,0,world);
+  MPI_Bcast(Htot,N,MPI_INT,0,world);
+  MPI_Bcast(PROH,N,MPI_INT,0,world);
+  if (comm->me != 0) {
+    STG = ivalues[0];
+    Count = ivalues[1];
+    CountH = ivalues[2];
+    CountPH = ivalues[3];
+    totC = ivalues[4];
+    totCi = ivalues[5];
+    SWf = ivalues[6];
+    SWchk = ivalues[7];
+    SWfold = ivalues[8];
+    invt_flag = ivalues[9];
+    curbin = ivalues[10];
+    f = dvalues[0];
+    df = dvalues[1];
+    T = dvalues[2];
+    T1 = dvalues[3];
+    T2 = dvalues[4];
+    CTmin = dvalues[5];
+    CTmax = dvalues[6];
+    ts_change = dvalues[7];
+    ts_changed();
+  }
+}
 
-  // Histogram Update
-  AddedEHis(stmdi);
-  CountH++;
+/* ----------------------------------------------------------------------
+   allocate and clear the energy-space diffusion statistics
+   like the histograms they start over with every run unless restarted
+------------------------------------------------------------------------- */
 
-  // Add to Histogram for production run
-  if (STG >= 3) {
-    PROH[stmdi]++;
-    CountPH++;
+void FixStmd::setup_diffusion()
+{
+  memory->destroy(trans);
+  memory->destroy(ac_buf);
+  memory->destroy(ac_sum);
+  memory->create(trans, N, 2*diff_band+1, "FixSTMD:trans");
+  if (diff_lag > 0) {
+    memory->create(ac_buf, diff_lag, "FixSTMD:ac_buf");
+    memory->create(ac_sum, diff_lag, "FixSTMD:ac_sum");
   }
 
-  // Hist Output
-  int o = istep % RSTFRQ;
-  if ((o == 0) && (comm->me == 0)) {
-    fprintf(fp_whnm,"### STMD Step=%d: bin E hist thist phist\n",istep);
-    for (int i=0; i<N; i++) 
-      fprintf(fp_whnm,"%i %f %i %i %i\n",i,(i*bin)+Emin,Hist[i],Htot[i],PROH[i]);
-    fprintf(fp_whnm,"\n\n");
-  }
-  
-  // Production Run if STG >= 3
-  // STG3 START: Check histogram and further reduce f until cutoff
-  if (STG >= 3) {
-    int m = istep % TSC2;
-
-    // STMD, reduce f based on histogram flatness (original form)
-    if (m == 0) {
-      if ((stmd_logfile) && (stmd_debug)) {
-        fprintf(logfile,"  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
-        fprintf(screen,"  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
-      }
+  for (int i=0; i<N; i++)
+    for (int j=0; j<2*diff_band+1; j++) trans[i][j] = 0.0;
+  for (int k=0; k<diff_lag; k++) ac_buf[k] = ac_sum[k] = 0.0;
+
+  diff_prev = -1;
+  diff_end = 0;
+  diff_end_step = 0;
+  diff_npass[0] = diff_npass[1] = 0;
+  diff_tpass[0] = diff_tpass[1] = 0.0;
+  diff_ntrans = diff_far = 0;
+  ac_n = 0;
+  ac_e0 = ac_s1 = 0.0;
+}
 
-      // Reduction based on histogram flatness
-      if (f_flag == 1) { 
-        HCHK(); // Check flatness
-        if ((stmd_logfile) && (stmd_debug)) {
-          fprintf(logfile,"  STMD: SWfold= %i  SWf= %i\n",SWfold,SWf);
-          fprintf(logfile,"  STMD: f= %f  SWchk= %i\n",f,SWchk);
-          fprintf(screen,"  STMD: SWfold= %i  SWf= %i\n",SWfold,SWf);
-          fprintf(screen,"  STMD: f= %f  SWchk= %i\n",f,SWchk);
-        }
-        if (SWfold != SWf) {
-          if (STG == 3) // dont reduce if STG4
-            f = sqrt(f); // reduce f
-          df = log(f) * 0.5 / bin;
-          if ((stmd_logfile) && (stmd_debug)) {
-            fprintf(logfile,"  STMD f-UPDATE: f= %f  SWf= %i  df= %f\n",f,SWf,df);
-            fprintf(screen,"  STMD f-UPDATE: f= %f  SWf= %i  df= %f\n",f,SWf,df);
-          }
-          SWchk = 1;
-          // Histogram reset
-          ResetPH();
-          CountH = 0;
-        } 
-        else {
-          SWchk++;
-          if ((stmd_logfile) && (stmd_debug)) {
-            fprintf(logfile,"  STMD: f= %f  Swchk= %i T= %f\n",f,SWchk,T);
-            fprintf(screen,"  STMD: f= %f  Swchk= %i T= %f\n",f,SWchk,T);
-          }
-        }
-      } // if (f_flag == 1)
+/* ----------------------------------------------------------------------
+   add the sample of this step to the diffusion statistics
+   the window ends are the bins with Ts at or beyond CTmin and CTmax,
+   the cutoffs of the flatness check; they are only meaningful once
+   dig has pulled Ts down to T1, so passages are counted from STG2
+------------------------------------------------------------------------- */
 
-      if (f_flag > 1) {
-        if ((stmd_logfile) && (stmd_debug)) {
-          fprintf(logfile,"  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
-          fprintf(screen,"  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
-        }
-        if (STG == 3) // dont reduce if STG4
-          f = sqrt(f);
-        df = log(f) * 0.5 / bin;
-        if ((stmd_logfile) && (stmd_debug)) {
-          fprintf(logfile,"  STMD f-UPDATE: f= %f  df= %f\n",f,df);
-          fprintf(screen,"  STMD f-UPDATE: f= %f  df= %f\n",f,df);
-        }
-      
-        // Histogram reset
-        ResetPH();
-        CountH = 0;
-      } // if (f_flag > 1)
-
-      // Check stage 3
-      if (f <= finFval) STG = 4;
-
-      /*
-      // Production run: Hist Output STMD
-      if ((o == 0) && (comm->me == 0)) {
-      fprintf(fp_whpnm,"### STMD Step=%d: bin E phist tot_hist\n",istep);
-        for (int i=0; i<N; i++)
-          fprintf(fp_whpnm,"%i %f %i %i\n", i, (i*bin)+Emin,PROH[i],Htot[i]);
-        fprintf(fp_whpnm,"\n\n");
-      }
-      */
-    } // if ((m == 0)
-  } // if (STG >= 3)
-
-  // STG2 START: Check histogram and modify f value on STG2
-  // If STMD, run until histogram is flat, then reduce f value 
-  // else if RESTMD, reduce every TSC2 steps
-  if (STG == 2) {
-
-    int m = istep % TSC2;
-    if (m == 0) {
-      if ((stmd_logfile) && (stmd_debug)) {
-        fprintf(logfile,"  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
-        fprintf(screen,"  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
+void FixStmd::tally_diffusion(int istep, int i, double e)
+{
+  // Banded transition matrix, longer jumps are only counted
+  if (diff_prev >= 0) {
+    int d = i - diff_prev;
+    if ((d >= -diff_band) && (d <= diff_band))
+      trans[diff_prev][d+diff_band] += 1.0;
+    else diff_far++;
+    diff_ntrans++;
+  }
+  diff_prev = i;
+
+  // First passage times between the low and the high end
+  if (STG >= 2) {
+    int end = 0;
+    if (Y2[i] <= CTmin) end = -1;
+    else if (Y2[i] >= CTmax) end = 1;
+    if (end && (end != diff_end)) {
+      if (diff_end) {
+        int k = (end > 0) ? 0 : 1;
+        diff_tpass[k] += double(istep - diff_end_step);
+        diff_npass[k]++;
       }
+      diff_end = end;
+      diff_end_step = istep;
+    }
+  }
 
-      // No f-reduction, simulate at initf only!
-      if (f_flag == 0) { 
-        ResetPH();
-        CountH = 0;
-      }
+  // Running sums of E(t) E(t-k), shifted by the first energy
+  if (diff_lag > 0) {
+    if (ac_n == 0) ac_e0 = e;
+    double x = e - ac_e0;
+    int j = ac_n % diff_lag;
+    ac_buf[j] = x;
+    int kmax = (ac_n < diff_lag) ? static_cast<int> (ac_n) : diff_lag-1;
+    for (int k=0; k<=kmax; k++) {
+      int jk = j - k;
+      if (jk < 0) jk += diff_lag;
+      ac_sum[k] += x * ac_buf[jk];
+    }
+    ac_s1 += x;
+    ac_n++;
+  }
+}
 
-      // Standard f-reduction as HCHK() every m steps
-      if (f_flag == 1) { 
-        HCHK();
-        if ((stmd_logfile) && (stmd_debug)) {
-          fprintf(logfile,"  STMD: SWfold= %i SWf= %i\n",SWfold,SWf);
-          fprintf(screen,"  STMD: SWfold= %i SWf= %i\n",SWfold,SWf);
-        }
-        // f value update
-        if (SWfold != SWf) {
-          f = sqrt(f);
-          df = log(f) * 0.5 / bin;
-          if ((stmd_logfile) && (stmd_debug)) {
-            fprintf(logfile,"  STMD f-UPDATE: f= %f  SWf= %i  df= %f\n",f,SWf,df);
-            fprintf(screen,"  STMD f-UPDATE: f= %f  SWf= %i  df= %f\n",f,SWf,df);
-          }
-          SWchk = 1;
-          ResetPH();
-          CountH = 0;
-        }
-        else SWchk++;
+/* ----------------------------------------------------------------------
+   summary of the diffusion statistics, only valid on proc 0
+   0 = integrated autocorrelation time of E in steps, window 6 tau
+   1,2 = mean first passage time low->high and high->low in steps
+   3 = mean round-trip time, 4 = number of completed round trips
+   5 = transitions recorded, 6 = fraction longer than the band
+   7 = diffusion coefficient in bins^2/step from transitions in the band
+------------------------------------------------------------------------- */
 
-        if ((stmd_logfile) && (stmd_debug)) {
-          fprintf(logfile,"  STMD RESULTS: totCi= %i  f= %f  SWf= %i  SWchk= %i  "
-              "STG= %i\n",totCi,f,SWf,SWchk,STG);
-          fprintf(screen,"  STMD RESULTS: totCi= %i  f= %f  SWf= %i  SWchk= %i  "
-              "STG= %i\n",totCi,f,SWf,SWchk,STG);
-        }
-        if (f <= pfinFval) {
-          STG = 3;
-          CountPH = 0;
-          SWchk = 1;
-          ResetPH();
-          CountH = 0;
-        }
-      } // if (f_flag == 1)
+void FixStmd::diffusion_vector(double *v)
+{
+  for (int k=0; k<8; k++) v[k] = 0.0;
+  if (!diff_flag || (trans == NULL)) return;
+
+  if ((diff_lag > 1) && (ac_n > 1)) {
+    double mean = ac_s1 / double(ac_n);
+    double var = ac_sum[0] / double(ac_n) - mean*mean;
+    if (var > 0.0) {
+      double tau = 0.5;
+      for (int k=1; (k<diff_lag) && (k<ac_n); k++) {
+        tau += (ac_sum[k] / double(ac_n-k) - mean*mean) / var;
+        if (k >= 6.0*tau) break;
+      }
+      v[0] = tau;
+    }
+  }
+
+  if (diff_npass[0]) v[1] = diff_tpass[0] / double(diff_npass[0]);
+  if (diff_npass[1]) v[2] = diff_tpass[1] / double(diff_npass[1]);
+  if (diff_npass[0] && diff_npass[1]) v[3] = v[1] + v[2];
+  v[4] = static_cast<double> (MIN(diff_npass[0],diff_npass[1]));
+  v[5] = static_cast<double> (diff_ntrans);
+  if (diff_ntrans) v[6] = double(diff_far) / double(diff_ntrans);
+
+  double cnt = 0.0, msd = 0.0;
+  for (int i=0; i<N; i++)
+    for (int d=-diff_band; d<=diff_band; d++) {
+      cnt += trans[i][d+diff_band];
+      msd += double(d*d) * trans[i][d+diff_band];
+    }
+  if (cnt > 0.0) v[7] = 0.5 * msd / cnt;
+}
+
+/* ----------------------------------------------------------------------
+   per-bin transitions, only valid on proc 0, N rows with columns
+   0 = binned energy, 1 = transitions out of the bin,
+   2 = local diffusion coefficient in bins^2/step,
+   3 ... = counts of jumps by -band ... +band bins
+------------------------------------------------------------------------- */
+
+void FixStmd::diffusion_array(double **a)
+{
+  for (int i=0; i<N; i++) {
+    double cnt = 0.0, msd = 0.0;
+    for (int d=-diff_band; d<=diff_band; d++) {
+      double c = trans ? trans[i][d+diff_band] : 0.0;
+      cnt += c;
+      msd += double(d*d) * c;
+      a[i][3+d+diff_band] = c;
+    }
+    a[i][0] = bin_energy(i);
+    a[i][1] = cnt;
+    a[i][2] = (cnt > 0.0) ? 0.5 * msd / cnt : 0.0;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   write diffusion statistics to oDIFF.<walker>.d, oREST is left as is
+------------------------------------------------------------------------- */
+
+void FixStmd::write_diffusion()
+{
+  char filename[256];
+  sprintf(filename,"%s/oDIFF.%i.d",dir_output,universe->iworld);
+  FILE *fp = fopen(filename,"w");
+  if (fp == NULL)
+    error->one(FLERR,"Cannot open STMD restart file");
+
+  fprintf(fp,"%d %d %d\n",N,diff_band,diff_lag);
+  fprintf(fp,"%d %d " BIGINT_FORMAT " " BIGINT_FORMAT " " BIGINT_FORMAT
+          " " BIGINT_FORMAT " " BIGINT_FORMAT " " BIGINT_FORMAT "\n",
+          diff_prev,diff_end,diff_end_step,diff_npass[0],diff_npass[1],
+          diff_ntrans,diff_far,ac_n);
+  fprintf(fp,"%.15g %.15g %.15g %.15g\n",
+          diff_tpass[0],diff_tpass[1],ac_e0,ac_s1);
+  for (int i=0; i<N; i++) {
+    for (int j=0; j<2*diff_band+1; j++)
+      fprintf(fp,"%.15g ",trans[i][j]);
+    fprintf(fp,"\n");
+  }
+  for (int k=0; k<diff_lag; k++)
+    fprintf(fp,"%.15g ",ac_buf[k]);
+  fprintf(fp,"\n");
+  for (int k=0; k<diff_lag; k++)
+    fprintf(fp,"%.15g ",ac_sum[k]);
+  fprintf(fp,"\n");
+  fclose(fp);
+}
+
+/* ----------------------------------------------------------------------
+   restore diffusion statistics from oDIFF.<walker>.d, proc 0 only
+   a missing file leaves them empty, e.g. when diffusion was only
+   switched on for the restarted run
+------------------------------------------------------------------------- */
+
+void FixStmd::read_diffusion()
+{
+  char filename[256];
+  sprintf(filename,"%s/oDIFF.%i.d",dir_output,universe->iworld);
+  std::ifstream file(filename);
+  if (!file.good()) {
+    char str[512];
+    sprintf(str,"Fix stmd diffusion restart file %s not found, "
+            "statistics start empty",filename);
+    error->warning(FLERR,str);
+    return;
+  }
+
+  int n,band,lag;
+  file >> n >> band >> lag;
+  if (!file || (n != N) || (band != diff_band) || (lag != diff_lag))
+    error->one(FLERR,"Fix stmd diffusion restart file does not match the bins");
+
+  file >> diff_prev >> diff_end >> diff_end_step >> diff_npass[0]
+       >> diff_npass[1] >> diff_ntrans >> diff_far >> ac_n;
+  file >> diff_tpass[0] >> diff_tpass[1] >> ac_e0 >> ac_s1;
+  for (int i=0; i<N; i++)
+    for (int j=0; j<2*diff_band+1; j++) file >> trans[i][j];
+  for (int k=0; k<diff_lag; k++) file >> ac_buf[k];
+  for (int k=0; k<diff_lag; k++) file >> ac_sum[k];
+  if (!file)
+    error->one(FLERR,"Fix stmd diffusion restart file does not match the bins");
+}
+
+/* ----------------------------------------------------------------------
+   one walker per molecule of the group, in order of the molecule IDs
+   Ts, histograms and counters of all walkers live in walker x bin
+   arrays; MAIN runs on them by pointing the fix state at one walker
+------------------------------------------------------------------------- */
+
+void FixStmd::setup_molecule(int restart)
+{
+  mol_compute = modify->find_compute(id_mol);
+  if (mol_compute < 0)
+    error->all(FLERR,"Fix stmd molecule compute ID does not exist");
+  Compute *c = modify->compute[mol_compute];
+  if (!c->peratom_flag || c->size_peratom_cols)
+    error->all(FLERR,"Fix stmd molecule compute does not calculate "
+               "a per-atom vector");
+  if (vol_flag || shared_flag || overlap_flag || diff_flag ||
+      (energy_group >= 0) ||
+      interp_flag || dt_flag || neigh_flag)
+    error->all(FLERR,"Fix_modify molecule cannot be combined with this option");
+  if (pressflag)
+    error->all(FLERR,"Fix stmd molecule cannot be used with a barostat");
+  if (force->kspace)
+    error->all(FLERR,"Fix stmd molecule cannot be used with kspace");
+
+  int *mask = atom->mask;
+  tagint *molecule = atom->molecule;
+  int nlocal = atom->nlocal;
+
+  int flag = atom->molecule_flag ? 0 : 1;
+  tagint mlocal = 0;
+  for (int i=0; !flag && (i<nlocal); i++)
+    if (mask[i] & groupbit) {
+      if (molecule[i] <= 0) flag = 1;
+      mlocal = MAX(mlocal,molecule[i]);
+    }
+  int flagall;
+  MPI_Allreduce(&flag,&flagall,1,MPI_INT,MPI_MAX,world);
+  if (flagall)
+    error->all(FLERR,"Fix stmd molecule requires molecule IDs in the fix group");
+  tagint mmax;
+  MPI_Allreduce(&mlocal,&mmax,1,MPI_LMP_TAGINT,MPI_MAX,world);
+  molmax = static_cast<int> (mmax);
+
+  // compress the molecule IDs present in the group to walker indices
+  int *mine;
+  memory->create(mine,molmax+1,"FixSTMD:mine");
+  for (int m=0; m<=molmax; m++) mine[m] = 0;
+  for (int i=0; i<nlocal; i++)
+    if (mask[i] & groupbit) mine[molecule[i]] = 1;
+  memory->destroy(molmap);
+  memory->create(molmap,molmax+1,"FixSTMD:molmap");
+  MPI_Allreduce(mine,molmap,molmax+1,MPI_INT,MPI_MAX,world);
+  memory->destroy(mine);
+
+  nwalk = 0;
+  for (int m=0; m<=molmax; m++)
+    molmap[m] = molmap[m] ? nwalk++ : -1;
+  if (nwalk == 0)
+    error->all(FLERR,"Fix stmd molecule requires molecule IDs in the fix group");
+  memory->destroy(mollist);
+  memory->create(mollist,nwalk,"FixSTMD:mollist");
+  for (int m=0; m<=molmax; m++)
+    if (molmap[m] >= 0) mollist[molmap[m]] = m;
+
+  memory->destroy(ymol);
+  memory->destroy(y2oldmol);
+  memory->destroy(probmol);
+  memory->destroy(hmol);
+  memory->destroy(htotmol);
+  memory->destroy(prohmol);
+  memory->destroy(emol);
+  memory->destroy(emol_local);
+  memory->destroy(gmol);
+  delete [] mstate;
+  memory->create(ymol,nwalk,N,"FixSTMD:ymol");
+  memory->create(y2oldmol,nwalk,N,"FixSTMD:y2oldmol");
+  memory->create(probmol,nwalk,N,"FixSTMD:probmol");
+  memory->create(hmol,nwalk,N,"FixSTMD:hmol");
+  memory->create(htotmol,nwalk,N,"FixSTMD:htotmol");
+  memory->create(prohmol,nwalk,N,"FixSTMD:prohmol");
+  memory->create(emol,nwalk,"FixSTMD:emol");
+  memory->create(emol_local,nwalk,"FixSTMD:emol_local");
+  memory->create(gmol,nwalk+2,"FixSTMD:gmol");
+  mstate = new MolState[nwalk];
+
+  // every walker starts from the state of the fix
+  y2own = Y2;
+  y2oldown = Y2old;
+  probown = Prob;
+  histown = Hist;
+  htotown = Htot;
+  prohown = PROH;
+  for (int w=0; w<nwalk; w++) {
+    for (int i=0; i<N; i++) {
+      ymol[w][i] = Y2[i];
+      y2oldmol[w][i] = Y2old[i];
+      probmol[w][i] = Prob[i];
+      hmol[w][i] = Hist[i];
+      htotmol[w][i] = Htot[i];
+      prohmol[w][i] = PROH[i];
+    }
+    save_walker(w);
+  }
+  mol_current = -1;
+
+  if (comm->me == 0) {
+    if (stmd_logfile)
+      fprintf(logfile,"STMD: %d molecule walkers\n",nwalk);
+    if (stmd_screen)
+      fprintf(screen,"STMD: %d molecule walkers\n",nwalk);
+  }
+
+  if (!restart) return;
 
-      if (f_flag == 2) { 
-      // Reduce as sqrtf every m steps
-        if (istep != 0) {
-          f = sqrt(f);
-          df = log(f) * 0.5 / bin;
+  // oMOL holds the molecule ID and the oREST record of every walker
+  int nsize = orest_size();
+  double *list = NULL;
+  if (comm->me == 0) {
+    memory->create(list,nwalk*nsize,"stmd:list");
+    char filename[256];
+    sprintf(filename,"%s/oMOL.%i.d",dir_output,universe->iworld);
+    std::ifstream file(filename);
+    if (!file.good())
+      error->one(FLERR,"Fix stmd molecule restart file does not exist");
+    int nw,n;
+    file >> nw >> n;
+    if (!file || (nw != nwalk) || (n != N))
+      error->one(FLERR,"Fix stmd molecule restart file does not match "
+                 "the walkers");
+    for (int w=0; w<nwalk; w++) {
+      tagint m;
+      file >> m;
+      if (m != mollist[w])
+        error->one(FLERR,"Fix stmd molecule restart file does not match "
+                   "the walkers");
+      for (int k=0; k<nsize; k++) file >> list[w*nsize+k];
+    }
+    if (!file)
+      error->one(FLERR,"Fix stmd molecule restart file does not match "
+                 "the walkers");
+  }
+  for (int w=0; w<nwalk; w++) {
+    load_walker(w);
+    restore_orest(list ? &list[w*nsize] : NULL);
+    save_walker(w);
+  }
+  unload_walkers();
+  memory->destroy(list);
+}
+
+/* ----------------------------------------------------------------------
+   energies of all walkers from the per-atom compute, one reduction,
+   then proc 0 advances every walker and sends back their Gamma
+------------------------------------------------------------------------- */
+
+void FixStmd::post_force_molecule()
+{
+  double **f = atom->f;
+  int *mask = atom->mask;
+  tagint *molecule = atom->molecule;
+  int nlocal = atom->nlocal;
+
+  // the molecules may not interact, pair and bond lists only change
+  // on reneighboring
+  if (neighbor->ago == 0) check_interactions();
+
+  // invoked_flag is only cleared on output steps, so always recompute
+  Compute *c = modify->compute[mol_compute];
+  c->compute_peratom();
+  c->invoked_flag |= INVOKED_PERATOM;
+  double *eatom = c->vector_atom;
+
+  for (int w=0; w<nwalk; w++) emol_local[w] = 0.0;
+  for (int i=0; i<nlocal; i++)
+    if (mask[i] & groupbit) emol_local[molmap[molecule[i]]] += eatom[i];
+  MPI_Reduce(emol_local,emol,nwalk,MPI_DOUBLE,MPI_SUM,0,world);
+
+  // last two entries flag the first failing walker and its status,
+  // MAIN only runs on proc 0, so every rank errors after the Bcast;
+  // walkers run backwards so that walker 0 is loaded at the end
+  if (comm->me == 0) {
+    gmol[nwalk] = -1.0;
+    gmol[nwalk+1] = STMD_OK;
+    for (int w=0; w<nwalk; w++) {
+      if (!in_range(emol[w])) {
+        gmol[nwalk] = w;
+        gmol[nwalk+1] = STMD_BIN_RANGE;
+        break;
+      }
+    }
+    if (gmol[nwalk] < 0.0) {
+      for (int w=nwalk-1; w>=0; w--) {
+        load_walker(w);
+        const int status = MAIN(update->ntimestep,emol[w]);
+        gmol[w] = Gamma;
+        save_walker(w);
+        if (status != STMD_OK) {
+          gmol[nwalk] = w;
+          gmol[nwalk+1] = status;
+          break;
         }
+      }
+      unload_walkers();
+      sampledE = sampledU = emol[0];
+    }
+  }
+  MPI_Bcast(gmol,nwalk+2,MPI_DOUBLE,0,world);
+
+  if (gmol[nwalk] >= 0.0) {
+    int w = static_cast<int> (gmol[nwalk]);
+    if (stmd_screen && (comm->me == 0))
+      fprintf(screen,"STMD: Sampled energy %f of molecule " TAGINT_FORMAT "\n",
+              emol[w],mollist[w]);
+    if (stmd_logfile && (comm->me == 0))
+      fprintf(logfile,"STMD: Sampled energy %f of molecule " TAGINT_FORMAT "\n",
+              emol[w],mollist[w]);
+    status_error(static_cast<int> (gmol[nwalk+1]));
+  }
+
+  // Scale forces by the Gamma of the molecule of each atom
+  for (int i = 0; i < nlocal; i++)
+    if (mask[i] & groupbit) {
+      const double g = gmol[molmap[molecule[i]]];
+      f[i][0]*= g;
+      f[i][1]*= g;
+      f[i][2]*= g;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixStmd::load_walker(int w)
+{
+  Y2 = ymol[w];
+  Y2old = y2oldmol[w];
+  Prob = probmol[w];
+  Hist = hmol[w];
+  Htot = htotmol[w];
+  PROH = prohmol[w];
+
+  const MolState &s = mstate[w];
+  STG = s.STG;
+  Count = s.Count;
+  CountH = s.CountH;
+  CountPH = s.CountPH;
+  totC = s.totC;
+  totCi = s.totCi;
+  SWf = s.SWf;
+  SWchk = s.SWchk;
+  SWfold = s.SWfold;
+  invt_flag = s.invt_flag;
+  curbin = s.curbin;
+  f = s.f;
+  df = s.df;
+  T = s.T;
+  Gamma = s.Gamma;
+  ts_change = s.ts_change;
+  mol_current = w;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixStmd::save_walker(int w)
+{
+  MolState &s = mstate[w];
+  s.STG = STG;
+  s.Count = Count;
+  s.CountH = CountH;
+  s.CountPH = CountPH;
+  s.totC = totC;
+  s.totCi = totCi;
+  s.SWf = SWf;
+  s.SWchk = SWchk;
+  s.SWfold = SWfold;
+  s.invt_flag = invt_flag;
+  s.curbin = curbin;
+  s.f = f;
+  s.df = df;
+  s.T = T;
+  s.Gamma = Gamma;
+  s.ts_change = ts_change;
+}
+
+/* ----------------------------------------------------------------------
+   restore the arrays of the fix and fill them with walker 0, so that
+   outputs, extract() and the reweighting computes see the first walker
+------------------------------------------------------------------------- */
+
+void FixStmd::unload_walkers()
+{
+  load_walker(0);
+  Y2 = y2own;
+  Y2old = y2oldown;
+  Prob = probown;
+  Hist = histown;
+  Htot = htotown;
+  PROH = prohown;
+  for (int i=0; i<N; i++) {
+    Y2[i] = ymol[0][i];
+    Y2old[i] = y2oldmol[0][i];
+    Prob[i] = probmol[0][i];
+    Hist[i] = hmol[0][i];
+    Htot[i] = htotmol[0][i];
+    PROH[i] = prohmol[0][i];
+  }
+  mol_current = -1;
+  ts_changed();
+}
+
+/* ----------------------------------------------------------------------
+   write the oREST record of every walker to oMOL.<world>.d
+------------------------------------------------------------------------- */
+
+void FixStmd::write_molecule()
+{
+  char filename[256];
+  sprintf(filename,"%s/oMOL.%i.d",dir_output,universe->iworld);
+  FILE *fp = fopen(filename,"w");
+  if (fp == NULL)
+    error->one(FLERR,"Cannot open STMD restart file");
+
+  int nsize = orest_size();
+  double *list;
+  memory->create(list,nsize,"stmd:list");
+
+  fprintf(fp,"%d %d\n",nwalk,N);
+  for (int w=0; w<nwalk; w++) {
+    load_walker(w);
+    pack_orest(list);
+    fprintf(fp,TAGINT_FORMAT "\n",mollist[w]);
+    for (int k=0; k<nsize; k++)
+      fprintf(fp,"%.15g ",list[k]);
+    fprintf(fp,"\n");
+  }
+  unload_walkers();
+
+  fclose(fp);
+  memory->destroy(list);
+}
+
+/* ----------------------------------------------------------------------
+   build kernel weight table kw[1..nkernel] from kernel_flag/kernel_width
+------------------------------------------------------------------------- */
+
+void FixStmd::setup_kernel()
+{
+  memory->destroy(kw);
+  memory->create(kw,kernel_size()+1,"FixSTMD:kw");
+  kernel_weights();
+}
+/* ----------------------------------------------------------------------
+   flag bins lo..hi of Y2 as changed since the last spline and
+   entropy refresh, the Cv peak is stale from now on
+------------------------------------------------------------------------- */
+
+void FixStmd::mark_dirty(int lo, int hi)
+{
+  StmdCore::mark_dirty(lo,hi);
+  if (lo < sdirty_lo || sdirty_hi < sdirty_lo) sdirty_lo = lo;
+  if (hi > sdirty_hi) sdirty_hi = hi;
+  cv_valid = 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixStmd::ts_changed()
+{
+  dirty_lo = sdirty_lo = 0;
+  dirty_hi = sdirty_hi = N-1;
+  array_step = -1;
+  cv_valid = 0;
+}
+
+/* ----------------------------------------------------------------------
+   S(E)/k is kept as prefix sums of the entropy increments between
+   neighbouring bins, dS/k = int dE/(k Ts) with Ts linear in the bin
+   interval as in ST-WHAM; only intervals next to bins changed since the
+   last refresh are recomputed, the sums from the first of them on
+------------------------------------------------------------------------- */
+
+void FixStmd::refresh_entropy()
+{
+  if (sdirty_hi < sdirty_lo) return;
+
+  const int lo = MAX(sdirty_lo,1);
+  const int hi = MIN(sdirty_hi+1,N-1);
+  const double kT0 = force->boltz * ST;
+
+  for (int i = lo; i <= hi; i++) {
+    double ds = 0.0;
+    const double ya = Y2[i-1];
+    const double yb = Y2[i];
+    if ((ya > 0.0) && (yb > 0.0)) {
+      if (ya == yb) ds = bin / (kT0 * yb);
+      else ds = bin / (kT0 * (yb - ya)) * log(yb / ya);
+    }
+    ent_inc[i] = ds;
+  }
+
+  ent_sum[0] = 0.0;
+  for (int i = lo; i < N; i++) ent_sum[i] = ent_sum[i-1] + ent_inc[i];
+
+  sdirty_lo = 0;
+  sdirty_hi = -1;
+}
+
+/* ----------------------------------------------------------------------
+   S(E)/k of bin i relative to the lowest bin, prefix sum of increments
+------------------------------------------------------------------------- */
+
+double FixStmd::entropy(int i)
+{
+  return ent_sum[i];
+}
+
+/* ----------------------------------------------------------------------
+   canonical Cv(T)/k from S(E), one pass of exp over the bins
+------------------------------------------------------------------------- */
 
-        ResetPH();
-        CountH = 0;
-      } // if (f_flag == 2)
-
-      // Reduce f by constant every m steps
-      // otherwise, reduce by sqrt(f) if too small
-      if (f_flag == 3) { 
-        double reduce_val = 0.1;
-        if (istep != 0) {
-          if (f > (1+(2*reduce_val)))
-            f = f - (reduce_val*f);
-          else f = sqrt(f);
+double FixStmd::cv_at(double t)
+{
+  const double beta = 1.0 / (force->boltz * t);
+
+  // energies relative to Emin, the shift cancels in the variance
+  double wmax = -HUGE_VAL;
+  for (int i = 0; i < N; i++)
+    wmax = MAX(wmax,ent_sum[i] - beta*i*bin);
+  double z = 0.0, e1 = 0.0, e2 = 0.0;
+  for (int i = 0; i < N; i++) {
+    const double e = i*bin;
+    const double w = exp(ent_sum[i] - beta*e - wmax);
+    z += w;
+    e1 += w * e;
+    e2 += w * e * e;
+  }
+  e1 /= z;
+  return beta * beta * (e2/z - e1*e1);
+}
+
+/* ----------------------------------------------------------------------
+   a coarse scan over [TL,TH] brackets the highest Cv peak, golden
+   section search refines it; kept until Ts changes
+------------------------------------------------------------------------- */
+
+void FixStmd::cv_peak_scan()
+{
+  refresh_entropy();
+
+  const double tlo = T1 * ST;
+  const double thi = T2 * ST;
+  const int ncoarse = 32;
+  const double dt = (thi - tlo) / (ncoarse - 1);
+
+  int imax = 0;
+  double cvm = -1.0;
+  for (int k = 0; k < ncoarse; k++) {
+    const double cv = cv_at(tlo + k*dt);
+    if (cv > cvm) {
+      imax = k;
+      cvm = cv;
+    }
+  }
+  cv_peak_T = tlo + imax*dt;
+  cv_peak = cvm;
+
+  const double g = 0.5 * (sqrt(5.0) - 1.0);
+  double a = tlo + MAX(imax-1,0)*dt;
+  double b = tlo + MIN(imax+1,ncoarse-1)*dt;
+  double c = b - g*(b - a);
+  double d = a + g*(b - a);
+  double fc = cv_at(c);
+  double fd = cv_at(d);
+  for (int it = 0; (it < 50) && (b - a > 1.0e-6*(thi - tlo)); it++) {
+    if (fc > fd) {
+      b = d;
+      d = c;
+      fd = fc;
+      c = b - g*(b - a);
+      fc = cv_at(c);
+    } else {
+      a = c;
+      c = d;
+      fc = fd;
+      d = a + g*(b - a);
+      fd = cv_at(d);
+    }
+  }
+  if ((fc >= fd) && (fc > cv_peak)) {
+    cv_peak_T = c;
+    cv_peak = fc;
+  } else if (fd > cv_peak) {
+    cv_peak_T = d;
+    cv_peak = fd;
+  }
+  cv_valid = 1;
+}
+
+/* ----------------------------------------------------------------------
+   replace Y2 with a Ts array learned on another grid (nsrc bins
+   with spacing bin_src, bin 0 at energy e0_src), linearly interpolated
+   at the energies of my bins; outside the source grid Ts is held at
+   its end values, temper/stmd only swaps windows saturated at T1/T2
+   at both ends of their grid and lying inside the receiving grid
+------------------------------------------------------------------------- */
+
+void FixStmd::map_temperature(const double *ysrc, int nsrc,
+                              double e0_src, double bin_src)
+{
+  for (int i=0; i<N; i++) {
+    const double x = (bin_energy(i) - e0_src) / bin_src;
+    if (x <= 0.0) Y2[i] = ysrc[0];
+    else if (x >= nsrc-1) Y2[i] = ysrc[nsrc-1];
+    else {
+      const int j = static_cast<int> (x);
+      const double t = x - j;
+      Y2[i] = (1.0-t)*ysrc[j] + t*ysrc[j+1];
+    }
+  }
+  ts_changed();
+}
+
+/* ----------------------------------------------------------------------
+   seed Ts(E) from an oREST, WT or Ts_stwham.dat file of an earlier run
+   the source points are interpolated linearly in E onto my grid and
+   held constant beyond its ends; for WT files the last block is used
+   points with Ts <= 0, e.g. unsampled ST-WHAM edges, are skipped
+------------------------------------------------------------------------- */
+
+void FixStmd::import_temperature()
+{
+  if (comm->me == 0) {
+    FILE *fp = fopen(import_file,"r");
+    if (fp == NULL) {
+      char str[512];
+      snprintf(str,512,"Cannot open fix stmd ts_import file %s",import_file);
+      error->one(FLERR,str);
+    }
+
+    int nsrc = 0;
+    int maxsrc = 0;
+    double *esrc = NULL;
+    double *tsrc = NULL;
+
+    if (import_style == IMPORT_OREST) {
+      int nlist = 0;
+      double *list = NULL;
+      double value;
+      while (fscanf(fp,"%lg",&value) == 1) {
+        if (nlist == maxsrc) {
+          maxsrc += 1024;
+          memory->grow(list,maxsrc,"stmd:list");
         }
-        df = log(f) * 0.5 / bin;
-        ResetPH();
-        CountH = 0;
-      } // if (f_flag == 3)
-
-      // Reduce df by constant every m steps
-      if (f_flag == 4) {
-        double reduce_val = 0.01; // 1% reduction
-        if (istep != 0) {
-          df = df - (df * reduce_val);
-          f = exp(2 * bin * df);
+        list[nlist++] = value;
+      }
+      if ((nlist < 13) || ((nlist-13) % 3))
+        error->one(FLERR,"Fix stmd ts_import file is not an oREST file");
+      nsrc = (nlist-13) / 3;
+      memory->create(esrc,nsrc+1,"stmd:esrc");
+      memory->create(tsrc,nsrc+1,"stmd:tsrc");
+      // Y2 of the source is scaled by its own ST, its bin j lies at
+      // (j-1+BinMin)*bin as in bin_energy()
+      const int binmin_src = static_cast<int> (round(import_emin / import_bin));
+      for (int j=0; j<nsrc; j++) {
+        esrc[j] = (j-1+binmin_src) * import_bin;
+        tsrc[j] = list[13+j] * import_st / ST;
+      }
+      memory->destroy(list);
+    } else {
+      char line[1024];
+      int ibin;
+      double e,ts;
+      while (fgets(line,1024,fp)) {
+        if (line[0] == '#') {
+          if ((import_style == IMPORT_WT) && strstr(line,"STMD Step")) nsrc = 0;
+          continue;
         }
-      } // if (f_flag == 4)
+        if (import_style == IMPORT_WT) {
+          if (sscanf(line,"%d %lg %lg",&ibin,&e,&ts) != 3) continue;
+        } else if (sscanf(line,"%lg %lg",&e,&ts) != 2) continue;
+        if (!(ts > 0.0)) continue;
+        if (nsrc == maxsrc) {
+          maxsrc += 1024;
+          memory->grow(esrc,maxsrc,"stmd:esrc");
+          memory->grow(tsrc,maxsrc,"stmd:tsrc");
+        }
+        esrc[nsrc] = e;
+        tsrc[nsrc++] = ts / ST;
+      }
+    }
+    fclose(fp);
+
+    if (nsrc < 2)
+      error->one(FLERR,"Fix stmd ts_import file has less than 2 points");
+    for (int j=1; j<nsrc; j++)
+      if (esrc[j] <= esrc[j-1])
+        error->one(FLERR,"Fix stmd ts_import energies are not increasing");
+
+    int j = 0;
+    for (int i=0; i<N; i++) {
+      const double e = bin_energy(i);
+      if (e <= esrc[0]) Y2[i] = tsrc[0];
+      else if (e >= esrc[nsrc-1]) Y2[i] = tsrc[nsrc-1];
+      else {
+        while (esrc[j+1] < e) j++;
+        const double t = (e - esrc[j]) / (esrc[j+1] - esrc[j]);
+        Y2[i] = (1.0-t)*tsrc[j] + t*tsrc[j+1];
+      }
+      if (Y2[i] < T1) Y2[i] = T1;
+      if (Y2[i] > T2) Y2[i] = T2;
+    }
 
-      if (f <= 1.0)
-        error->all(FLERR,"f-value is less than unity");
+    if (stmd_logfile)
+      fprintf(logfile,"STMD: imported Ts(E) from %d points of %s\n",
+              nsrc,import_file);
+    if (stmd_screen)
+      fprintf(screen,"STMD: imported Ts(E) from %d points of %s\n",
+              nsrc,import_file);
 
-      if ((stmd_logfile) && (stmd_debug) && (f_flag > 1)) {
-	      fprintf(logfile,"  STMD f-UPDATE: f= %f  df= %f\n",f,df);
-	      fprintf(screen,"  STMD f-UPDATE: f= %f  df= %f\n",f,df);
-      }
+    memory->destroy(esrc);
+    memory->destroy(tsrc);
+  }
+
+  if (import_stage) STG = import_stage;
+  if (import_f > 0.0) {
+    f = import_f;
+    df = log(f) * 0.5 / bin;
+  }
+  import_flag = 0;
+
+  invt_flag = ((f_flag == 5) && (STG >= 3)) ? 1 : 0;
+  for (int i=0; i<N; i++) Y2old[i] = Y2[i];
+  ts_changed();
+}
+
+/* ----------------------------------------------------------------------
+   move the scaled Ts window to [t1,t2], keeping the flatness cutoffs
+   CTmin/CTmax at the same distance from the window edges
+------------------------------------------------------------------------- */
+
+void FixStmd::set_window(double t1, double t2)
+{
+  CTmin += t1 - T1;
+  CTmax += t2 - T2;
+  T1 = t1;
+  T2 = t2;
+  for (int i=0; i<N; i++) {
+    if (Y2[i] < T1) Y2[i] = T1;
+    if (Y2[i] > T2) Y2[i] = T2;
+  }
+  ts_changed();
+}
 
-      if ((f <= pfinFval) && (f_flag > 1)) {
-        STG = 3;
-        CountPH = 0;
+/* ----------------------------------------------------------------------
+   reference pressure of the sampled enthalpy, set by temper/stmd when a
+   replica moves to another pressure; the barostat target is reset by
+   the caller
+------------------------------------------------------------------------- */
+
+void FixStmd::set_pressure(double p)
+{
+  pressref = p;
+}
+
+/* ----------------------------------------------------------------------
+   energy of bin i, the bin Yval() and GammaE() assign E to is
+   round(E/bin) - BinMin + 1
+------------------------------------------------------------------------- */
+
+double FixStmd::bin_energy(int i)
+{
+  return (i - 1 + BinMin) * bin;
+}
+
+/* ----------------------------------------------------------------------
+   1 if E can be sampled, i.e. lies in [Emin,Emax] and in a bin Yval()
+   can update, 0 otherwise
+------------------------------------------------------------------------- */
+
+int FixStmd::in_range(double e)
+{
+  if ((e < Emin) || (e > Emax)) return 0;
+  const int i = static_cast<int> (round(e / bin)) - BinMin + 1;
+  return ((i >= 1) && (i <= N-2)) ? 1 : 0;
+}
+
+/* ----------------------------------------------------------------------
+   S(E)/k at an arbitrary energy on the grid, the last partial bin
+   integrated with Ts linear in the bin as in refresh_entropy()
+------------------------------------------------------------------------- */
+
+double FixStmd::entropy_at(double e)
+{
+  refresh_entropy();
+
+  const double x = (e - bin_energy(0)) / bin;
+  const int i = MAX(0, MIN(N-2, static_cast<int> (floor(x))));
+  const double dx = (x - i) * bin;
+  const double kT0 = force->boltz * ST;
+  const double ya = Y2[i];
+  const double yx = Y2[i] + (Y2[i+1] - Y2[i]) * (dx / bin);
+
+  double ds = 0.0;
+  if ((ya > 0.0) && (yx > 0.0)) {
+    if (ya == yx) ds = dx / (kT0 * ya);
+    else ds = dx / (kT0 * (yx - ya)) * log(yx / ya);
+  }
+  return entropy(i) + ds;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixStmd::EPROB(int icycle)
+{
+  int sw, m;
+  const int indx = icycle;
+  m = indx % TSC1;
+  if ((m == 0) && (indx != 0)) sw = 1;
+
+  m = indx % TSC2;
+  if ((m == 0) && (indx != 0)) sw = 2;
+
+  if (sw == 1) 
+    for (int i=0; i<N; i++) 
+      Prob[i] = Prob[i] / double(TSC1);
+  else if (sw == 2)
+    for (int i=0; i<N; i++) 
+      Prob[i] = Prob[i] / double(TSC2);
+  sw = 0;
+}
+
+/* ----------------------------------------------------------------------
+   create the RMA window shared by walkers with the same shared_group
+   every proc in the universe must call this, non-roots pass MPI_UNDEFINED
+   the window on shared rank 0 holds 1/Ts in [0,N) and Htot in [N,2N)
+------------------------------------------------------------------------- */
+
+void FixStmd::setup_shared()
+{
+#ifdef STMD_MPI3
+  // later runs keep the window, init() has reset Y2 and Htot though,
+  // so re-baseline and pull the shared estimate again
+  if (shared_win != MPI_WIN_NULL) {
+    if (comm->me == 0) {
+      for (int i=0; i<N; i++) {
+        Y2sync[i] = Y2[i];
+        Hsync[i] = Htot[i];
       }
+      sync_shared();
+    }
+    sync_state();
+    return;
+  }
+
+  int color = (comm->me == 0) ? shared_group : MPI_UNDEFINED;
+  MPI_Comm_split(universe->uworld,color,universe->iworld,&shared_comm);
 
-    } // if (m == 0)
-  } // if (STG == 2)
-
-  // STG1 START: Digging and chk stage on STG1
-  // Run until lowest temperature sampled
-  if (STG == 1) {
-    int m = istep % TSC1;
-    if ((m == 0) && (istep != 0)) {
-      if (stmd_logfile)
-        fprintf(logfile,"  STMD DIG: istep=%i  TSC1=%i Tlow=%f\n",istep,TSC1,T);
-      if (stmd_screen)
-        fprintf(screen,"  STMD DIG: istep=%i  TSC1=%i Tlow=%f\n",istep,TSC1,T);
-
-      dig();
-      TCHK();
-
-      // Histogram reset
-      if (STG > 1) {
-        ResetPH();
-        CountH = 0;
+  memory->grow(Y2sync, N, "FixSTMD:Y2sync");
+  memory->grow(Hsync, N, "FixSTMD:Hsync");
+  memory->grow(shared_delta, 2*N, "FixSTMD:shared_delta");
+  memory->grow(shared_result, 2*N, "FixSTMD:shared_result");
+
+  if (comm->me == 0) {
+    MPI_Comm_rank(shared_comm,&shared_rank);
+
+    // all walkers must agree on the grid and temperature range
+    double mine[5], lo[5], hi[5];
+    mine[0] = N; mine[1] = Emin; mine[2] = bin; mine[3] = T1; mine[4] = T2;
+    MPI_Allreduce(mine,lo,5,MPI_DOUBLE,MPI_MIN,shared_comm);
+    MPI_Allreduce(mine,hi,5,MPI_DOUBLE,MPI_MAX,shared_comm);
+    for (int k=0; k<5; k++)
+      if (lo[k] != hi[k])
+        error->one(FLERR,"Fix stmd shared_ts requires identical bins and T range");
+
+    MPI_Aint size = (shared_rank == 0) ? 2*N*sizeof(double) : 0;
+    MPI_Win_allocate(size,sizeof(double),MPI_INFO_NULL,shared_comm,
+                     &shared_buf,&shared_win);
+
+    // first walker seeds the shared estimate with its own Ts and Htot
+    if (shared_rank == 0) {
+      MPI_Win_lock(MPI_LOCK_EXCLUSIVE,0,0,shared_win);
+      for (int i=0; i<N; i++) {
+        shared_buf[i] = 1.0 / Y2[i];
+        shared_buf[N+i] = Htot[i];
       }
-    } // if (m == 0) 
-  } // if (STG == 1) 
+      MPI_Win_unlock(0,shared_win);
+    }
+    MPI_Barrier(shared_comm);
 
-  if ((stmd_logfile) && (stmd_debug)) {
-    fprintf(logfile,"STMD NEXT STG= %i\n",STG);
-    fprintf(screen,"STMD NEXT STG= %i\n",STG);
+    // everyone starts from the shared estimate
+    for (int i=0; i<N; i++) {
+      Y2sync[i] = Y2[i];
+      Hsync[i] = Htot[i];
+    }
+    sync_shared();
+
+    if (stmd_logfile)
+      fprintf(logfile,"STMD: sharing Ts as walker %i of group %i, sync every %i steps\n",
+              shared_rank,shared_group,shared_every);
+    if (stmd_screen)
+      fprintf(screen,"STMD: sharing Ts as walker %i of group %i, sync every %i steps\n",
+              shared_rank,shared_group,shared_every);
   }
+
+  // only the first walker digs, on all of its procs
+  MPI_Bcast(&shared_rank,1,MPI_INT,0,world);
+  sync_state();
+#endif
+}
+
+/* ----------------------------------------------------------------------
+   The Ts update is additive in 1/Ts (1/Y' = 1/Y -/+ df), so each walker
+   accumulates its change of 1/Ts since the last sync into the shared
+   window and receives the sum of all walkers' changes in one atomic
+   MPI_Get_accumulate. Htot is merged the same way. Staleness is bounded
+   by shared_every steps. Walkers clamp Ts to [T1,T2], so the part of the
+   merged 1/Ts cut off by the clamp is taken back out of the window.
+------------------------------------------------------------------------- */
+
+void FixStmd::sync_shared()
+{
+#ifdef STMD_MPI3
+  for (int i=0; i<N; i++) {
+    shared_delta[i] = 1.0/Y2[i] - 1.0/Y2sync[i];
+    shared_delta[N+i] = Htot[i] - Hsync[i];
+  }
+
+  // window contents before this walker's contribution
+  double *result = shared_result;
+
+  MPI_Win_lock(MPI_LOCK_SHARED,0,0,shared_win);
+  MPI_Get_accumulate(shared_delta,2*N,MPI_DOUBLE,result,2*N,MPI_DOUBLE,
+                     0,0,2*N,MPI_DOUBLE,MPI_SUM,shared_win);
+  MPI_Win_unlock(0,shared_win);
+
+  int clamped = 0;
+  for (int i=0; i<N; i++) {
+    const double sum = result[i] + shared_delta[i];
+    double y = 1.0 / sum;
+    if (y < T1) y = T1;
+    if (y > T2) y = T2;
+    Y2[i] = Y2sync[i] = y;
+    Htot[i] = static_cast<int> (result[N+i] + shared_delta[N+i]);
+    Hsync[i] = Htot[i];
+    shared_delta[i] = 1.0/y - sum;
+    if (shared_delta[i] != 0.0) clamped = 1;
+  }
+
+  // corrections are additive like the updates, so they commute with
+  // the contributions of other walkers in between
+  if (clamped) {
+    MPI_Win_lock(MPI_LOCK_SHARED,0,0,shared_win);
+    MPI_Accumulate(shared_delta,N,MPI_DOUBLE,0,0,N,MPI_DOUBLE,MPI_SUM,
+                   shared_win);
+    MPI_Win_unlock(0,shared_win);
+  }
+
+  ts_changed();
+#endif
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixStmd::MAIN(int istep, double sampledE)
+{
+  // With shared Ts only the first walker digs, the others
+  // receive the dug Ts at the next synchronization
+  dig_flag = !shared_flag || (shared_rank == 0);
+
+  const int status = advance(istep,sampledE);
+  if (status != STMD_OK) return status;
+
+  // Exchange Ts changes with the other walkers
+  // then hand the synced state to the other procs of the world
+  if (shared_flag && (istep % shared_every == 0)) {
+    if (comm->me == 0) sync_shared();
+    sync_state();
+  }
+
+  return STMD_OK;
+}
+
+/* ----------------------------------------------------------------------
+   in 2D mode f is reduced once the (E,V) histogram is flat: every cell
+   visited since the last reduction, with Ts(E) of its energy bin inside
+   CTmin..CTmax, must lie within HCKtol of the mean of those cells
+------------------------------------------------------------------------- */
+
+void FixStmd::HCHK()
+{
+  if (!vol_flag) {
+    StmdCore::HCHK();
+    return;
+  }
+
+  SWfold = SWf;
+
+  int icnt = 0;
+  double aveH = 0.0;
+  std::map<int,int>::const_iterator it;
+  for (it = hist2f.begin(); it != hist2f.end(); ++it) {
+    const int i = it->first % N;
+    if ((Y2[i] > CTmin) && (Y2[i] < CTmax)) {
+      aveH += double(it->second);
+      icnt++;
+    }
+  }
+
+  if (stmd_logfile && stmd_debug) {
+    fprintf(logfile,"  STMD CHK HIST2: icnt= %i  aveH= %f\n",icnt,aveH);
+    fprintf(screen,"  STMD CHK HIST2: icnt= %i  aveH= %f\n",icnt,aveH);
+  }
+  if (icnt == 0) return;
+
+  aveH = aveH / double(icnt);
+
+  int ichk = 0;
+  for (it = hist2f.begin(); it != hist2f.end(); ++it) {
+    const int i = it->first % N;
+    if ((Y2[i] > CTmin) && (Y2[i] < CTmax) &&
+        (fabs(double(it->second) - aveH) / aveH > HCKtol)) ichk++;
+  }
+
+  if (ichk < 1) SWf = SWf + 1;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixStmd::ResetPH()
+{
+  StmdCore::ResetPH();
+  hist2f.clear();
+}
+
+/* ----------------------------------------------------------------------
+   per-sample bookkeeping of advance(): energy-space diffusion and
+   the WH histogram output every RSTFRQ steps
+------------------------------------------------------------------------- */
+
+void FixStmd::tally_sample(int istep, int i, double e)
+{
+  // (E,V) cell for the 2D flatness check, sampledV is the same on all
+  // ranks, unlike hist2 which MAIN2() only fills on proc 0
+  if (vol_flag) {
+    const int iv = MAX(0, MIN(NV-1, static_cast<int>
+                              (round((sampledV - Vmin) / vbin))));
+    hist2f[iv*N + i]++;
+  }
+
+  // Transitions, passages and energy autocorrelation
+  if (diff_flag && (comm->me == 0)) tally_diffusion(istep,i,e);
+
+  // Hist Output
+  int o = istep % RSTFRQ;
+  if ((o == 0) && (comm->me == 0) && !aggregate_flag) {
+    if (mol_current >= 0)
+      fprintf(fp_whnm,"### STMD Step=%d walker=%d molecule=" TAGINT_FORMAT
+              ": bin E hist thist phist\n",istep,mol_current,
+              mollist[mol_current]);
+    else
+      fprintf(fp_whnm,"### STMD Step=%d: bin E hist thist phist\n",istep);
+    for (int k=0; k<N; k++)
+      fprintf(fp_whnm,"%i %f %i %i %i\n",k,bin_energy(k),Hist[k],Htot[k],PROH[k]);
+    fprintf(fp_whnm,"\n\n");
+  }
+}
+/* ----------------------------------------------------------------------
+   collective error for a failed MAIN, once its status reached all ranks
+------------------------------------------------------------------------- */
+
+void FixStmd::status_error(int status)
+{
+  if (status == STMD_BIN_RANGE)
+    error->all(FLERR,"STMD: Histogram index out of range");
+  error->all(FLERR,"f-value is less than unity");
 }
 
 /* ---------------------------------------------------------------------- */
@@ -1208,6 +3007,13 @@ double FixStmd::compute_vector(int i)
   else if (i == 6) xx = df;                                   // df-value
   else if (i == 7) xx = Gamma;                                // force scalling factor
   else if (i == 8) xx = sampledE;                             // Energy/Enthalpy sampled in curbin
+  else if (i == 9) xx = ts_change;                            // Ts change per step, running
+  else if (i == 10) xx = static_cast<double>(invt_flag);      // 1 if in 1/t f-reduction
+  else if (i >= 11) {
+    if (!cv_valid) cv_peak_scan();
+    if (i == 11) xx = cv_peak_T;                              // T at canonical Cv(T) peak
+    else xx = cv_peak;                                        // Cv/k at the peak
+  }
 
   return xx;
 }
@@ -1216,14 +3022,28 @@ double FixStmd::compute_vector(int i)
 
 double FixStmd::compute_array(int i, int j)
 {
-  // Returns data from arrays
-  double xx;
-  if      (i == 0) xx = (j*bin)+Emin;    // Binned Energies
-  else if (i == 1) xx = Y2[j];           // Histogram of temperature 1/T*j
-  else if (i == 2) xx = Hist[j];         // Histogram of energies*j
-  else if (i == 3) xx = PROH[j];         // Production histogram*j
+  // Row i is the energy bin, column j the quantity
+  if (array_step != update->ntimestep) pack_array();
+  return stmd_array[i][j];
+}
 
-  return xx;
+/* ----------------------------------------------------------------------
+   pack E, Ts, Hist, PROH and S into the contiguous global array
+   columns: 0 = binned energy, 1 = Ts(E), 2 = Hist(E), 3 = PROH(E),
+            4 = S(E)/k relative to the lowest bin
+------------------------------------------------------------------------- */
+
+void FixStmd::pack_array()
+{
+  refresh_entropy();
+  for (int i=0; i<N; i++) {
+    stmd_array[i][0] = bin_energy(i);
+    stmd_array[i][1] = Y2[i];
+    stmd_array[i][2] = Hist[i];
+    stmd_array[i][3] = PROH[i];
+    stmd_array[i][4] = entropy(i);
+  }
+  array_step = update->ntimestep;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -1243,6 +3063,271 @@ int FixStmd::modify_param(int narg, char **arg)
     return 2;
   }
   
+  // Spread the Ts update over a kernel of neighbouring bins
+  // fix_modify ID kernel none|gaussian|epanechnikov width
+  else if (strcmp(arg[0],"kernel") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    if (strcmp(arg[1],"none") == 0) {
+      kernel_flag = 0;
+      return 2;
+    }
+    if (narg < 3) error->all(FLERR,"Illegal fix_modify command");
+    if (strcmp(arg[1],"gaussian") == 0)
+      kernel_flag = 1;
+    else if (strcmp(arg[1],"epanechnikov") == 0)
+      kernel_flag = 2;
+    else
+      error->all(FLERR,"Illegal fix_modify command");
+
+    kernel_width = force->numeric(FLERR,arg[2]);
+    if ((kernel_width <= 0.0) || (kernel_width >= N))
+      error->all(FLERR,"Illegal fix_modify kernel width");
+    setup_kernel();
+    return 3;
+  }
+
+  // Share one Ts estimate between walkers with the same group id
+  // fix_modify ID shared_ts group-id Nsync
+  else if (strcmp(arg[0],"shared_ts") == 0) {
+    if (narg < 3) error->all(FLERR,"Illegal fix_modify command");
+#ifndef STMD_MPI3
+    error->all(FLERR,"Fix_modify shared_ts requires MPI-3");
+#endif
+    shared_group = force->inumeric(FLERR,arg[1]);
+    shared_every = force->inumeric(FLERR,arg[2]);
+    if ((shared_group < 0) || (shared_every < 1))
+      error->all(FLERR,"Illegal fix_modify command");
+    shared_flag = 1;
+    return 3;
+  }
+
+  // Interpolation of Ts(E) used for Gamma(E)
+  else if (strcmp(arg[0],"gamma_interp") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    if (strcmp(arg[1],"linear") == 0)
+      interp_flag = 0;
+    else if (strcmp(arg[1],"hermite") == 0)
+      interp_flag = 1;
+    else
+      error->all(FLERR,"Illegal fix_modify command");
+    return 2;
+  }
+
+  // Ts change per step below which inv_t enters STG4
+  else if (strcmp(arg[0],"ts_tol") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    ts_tol = force->numeric(FLERR,arg[1]);
+    if (ts_tol < 0.0)
+      error->all(FLERR,"Illegal fix_modify ts_tol value");
+    return 2;
+  }
+
+  // 2D statistical temperature in (E,V) for NPT
+  // fix_modify ID volume Vmin Vmax Vbin Pilo Pihi
+  // E is then the potential energy alone and Pi, the pressure the
+  // barostat effectively targets, is learned on its own grid;
+  // hchk and inv_t then check the flatness of the (E,V) histogram
+  else if (strcmp(arg[0],"volume") == 0) {
+    if (narg < 6) error->all(FLERR,"Illegal fix_modify command");
+    Vmin = force->numeric(FLERR,arg[1]);
+    Vmax = force->numeric(FLERR,arg[2]);
+    vbin = force->numeric(FLERR,arg[3]);
+    Plo = force->numeric(FLERR,arg[4]);
+    Phi = force->numeric(FLERR,arg[5]);
+    if ((Vmin >= Vmax) || (vbin <= 0.0) || (Plo > Phi))
+      error->all(FLERR,"Illegal fix_modify volume values");
+    vol_flag = 1;
+    return 6;
+  }
+
+  // Sample the energy of a solute group, REST2 style, instead of the
+  // total pe: solute-solute terms plus lambda of the solute-solvent pairs
+  // fix_modify ID energy group-ID lambda or energy default
+  // the pe/atom compute is created here, computes added in init() come
+  // after Verlet::init() and would not get per-atom energies tallied
+  else if (strcmp(arg[0],"energy") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    if (id_peatom) {
+      modify->delete_compute(id_peatom);
+      delete [] id_peatom;
+      id_peatom = NULL;
+    }
+    energy_group = -1;
+    if (strcmp(arg[1],"default") == 0) return 2;
+
+    if (narg < 3) error->all(FLERR,"Illegal fix_modify command");
+    int jgroup = group->find(arg[1]);
+    if (jgroup < 0)
+      error->all(FLERR,"Could not find fix_modify energy group ID");
+    energy_lambda = force->numeric(FLERR,arg[2]);
+    if ((energy_lambda < 0.0) || (energy_lambda > 1.0))
+      error->all(FLERR,"Illegal fix_modify command");
+    energy_group = jgroup;
+    energy_bit = group->bitmask[jgroup];
+
+    int n = strlen(id) + 8;
+    id_peatom = new char[n];
+    strcpy(id_peatom,id);
+    strcat(id_peatom,"_peatom");
+
+    char **newarg = new char*[3];
+    newarg[0] = id_peatom;
+    newarg[1] = arg[1];
+    newarg[2] = (char *) "pe/atom";
+    modify->add_compute(3,newarg);
+    delete [] newarg;
+    return 3;
+  }
+
+  // Adapt the timestep to the Gamma-scaled forces
+  // fix_modify ID dt_adapt dtmin dtmax xmax [Nevery] or dt_adapt no
+  else if (strcmp(arg[0],"dt_adapt") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    if (strcmp(arg[1],"no") == 0) {
+      dt_flag = 0;
+      return 2;
+    }
+    if (narg < 4) error->all(FLERR,"Illegal fix_modify command");
+    dt_min = force->numeric(FLERR,arg[1]);
+    dt_max = force->numeric(FLERR,arg[2]);
+    dt_xmax = force->numeric(FLERR,arg[3]);
+    if ((dt_min <= 0.0) || (dt_max < dt_min) || (dt_xmax <= 0.0))
+      error->all(FLERR,"Illegal fix_modify dt_adapt values");
+    int iarg = 4;
+    dt_every = 1;
+    if ((narg > 4) && isdigit(arg[4][0])) {
+      dt_every = force->inumeric(FLERR,arg[4]);
+      if (dt_every < 1) error->all(FLERR,"Illegal fix_modify dt_adapt values");
+      iarg = 5;
+    }
+    dt_flag = 1;
+    return iarg;
+  }
+
+  // Adapt the neighbor check interval to the measured atom motion
+  // fix_modify ID neigh_adapt Nmin Nmax [safety] or neigh_adapt no
+  else if (strcmp(arg[0],"neigh_adapt") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    if (strcmp(arg[1],"no") == 0) {
+      neigh_flag = 0;
+      restore_neighbor();
+      return 2;
+    }
+    if (narg < 3) error->all(FLERR,"Illegal fix_modify command");
+    neigh_min = force->inumeric(FLERR,arg[1]);
+    neigh_max = force->inumeric(FLERR,arg[2]);
+    if ((neigh_min < 1) || (neigh_max < neigh_min))
+      error->all(FLERR,"Illegal fix_modify neigh_adapt values");
+    int iarg = 3;
+    if ((narg > 3) && isdigit(arg[3][0])) {
+      neigh_safety = force->numeric(FLERR,arg[3]);
+      if ((neigh_safety <= 0.0) || (neigh_safety > 1.0))
+        error->all(FLERR,"Illegal fix_modify neigh_adapt values");
+      iarg = 4;
+    }
+    neigh_flag = 1;
+    return iarg;
+  }
+
+  // Track transitions between bins, the energy autocorrelation and
+  // passages between the ends of the [T1,T2] window
+  // fix_modify ID diffusion yes [band B] [lag L] or diffusion no
+  else if (strcmp(arg[0],"diffusion") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    if (strcmp(arg[1],"no") == 0) {
+      diff_flag = 0;
+      return 2;
+    }
+    if (strcmp(arg[1],"yes") != 0)
+      error->all(FLERR,"Illegal fix_modify command");
+    int iarg = 2;
+    while (iarg+1 < narg) {
+      if (strcmp(arg[iarg],"band") == 0) {
+        diff_band = force->inumeric(FLERR,arg[iarg+1]);
+        if (diff_band < 1)
+          error->all(FLERR,"Illegal fix_modify diffusion values");
+      } else if (strcmp(arg[iarg],"lag") == 0) {
+        diff_lag = force->inumeric(FLERR,arg[iarg+1]);
+        if (diff_lag < 0)
+          error->all(FLERR,"Illegal fix_modify diffusion values");
+      } else break;
+      iarg += 2;
+    }
+    diff_flag = 1;
+    return iarg;
+  }
+
+  // Treat every molecule of the group as an independent walker
+  // fix_modify ID molecule computeID or molecule no
+  // the compute is a per-atom energy, e.g. pe/atom, summed by molecule
+  // only for non-interacting molecules, checked on every reneighboring
+  else if (strcmp(arg[0],"molecule") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    delete [] id_mol;
+    id_mol = NULL;
+    mol_flag = 0;
+    if (strcmp(arg[1],"no") != 0) {
+      int n = strlen(arg[1]) + 1;
+      id_mol = new char[n];
+      strcpy(id_mol,arg[1]);
+      mol_flag = 1;
+    }
+    return 2;
+  }
+
+  // Overlap the pe reduction with the reverse communication of forces
+  // fix_modify ID overlap yes|no
+  else if (strcmp(arg[0],"overlap") == 0) {
+    if (narg < 2) error->all(FLERR,"Illegal fix_modify command");
+    if (strcmp(arg[1],"yes") == 0)
+      overlap_flag = 1;
+    else if (strcmp(arg[1],"no") == 0)
+      overlap_flag = 0;
+    else
+      error->all(FLERR,"Illegal fix_modify command");
+    return 2;
+  }
+
+  // Seed Ts(E) from an earlier run on any energy grid
+  // fix_modify ID ts_import orest|wt|stwham file [Emin bin ST] [stage S] [f F]
+  // oREST files carry no grid and Ts scaled by the ST of their run,
+  // so their Emin, bin and ST must be given
+  else if (strcmp(arg[0],"ts_import") == 0) {
+    if (narg < 3) error->all(FLERR,"Illegal fix_modify command");
+    if (strcmp(arg[1],"orest") == 0) import_style = IMPORT_OREST;
+    else if (strcmp(arg[1],"wt") == 0) import_style = IMPORT_WT;
+    else if (strcmp(arg[1],"stwham") == 0) import_style = IMPORT_STWHAM;
+    else error->all(FLERR,"Illegal fix_modify command");
+    delete [] import_file;
+    import_file = new char[strlen(arg[2])+1];
+    strcpy(import_file,arg[2]);
+    int iarg = 3;
+    if (import_style == IMPORT_OREST) {
+      if (narg < 6) error->all(FLERR,"Illegal fix_modify command");
+      import_emin = force->numeric(FLERR,arg[3]);
+      import_bin = force->numeric(FLERR,arg[4]);
+      import_st = force->numeric(FLERR,arg[5]);
+      if ((import_bin <= 0.0) || (import_st <= 0.0))
+        error->all(FLERR,"Illegal fix_modify command");
+      iarg = 6;
+    }
+    import_stage = 0;
+    import_f = 0.0;
+    while (iarg+1 < narg) {
+      if (strcmp(arg[iarg],"stage") == 0) {
+        import_stage = force->inumeric(FLERR,arg[iarg+1]);
+        if ((import_stage < 1) || (import_stage > 4))
+          error->all(FLERR,"Illegal fix_modify command");
+      } else if (strcmp(arg[iarg],"f") == 0) {
+        import_f = force->numeric(FLERR,arg[iarg+1]);
+        if (import_f <= 1.0) error->all(FLERR,"Illegal fix_modify command");
+      } else break;
+      iarg += 2;
+    }
+    import_flag = 1;
+    return iarg;
+  }
+
   // Reset dfvalue, must be >=0. (=0 means Ts does not update)
   // df will take value from LAMMPS input, STG is NOT reset
   else if (strcmp(arg[0],"dfval") == 0) {
@@ -1266,6 +3351,7 @@ int FixStmd::modify_param(int narg, char **arg)
 
 void *FixStmd::extract(const char *str, int &dim)
 {
+  // Scalars: dim = 0
   dim=0;
   if (strcmp(str,"scale_stmd") == 0) {
     return &Gamma;
@@ -1273,5 +3359,58 @@ void *FixStmd::extract(const char *str, int &dim)
   if (strcmp(str,"sampledE") == 0) {
     return &sampledE;
   }
+  if (strcmp(str,"sampledU") == 0) {
+    return &sampledU;
+  }
+  if (strcmp(str,"sampledV") == 0) {
+    return &sampledV;
+  }
+  if (strcmp(str,"N") == 0) {         // int
+    return &N;
+  }
+  if (strcmp(str,"bin") == 0) {
+    return &bin;
+  }
+  if (strcmp(str,"Emin") == 0) {
+    return &Emin;
+  }
+  if (strcmp(str,"Emax") == 0) {
+    return &Emax;
+  }
+  if (strcmp(str,"pressure_shift") == 0) {
+    return &pshift;
+  }
+  if (strcmp(str,"neigh_disp") == 0) {
+    return &neigh_disp;
+  }
+  if (strcmp(str,"RSTFRQ") == 0) {    // int
+    return &RSTFRQ;
+  }
+  if (strcmp(str,"OREST") == 0) {     // int, 1 while a restart is pending
+    return &OREST;
+  }
+
+  // Per-bin arrays of length N: dim = 1
+  // Pointers are only valid until the next run re-allocates them
+  dim=1;
+  if (strcmp(str,"Y2") == 0) {        // double
+    return Y2;
+  }
+  if (strcmp(str,"Hist") == 0) {      // int
+    return Hist;
+  }
+  if (strcmp(str,"Htot") == 0) {      // int
+    return Htot;
+  }
+  if (strcmp(str,"PROH") == 0) {      // int
+    return PROH;
+  }
+
+  // Contiguous N x 5 global array: dim = 2
+  dim=2;
+  if (strcmp(str,"stmd_array") == 0) {
+    if (stmd_array) pack_array();
+    return stmd_array;
+  }
   return NULL;
 }
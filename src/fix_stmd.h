@@ -21,10 +21,18 @@ FixStyle(stmd,FixStmd)
 #define LMP_FIX_STMD_H
 
 #include "fix.h"
+#include "stmd_core.h"
+#include <map>
+
+// one-sided windows and non-blocking collectives need MPI-3,
+// the serial STUBS library does not provide them
+#if defined(MPI_VERSION) && (MPI_VERSION >= 3)
+#define STMD_MPI3
+#endif
 
 namespace LAMMPS_NS {
 
-class FixStmd : public Fix {
+class FixStmd : public Fix, public StmdCore {
  public:
   FixStmd(class LAMMPS *, int, char **);
   ~FixStmd();
@@ -32,10 +40,14 @@ class FixStmd : public Fix {
   void init();
   void setup(int);
   void min_setup(int);
+  void init_list(int, class NeighList *);
+  void pre_reverse(int, int);
   void post_force(int);
   void min_post_force(int);
   void end_of_step();
   void *extract(const char *, int &);
+  int pack_reverse_comm(int, int, double *);
+  void unpack_reverse_comm(int, int *, double *);
   double memory_usage();
 
   double compute_scalar();
@@ -44,46 +56,61 @@ class FixStmd : public Fix {
   int modify_param(int, char **);
   void write_orest();
   void write_temperature();
-
-  // Public for access by temper_stmd
-  double * Y2;              // statistical temperature array
-  int STG;                  // stage flag
-  int N;                    // number of bins
-  double T;                 // latest sampled temperature
-  double f;                 // current f-value
-  double ST;                // kinetic temperature
-  double T1, T2;            // scaled temperature cutoffs
+  int orest_size();         // length of an oREST record
+  void pack_orest(double *);
+  void restore_orest(const double *);
+  void pack_array();        // refresh contiguous global array output
+  void ts_changed();        // Y2 was modified outside of the fix
+  void map_temperature(const double *, int, double, double);
+  double bin_energy(int);    // energy of bin i as binned by Yval()
+  int in_range(double);      // 1 if E lies in an updatable bin
+  void set_window(double, double);
+  void set_pressure(double);
+  double entropy_at(double); // S(E)/k relative to the lowest bin
+  void diffusion_vector(double *); // tau_E, passage and round-trip times
+  void diffusion_array(double **); // per-bin transition counts
+
+  // Public for access by temper_stmd, Y2, STG, N, T, f, ST, T1
+  // and T2 come from StmdCore
   int pressflag;
+  int shared_flag;          // 1 if Ts is shared between walkers via RMA
+  int aggregate_flag;       // 1 if temper/stmd writes WT, WH and oREST
+  int diff_flag;            // 1 if energy-space diffusion is tracked
+  int diff_band;            // half-width of the banded transition matrix
+  int mol_flag;             // 1 if every molecule of the group is a walker
+  int vol_flag;             // 1 for 2D (E,V) statistical temperature
 
  private:
   int RSTFRQ;               // restart and print frequency
-  int f_flag;               // determines type of f-reduction
-  int TSC1;                 // dig reduction frequency
-  int TSC2;                 // hckh() or f-reduction frequency
   int OREST;                // restart flag, 1 to read restart
   int iworld,nworlds;       // world info
-  int BinMin,BinMax;        // bin info
-  int Count,CountH,CountPH; // histogram counts   
-  int totC,totCi;           // total counts
-  int SWf,SWchk,SWfold;     // histogram flatness checks
-  int curbin;               // current sampled bin
+  int BinMax;               // bin info
+  int totC;                 // total counts
 
   int hist_flag, freset_flag;
+  int shared_group;         // walkers with the same id share one Ts
+  int shared_every;         // steps between synchronizations
+  int shared_rank;          // rank among walkers sharing Ts
+  MPI_Comm shared_comm;     // world roots of walkers sharing Ts
+#ifdef STMD_MPI3
+  MPI_Win shared_win;       // window holding shared 1/Ts and Htot
+#endif
+  double * shared_buf;      // window memory, only non-empty on shared_rank 0
+  double * Y2sync, * Hsync; // Y2 and Htot as of the last synchronization
+  double * shared_delta;    // local changes pushed to the shared estimate
+  double * shared_result;   // window contents fetched by the last sync
   int stmd_logfile,stmd_debug,stmd_screen;
   int pe_compute_id;
+  int nreweight;            // number of compute stmd/reweight instances
+  int *reweight_list;       // their indices in modify->compute
   double pressref;
 
-  double bin;               // binsize
   double Emin,Emax;         // energy range
   double T0;                // kinetic temp
   double TL, TH;            // unscaled lower and upper T cutoff
-  double CTmin,CTmax;       // temperature cutoffs
   double CutTmin,CutTmax;
   double dFval3,dFval4;     // deltaf-tolerance for stg 3 and stg 4
-  double finFval,pfinFval;  // f-tolerance for stg 3 and stg 4
-  double initf,df;          // initial-f and delta-f
-  double HCKtol;            // histogram tolerance when chk flatness
-  double Gamma;             // force scaling factor
+  double initf;             // initial-f
   double sampledE;          // energy/enthalpy sampled
 
   char dir_output[256];     // output directory
@@ -91,20 +118,133 @@ class FixStmd : public Fix {
   char filename_whpnm[256],filename_orest[256];
 
   char * id_pe;
+  int energy_group;         // solute group of fix_modify energy, -1 = off
+  int energy_bit;           // its groupbit
+  double energy_lambda;     // weight of the solute-solvent pairs
+  char * id_peatom;         // pe/atom of the solute
+  int peatom_compute;       // index of that compute
+  class NeighList *list;    // half list the solute-solvent pairs come from
+  int ncross,maxcross;      // solute-solvent pairs of the list
+  int ** cross;             // i and j with special bits of each pair
+  int nmax_cross;           // length of fcross
+  double ** fcross;         // per-atom force of the solute-solvent pairs
+
+  int NV,N2;                // number of volume bins, energy bins of grids
+  double Vmin,Vmax,vbin;    // volume range and binsize
+  double Plo,Phi;           // bounds of the effective barostat pressure
+  double sampledU;          // potential energy sampled
+  double sampledV;          // volume sampled
+  double pshift;            // pressure shift applied by compute pressure/stmd
+  double ** Ts2;            // Ts(E,V), NV x N, scaled like Y2
+  double ** Pi2;            // effective barostat pressure T0 Ps/Ts, NV x N
+  std::map<int,int> hist2;  // sparse (E,V) histogram keyed by iv*N+iu
+  std::map<int,int> hist2f; // same since the last f reduction, for HCHK
+  int dt_flag;              // 1 if dt follows the Gamma-scaled forces
+  int dt_every;             // steps between timestep adaptations
+  double dt_min,dt_max;     // bounds of the adapted timestep
+  double dt_xmax;           // largest displacement allowed per step
+  int neigh_flag;           // 1 if the neighbor check interval is adapted
+  int neigh_min,neigh_max;  // bounds of the rebuild interval in steps
+  int neigh_saved;          // 1 while every and delay below are held
+  int neigh_every0,neigh_delay0; // neigh_modify settings before neigh_adapt
+  double neigh_safety;      // fraction of skin/2 allowed between rebuilds
+  double neigh_disp;        // largest displacement per step, neigh_adapt only
+  int overlap_flag;         // 1 if the pe reduction overlaps reverse comm
+  int overlap_pending;      // 1 if a reduction was started this step
+  double overlap_local;     // my part of the pe being reduced
+  double overlap_pe;        // reduced pe, valid after the wait
+  MPI_Request overlap_request;
+  int diff_lag;             // longest lag of the energy autocorrelation
+  int diff_prev;            // bin sampled on the previous step, -1 = none
+  int diff_end;             // last end of the window visited: -1 low, 1 high
+  bigint diff_end_step;     // step of the first arrival at diff_end
+  bigint diff_npass[2];     // completed passages low->high, high->low
+  double diff_tpass[2];     // summed passage times in steps
+  bigint diff_ntrans;       // transitions between consecutive samples
+  bigint diff_far;          // transitions longer than diff_band bins
+  double ** trans;          // N x (2 diff_band + 1) transition counts
+  bigint ac_n;              // energies in the autocorrelation sums
+  double ac_e0;             // first energy, shift against cancellation
+  double ac_s1;             // sum of shifted energies
+  double * ac_buf;          // ring buffer of the last diff_lag energies
+  double * ac_sum;          // sum of E(t) E(t-k) for lags k < diff_lag
+  char * id_mol;            // pe/atom compute summed per molecule
+  int mol_compute;          // its index in modify->compute
+  int nwalk;                // number of molecule walkers
+  int mol_current;          // walker loaded into the fix state, -1 = none
+  int molmax;               // largest molecule ID in the group
+  int * molmap;             // molecule ID -> walker, -1 if not in group
+  tagint * mollist;         // walker -> molecule ID
+  double ** ymol, ** y2oldmol, ** probmol; // walker x bin Ts, Ts at last
+  int ** hmol, ** htotmol, ** prohmol;     // check, Prob and histograms
+  double * y2own, * y2oldown, * probown;   // arrays of the fix itself
+  int * histown, * htotown, * prohown;
+  double * emol;            // walker energies, reduced on proc 0
+  double * emol_local;      // my part of the walker energies
+  double * gmol;            // walker Gamma, then the bad walker and its status
+  struct MolState {         // scalar STMD state of one walker
+    int STG,Count,CountH,CountPH,totC,totCi,SWf,SWchk,SWfold,invt_flag,curbin;
+    double f,df,T,Gamma,ts_change;
+  };
+  MolState * mstate;
+  int import_flag;          // 1 if Ts(E) is imported at the next init
+  int import_style;         // oREST, WT or ST-WHAM source file
+  char * import_file;
+  double import_emin,import_bin; // grid of an imported oREST file
+  double import_st;         // ST of the run that wrote that oREST file
+  int import_stage;         // stage after import, 0 = keep
+  double import_f;          // f after import, 0 = keep
+  FILE * fp_wt2;
+  char filename_wt2[256];
   FILE * fp_wtnm, * fp_whnm, * fp_whpnm, * fp_orest;
 
   double * Prob;
-  int * Hist, * Htot, * PROH;
-
-  void dig();               // Translation of stmd.f::stmddig()
-  int Yval(double);         // Translation of stmd.f::stmdYval()
-  void GammaE(double, int); // Translation of stmd.f::stmdGammaE()
-  void AddedEHis(int);      // Translation of stmd.f::stmdAddedEHis()
+  double ** stmd_array;     // contiguous N x 5 global array: E, Ts, Hist, PROH, S
+  double * ent_inc;         // S/k increment from bin i-1 to bin i
+  double * ent_sum;         // prefix sums of ent_inc, S(E)/k of each bin
+  int sdirty_lo,sdirty_hi;  // range of Y2 changed since last entropy refresh
+  double cv_peak_T,cv_peak; // canonical Cv(T) maximum and its temperature
+  int cv_valid;             // 1 while the Cv peak matches the current Ts
+  bigint array_step;        // timestep stmd_array was last packed
+
+  void setup_kernel();      // build kernel weight table
+  void mark_dirty(int, int); // flag Y2 range for spline and entropy refresh
+  void tally_sample(int, int, double); // diffusion and WH output per sample
+  void HCHK();              // flatness over visited (E,V) cells in 2D mode
+  void ResetPH();           // also clears the 2D flatness histogram
+  void refresh_entropy();   // update entropy increments of dirty range
+  double entropy(int);      // S(E)/k of a bin from the prefix sums
+  double cv_at(double);     // canonical Cv/k at one temperature
+  void cv_peak_scan();      // locate the canonical Cv(T) peak
+  void setup_volume();      // allocate and initialize 2D (E,V) grids
+  void import_temperature(); // seed Ts(E) from a file of an earlier run
+  void sync_state();        // copy the STMD state of proc 0 to the world
+  void setup_diffusion();   // allocate and clear diffusion statistics
+  void tally_diffusion(int, int, double); // add one sample, proc 0 only
+  void write_diffusion();   // write oDIFF file next to oREST
+  void read_diffusion();    // restore statistics from oDIFF file
+  void setup_molecule(int); // map molecules to walkers, restart from oMOL
+  void post_force_molecule(); // per-walker energies, updates and Gamma
+  void load_walker(int);    // point the fix state at one walker
+  void save_walker(int);    // store the scalar state of that walker
+  void unload_walkers();    // back to the fix arrays, holding walker 0
+  void write_molecule();    // write all walkers to oMOL file
+  void check_interactions(); // no interactions between energy owners
+  tagint energy_owner(int); // solute or molecule whose energy has atom i
+  void build_cross();       // solute-solvent pairs after reneighboring
+  double solute_energy();   // sampled solute energy and fcross
+  void adapt_timestep();    // fix dt/reset style timestep from scaled forces
+  void adapt_neighbor();    // displacement estimate and rebuild interval
+  void restore_neighbor();  // neigh_modify every and delay before neigh_adapt
+  void MAIN2(double, double); // 2D Ts and Pi update, Gamma and pressure shift
+  void write_temperature2(); // write 2D grids to WT2 file
+  void write_volume();      // write 2D grids to oREST2 file
+  void read_volume();       // restore 2D grids from oREST2 file
   void EPROB(int);          // Translation of stmd.f::stmdEPROB()
-  void ResetPH();           // Translation of stdm.f::stmdResetPH()
-  void TCHK();              // Translation of stmd.f::stmdTCHK()
-  void HCHK();              // Translation of stmd.f::stmdHCHK()
-  void MAIN(int, double);   // Translation of stmd.f::stmdMAIN()
+  void setup_shared();      // create RMA window for shared Ts
+  void sync_shared();       // push local changes, pull shared Ts
+  int MAIN(int, double);    // StmdCore::advance() and shared Ts, returns status
+  void status_error(int);   // error on all ranks for a failed MAIN
 
  protected:
   char *id_temp,*id_press,*id_nh;
@@ -127,7 +267,147 @@ command-line option when running LAMMPS to see the offending line.
 
 E: Invalid f-reduction scheme
 
-Style provided for f-reduction is incorrect. Use hckh, sqrt, constant.
+Style provided for f-reduction is incorrect. Use none, hchk, sqrt,
+constant_f, constant_df or inv_t.
+
+E: Illegal fix_modify dt_adapt values
+
+The timestep bounds and the displacement must be positive with
+dtmin <= dtmax, Nevery must be at least 1.
+
+E: Illegal fix_modify diffusion values
+
+The transition band must be at least 1 bin and the autocorrelation lag
+must not be negative.
+
+W: Fix stmd diffusion restart file %s not found, statistics start empty
+
+The run restarts from oREST but no oDIFF file was written by the
+earlier run, e.g. because fix_modify diffusion was not used then.
+
+E: Fix stmd diffusion restart file does not match the bins
+
+The oDIFF file was written for a different number of bins, band or
+autocorrelation lag.
+
+E: Fix stmd molecule compute ID does not exist
+
+The compute given to fix_modify molecule does not exist.
+
+E: Fix stmd molecule compute does not calculate a per-atom vector
+
+Use compute pe/atom or another compute with a per-atom vector whose
+sum over the atoms of a molecule is its energy.
+
+E: Fix stmd molecule requires molecule IDs in the fix group
+
+Every atom of the fix group must belong to a molecule, each molecule
+is an independent walker.  The molecules may not interact with each
+other or with atoms outside the group.
+
+E: Fix_modify molecule cannot be combined with this option
+
+The molecule walkers keep one Ts per molecule but volume, shared_ts,
+overlap, diffusion, energy, gamma_interp hermite, dt_adapt and
+neigh_adapt work on a single global Ts or Gamma.
+
+E: Fix stmd molecule cannot be used with a barostat
+
+Each walker samples its own potential energy, there is no enthalpy
+per molecule.
+
+E: Fix stmd molecule restart file does not exist
+
+Restarting with fix_modify molecule reads the oMOL file written by an
+earlier run with the same molecules.
+
+E: Fix stmd molecule restart file does not match the walkers
+
+The oMOL file holds a different number of walkers or bins, or other
+molecule IDs.
+
+E: Fix stmd volume restart file does not match the grid
+
+The oREST2 file was written for a different energy or volume grid.
+
+W: Fix stmd volume restart file %s not found, 2D grids start from the enthalpy weight
+
+OREST restores STG and f, but the Ts(E,V) and Pi(E,V) grids of a
+previous 2D run were not found.
+
+E: Cannot use temper/stmd with fix stmd volume
+
+Exchanges swap the 1D Ts window of the replicas, the 2D grids are not
+exchanged.
+
+E: Fix stmd molecule cannot be used with kspace
+
+Long-range interactions couple all molecules, so the force on a
+molecule would not derive from its own energy.
+
+E: Fix stmd molecule requires non-interacting molecules
+
+Each walker scales the full force on its molecule by its own Gamma,
+which only derives from the energy of that molecule when no pair
+within the force cutoff and no bonded term couples it to another
+molecule or to atoms outside the group.  Exclude those pairs with
+neigh_modify exclude molecule/inter.
+
+E: Fix stmd molecule requires a pair style with a single neighbor list
+
+Molecules are checked on the neighbor list of the pair style, pair
+hybrid keeps one list per sub-style.
+
+E: Cannot use temper/stmd with fix stmd molecule
+
+Molecule walkers each have their own Ts, replica exchange swaps the
+Ts of whole partitions.
+
+E: Illegal fix_modify neigh_adapt values
+
+Nmin must be at least 1 and not larger than Nmax, the safety factor
+must be in (0,1].
+
+E: Fix_modify neigh_adapt requires neigh_modify check yes
+
+The adapted interval only spaces the displacement checks, the
+measured bound cannot anticipate atoms that speed up later, so the
+rebuild itself must be decided by the check.
+
+E: Fix_modify overlap requires the default pe compute
+
+The overlapped reduction rebuilds the total potential energy of the
+thermo_pe compute, so it cannot be combined with fix_modify energy or
+another pe compute.
+
+E: Fix_modify overlap does not support fixes contributing to the energy
+
+Fix energies are not part of the overlapped reduction.  Use
+fix_modify overlap no when a fix has fix_modify energy yes.
+
+E: Fix_modify overlap cannot be used with volume or shared_ts
+
+Both modes update the STMD state on proc 0 only.
+
+E: Cannot open fix stmd ts_import file %s
+
+The file given to fix_modify ts_import could not be opened.
+
+E: Fix stmd ts_import file is not an oREST file
+
+The number of values in the file does not match 13 header values
+followed by Y2, Htot and PROH of equal length.  oREST files hold Ts
+divided by the ST of the run that wrote them, which is given after
+Emin and bin and must be the ST of that run, not of the current one.
+
+E: Fix stmd ts_import file has less than 2 points
+
+No usable (E,Ts) pairs were found.  Only rows with Ts > 0 are used
+and for WT files only the last block.
+
+E: Fix stmd ts_import energies are not increasing
+
+The imported points must be ordered by energy.
 
 E: Initial deltaF value too large
 
@@ -156,6 +436,80 @@ Sampled enthalpy was outside of energy specified by input file.
 This is usualy caused by either (1) improper inputs or (2) other
 problems in the simulation which cause the energy -> infinity.
 
+E: Illegal fix_modify kernel width
+
+The width of a gaussian or epanechnikov Ts update kernel must be
+positive and, in bins, smaller than the number of bins.
+
+E: Illegal fix_modify ts_tol value
+
+The Ts convergence tolerance must be >= 0. A value of 0 disables
+the convergence check and leaves STG4 to the f-tolerance.
+
+E: Fix_modify shared_ts requires MPI-3
+
+The shared Ts lives in an MPI one-sided window, LAMMPS must be built
+with an MPI library that supports MPI-3.
+
+E: Fix stmd shared_ts requires identical bins and T range
+
+All walkers sharing one Ts estimate must use the same Emin, Emax,
+bin, Tlo and Thi.
+
+E: Cannot use temper/stmd with fix stmd shared_ts
+
+Walkers sharing one Ts estimate have nothing to exchange.  Run the
+partitions with a plain run command instead.
+
+E: Illegal fix_modify volume values
+
+Vmin must be below Vmax, the volume binsize positive and the lower
+bound of the effective pressure not above the upper one.
+
+E: Fix stmd volume requires a barostat
+
+The 2D (E,V) mode learns the pressure the barostat targets, so the
+thermostat fix given to fix stmd must be an npt fix.
+
+E: Volume out of range
+
+Sampled volume was outside of the range given by fix_modify volume.
+
+E: Could not find fix_modify energy group ID
+
+Self-explanatory.
+
+E: Could not find fix_modify energy pe/atom compute
+
+The pe/atom compute created by fix_modify energy was deleted, e.g.
+by uncompute.  Repeat the fix_modify energy command.
+
+E: Fix_modify energy requires fix stmd group all
+
+The solute-solvent forces are scaled on the solvent atoms as well, so
+every atom must belong to the fix group.
+
+E: Fix_modify energy cannot be used with a barostat or volume
+
+The enthalpy and the 2D mode use the volume of the whole box, which
+is not part of the solute energy.
+
+E: Fix_modify energy cannot be used with kspace
+
+Long-range forces cannot be split into solute and solvent parts.  Use
+a pair style with cutoff Coulomb, e.g. coul/dsf or coul/wolf.
+
+E: Fix_modify energy requires a pair style with single()
+
+The solute-solvent pairs are evaluated one by one with the single()
+function of the pair style, as compute group/group does.
+
+E: Fix_modify energy solute is bonded to atoms outside its group
+
+Bonded terms are only split at the group boundary for pairs, a bond,
+angle, dihedral or improper must lie entirely inside or outside the
+solute group.
+
 E: f-value is less than unity
 
 f must always be *at least* 1. This error catches updates that
@@ -0,0 +1,645 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   Ts(E) update of STMD shared by fix stmd and tools/stmd_replay.cpp
+
+   Holds the state of one walker and the stage logic of stmd.f::stmdMAIN()
+   with the Ts update kernel, Hermite Gamma(E) and the 1/t schedule.
+   Needs nothing from LAMMPS, the owner allocates Y2, Y2old, Hist, Htot,
+   PROH, hcoef (interp_flag) and kw (kernel_flag) with N entries each,
+   nkernel+1 for kw, and sets the output streams.
+------------------------------------------------------------------------- */
+
+#ifndef LMP_STMD_CORE_H
+#define LMP_STMD_CORE_H
+
+#include <cmath>
+#include <cstdio>
+#include <cstdarg>
+
+namespace LAMMPS_NS {
+
+class StmdCore {
+ public:
+  enum{STMD_OK,STMD_BIN_RANGE,STMD_F_UNITY};     // status of advance()
+
+  int f_flag;               // determines type of f-reduction
+  int invt_flag;            // 1 once inv_t has switched to ln(f) = N/t
+  int TSC1;                 // dig reduction frequency
+  int TSC2;                 // hckh() or f-reduction frequency
+  int N;                    // number of bins
+  int BinMin;               // index of the lowest energy bin
+  int STG;                  // stage flag
+  int Count,CountH,CountPH; // histogram counts
+  int totCi;                // total counts
+  int SWf,SWchk,SWfold;     // histogram flatness checks
+  int curbin;               // current sampled bin
+  int dig_flag;             // 0 if another walker digs the shared Ts
+
+  double bin;               // binsize
+  double ST;                // kinetic temperature
+  double T;                 // latest sampled temperature
+  double Gamma;             // force scaling factor
+  double f,df;              // current f-value and delta-f
+  double T1,T2;             // scaled temperature cutoffs
+  double CTmin,CTmax;       // temperature cutoffs
+  double finFval,pfinFval;  // f-tolerance for stg 3 and stg 4
+  double HCKtol;            // histogram tolerance when chk flatness
+  double ts_tol;            // Ts change per step for STG4 with inv_t
+  double ts_change;         // running estimate of Ts change per step
+
+  double * Y2;              // statistical temperature array
+  double * Y2old;           // Ts at last TSC2 check, for ts_change
+  int * Hist, * Htot, * PROH;
+
+  int interp_flag;          // Gamma(E) interpolation: 0 = linear, 1 = hermite
+  int dirty_lo,dirty_hi;    // range of Y2 changed since last spline refresh
+  double ** hcoef;          // monotone Hermite coefficients per bin interval
+  int kernel_flag;          // Ts update kernel: 0 = none, 1 = gaussian, 2 = epanechnikov
+  int nkernel;              // half-width of update kernel in bins
+  double kernel_width;      // kernel width w in bins
+  double * kw;              // kernel weights for neighbour bins 1..nkernel
+
+  FILE * fp_screen, * fp_log; // stage messages, NULL = none
+  int debug_flag;           // 1 to trace every update to both
+
+  StmdCore() :
+    f_flag(0), invt_flag(0), TSC1(1), TSC2(1), N(0), BinMin(0), STG(1),
+    Count(0), CountH(0), CountPH(0), totCi(0), SWf(1), SWchk(1), SWfold(1),
+    curbin(0), dig_flag(1), bin(1.0), ST(1.0), T(1.0), Gamma(1.0),
+    f(1.0), df(0.0), T1(0.0), T2(0.0), CTmin(0.0), CTmax(0.0),
+    finFval(1.0), pfinFval(1.0), HCKtol(0.2), ts_tol(0.0), ts_change(0.0),
+    Y2(NULL), Y2old(NULL), Hist(NULL), Htot(NULL), PROH(NULL),
+    interp_flag(0), dirty_lo(0), dirty_hi(-1), hcoef(NULL),
+    kernel_flag(0), nkernel(1), kernel_width(0.0), kw(NULL),
+    fp_screen(NULL), fp_log(NULL), debug_flag(0) {}
+  virtual ~StmdCore() {}
+
+  // flag bins lo..hi of Y2 as changed since the last spline refresh
+
+  virtual void mark_dirty(int lo, int hi)
+  {
+    if (lo < dirty_lo || dirty_hi < dirty_lo) dirty_lo = lo;
+    if (hi > dirty_hi) dirty_hi = hi;
+  }
+
+  // called by advance() for every binned sample, after the histograms
+
+  virtual void tally_sample(int, int, double) {}
+
+  int advance(int, double);     // Translation of stmd.f::stmdMAIN(), returns status
+  int Yval(double);             // Translation of stmd.f::stmdYval()
+  void Yval_kernel(int);        // kernel-smoothed Ts update around bin
+  void GammaE(double, int);     // Translation of stmd.f::stmdGammaE()
+  void refresh_hermite();       // recompute Hermite coefficients of dirty range
+  void dig();                   // Translation of stmd.f::stmddig()
+  void TCHK();                  // Translation of stmd.f::stmdTCHK()
+  virtual void HCHK();          // Translation of stmd.f::stmdHCHK()
+  void TSCHANGE();              // update running Ts change per step
+  int kernel_size();            // set nkernel from kernel_flag and kernel_width
+  void kernel_weights();        // fill kw[0..nkernel]
+
+  // Translation of stmd.f::stmdAddedEHis()
+
+  void AddedEHis(int i)
+  {
+    Hist[i] = Hist[i] + 1;
+    Htot[i] = Htot[i] + 1;
+  }
+
+  // Translation of stdm.f::stmdResetPH()
+
+  virtual void ResetPH()
+  {
+    for (int i=0; i<N; i++) Hist[i] = 0;
+  }
+
+ protected:
+  double kernel_phi(int);       // kernel shape, 0 beyond nkernel
+
+  // stage messages to screen and log, debug() only with debug_flag
+
+  void message(const char *fmt, ...)
+  {
+    va_list ap;
+    va_start(ap,fmt);
+    vmessage(fmt,ap);
+    va_end(ap);
+  }
+
+  void debug(const char *fmt, ...)
+  {
+    if (!debug_flag) return;
+    va_list ap;
+    va_start(ap,fmt);
+    vmessage(fmt,ap);
+    va_end(ap);
+  }
+
+  void vmessage(const char *fmt, va_list ap)
+  {
+    va_list aq;
+    if (fp_screen) {
+      va_copy(aq,ap);
+      vfprintf(fp_screen,fmt,aq);
+      va_end(aq);
+    }
+    if (fp_log) {
+      va_copy(aq,ap);
+      vfprintf(fp_log,fmt,aq);
+      va_end(aq);
+    }
+  }
+};
+
+/* ---------------------------------------------------------------------- */
+
+inline void StmdCore::dig()
+{
+  int nkeepmin = 0;
+  double keepmin = Y2[nkeepmin];
+
+  for (int i=0; i<N; i++) {
+    if (Y2[i] <= keepmin) {
+      keepmin = Y2[i];
+      nkeepmin = i;
+    }
+  }
+
+  for (int i=0; i<nkeepmin; i++)
+    Y2[i] = keepmin;
+  mark_dirty(0,nkeepmin);
+}
+
+/* ---------------------------------------------------------------------- */
+
+inline int StmdCore::Yval(double sampledE)
+{
+  curbin = static_cast<int> (round(sampledE / double(bin))) - BinMin + 1;
+  int i = curbin;
+
+  // both neighbours are updated, advance() reports the failure to the caller
+  if ((i<1) || (i>N-2)) {
+    message("Error in Yval: pe=%f  bin=%f  i=%i\n",sampledE,bin,i);
+    return -1;
+  }
+
+  mark_dirty(i-nkernel,i+nkernel);
+
+  // Kernel-smoothed update over neighbouring bins
+  if (kernel_flag) {
+    Yval_kernel(i);
+    return i;
+  }
+
+  double Yhi = Y2[i+1];
+  double Ylo = Y2[i-1];
+
+  Y2[i+1] = Y2[i+1] / (1.0 - df * Y2[i+1]);
+  Y2[i-1] = Y2[i-1] / (1.0 + df * Y2[i-1]);
+
+  debug("  STMD T-UPDATE: sampledE= %f  sampledbin= %i  df=%f\n",sampledE,i,df);
+  debug("    bin %d+1: T'= %f  T=%f  delta= %f\n",i,Y2[i+1],Yhi,Y2[i+1]-Yhi);
+  debug("    bin %d-1: T'=%f  T=%f  delta= %f\n",i,Y2[i-1],Ylo,Y2[i-1]-Ylo);
+
+  if (Y2[i-1] < T1)
+    Y2[i-1] = T1;
+  if (Y2[i+1] > T2)
+    Y2[i+1] = T2;
+
+  return i;
+}
+
+/* ----------------------------------------------------------------------
+   Ts update spread over a bounded kernel phi(k) centred on bin i
+   The log-weight W(E) gains ln(f)*phi(E-E_i), so the derivative
+   1/Ts at bin i+/-k changes by -/+ df * (phi(k-1) - phi(k+1)).
+   kw[k] holds phi(k-1) - phi(k+1); kw[1] = 1 recovers Yval().
+------------------------------------------------------------------------- */
+
+inline void StmdCore::Yval_kernel(int i)
+{
+  const int kup = (nkernel < N-1-i) ? nkernel : N-1-i;
+  const int klo = (nkernel < i) ? nkernel : i;
+  double * const yup = &Y2[i];
+  double * const ylo = &Y2[i];
+  const double t1 = T1;
+  const double t2 = T2;
+
+  for (int k=1; k<=kup; k++) {
+    const double y = yup[k] / (1.0 - df * kw[k] * yup[k]);
+    yup[k] = (y > t2) ? t2 : y;
+  }
+
+  for (int k=1; k<=klo; k++) {
+    const double y = ylo[-k] / (1.0 + df * kw[k] * ylo[-k]);
+    ylo[-k] = (y < t1) ? t1 : y;
+  }
+
+  debug("  STMD T-UPDATE: kernel sampledbin= %i  width= %i  df=%f\n",
+        i,nkernel,df);
+}
+
+/* ----------------------------------------------------------------------
+   kernel shape phi(k), truncated beyond nkernel
+------------------------------------------------------------------------- */
+
+inline double StmdCore::kernel_phi(int k)
+{
+  if (k > nkernel) return 0.0;
+  const double x = double(k) / kernel_width;
+  if (kernel_flag == 1) return exp(-0.5*x*x);
+  return (x < 1.0) ? 1.0 - x*x : 0.0;
+}
+
+inline int StmdCore::kernel_size()
+{
+  if (kernel_flag == 1) nkernel = static_cast<int> (ceil(3.0*kernel_width));
+  else nkernel = static_cast<int> (ceil(kernel_width));
+  if (nkernel < 1) nkernel = 1;
+  return nkernel;
+}
+
+inline void StmdCore::kernel_weights()
+{
+  kw[0] = 0.0;
+  for (int k=1; k<=nkernel; k++)
+    kw[k] = kernel_phi(k-1) - kernel_phi(k+1);
+}
+
+/* ---------------------------------------------------------------------- */
+
+inline void StmdCore::GammaE(double sampledE, int indx)
+{
+  // Smooth Ts(E) from monotone cubic Hermite spline over bin index
+  if (interp_flag) {
+    refresh_hermite();
+    const double x = sampledE / double(bin) - BinMin + 1;
+    int j = static_cast<int> (floor(x));
+    if (j < 0) j = 0;
+    if (j > N-2) j = N-2;
+    const double t = x - j;
+    const double *c = hcoef[j];
+    T = ((c[3]*t + c[2])*t + c[1])*t + c[0];
+    Gamma = 1.0 / T;
+    return;
+  }
+
+  const int i  = indx;
+  const int im = indx - 1;
+  const int ip = indx + 1;
+
+  const double e = sampledE - double( round(sampledE / double(bin)) * bin );
+
+  if (e > 0.0) {
+    const double lam = (Y2[ip] - Y2[i]) / double(bin);
+    T = Y2[i] + lam * e;
+  } else if (e < 0.0) {
+    const double lam = (Y2[i] - Y2[im]) / double(bin);
+    T = Y2[i] + lam * e;
+  } else T = Y2[i];
+
+  Gamma = 1.0 / T;
+}
+
+/* ---------------------------------------------------------------------- */
+
+inline void StmdCore::refresh_hermite()
+{
+  if (dirty_hi < dirty_lo) return;
+
+  const int jlo = (dirty_lo-2 > 0) ? dirty_lo-2 : 0;
+  const int jhi = (dirty_hi+1 < N-2) ? dirty_hi+1 : N-2;
+
+  for (int j=jlo; j<=jhi; j++) {
+    double m[2];
+    for (int k=0; k<2; k++) {
+      const int n = j+k;
+      const double dl = (n > 0) ? Y2[n] - Y2[n-1] : Y2[n+1] - Y2[n];
+      const double dr = (n < N-1) ? Y2[n+1] - Y2[n] : dl;
+      m[k] = (dl*dr > 0.0) ? 2.0*dl*dr / (dl + dr) : 0.0;
+    }
+    const double d = Y2[j+1] - Y2[j];
+    hcoef[j][0] = Y2[j];
+    hcoef[j][1] = m[0];
+    hcoef[j][2] = 3.0*d - 2.0*m[0] - m[1];
+    hcoef[j][3] = m[0] + m[1] - 2.0*d;
+  }
+  hcoef[N-1][0] = Y2[N-1];
+  hcoef[N-1][1] = hcoef[N-1][2] = hcoef[N-1][3] = 0.0;
+
+  dirty_lo = 0;
+  dirty_hi = -1;
+}
+
+/* ---------------------------------------------------------------------- */
+
+inline void StmdCore::TCHK()
+{
+  debug("  STMD TCHK: T1= %f (%f K)  Y2[0]= %f (%f K)\n",T1,T1*ST,Y2[0],Y2[0]*ST);
+  if (Y2[0] == T1) STG = 2;
+}
+
+/* ---------------------------------------------------------------------- */
+
+inline void StmdCore::HCHK()
+{
+  SWfold = SWf;
+
+  int ichk = 0;
+  int icnt = 0;
+  double aveH = 0.0;
+
+  // check CTmin and CTmax
+  // average histogram
+  for (int i=0; i<N; i++) {
+    if ((Y2[i] > CTmin) && (Y2[i] < CTmax)) {
+      aveH = aveH + double(Hist[i]);
+      icnt++;
+    }
+  }
+
+  debug("  STMD CHK HIST: icnt= %i  aveH= %f  N= %i\n",icnt,aveH,N);
+  if (icnt==0) return;
+
+  aveH = aveH / double(icnt);
+
+  double eval;
+  for (int i=0; i<N; i++) {
+    if ((Y2[i] > CTmin) && (Y2[i] < CTmax) ) {
+      eval = fabs(double(Hist[i] - aveH) / aveH);
+      if (eval > HCKtol) ichk++;
+      debug("  STMD CHK HIST: totCi= %i  i= %i  eval= %f  HCKtol= %f  "
+            "ichk= %i  Hist[i]= %i\n",totCi,i,eval,HCKtol,ichk,Hist[i]);
+    }
+  }
+
+  if (ichk < 1) SWf = SWf + 1;
+}
+
+/* ----------------------------------------------------------------------
+   running estimate of the mean Ts change per step between TSC2 checks
+------------------------------------------------------------------------- */
+
+inline void StmdCore::TSCHANGE()
+{
+  double delta = 0.0;
+  for (int i=0; i<N; i++) {
+    delta += fabs(Y2[i] - Y2old[i]);
+    Y2old[i] = Y2[i];
+  }
+  delta = delta / (double(N) * double(TSC2));
+
+  if (ts_change == 0.0) ts_change = delta;
+  else ts_change = 0.5 * (ts_change + delta);
+}
+
+/* ----------------------------------------------------------------------
+   one STMD step at sampled energy E: Ts, Gamma, histograms and stage
+------------------------------------------------------------------------- */
+
+inline int StmdCore::advance(int istep, double sampledE)
+{
+  Count = istep;
+  totCi++;
+
+  if (STG >= 3) CountPH++;
+
+  debug("STMD DEBUG: STAGE %i\n",STG);
+  debug("  STMD: Count=%i, f=%f\n",Count,f);
+
+  // 1/t phase: ln(f) = N/t until frozen in STG4
+  if (invt_flag && (STG == 3)) {
+    df = double(N) * 0.5 / (bin * double(totCi));
+    f = exp(2 * bin * df);
+  }
+
+  // Statistical Temperature Update
+  int stmdi = Yval(sampledE);
+  if (stmdi < 0) return STMD_BIN_RANGE;
+
+  // Gamma Update
+  GammaE(sampledE,stmdi);
+
+  debug("  STMD: totCi= %i Gamma= %f Hist[%i]= %i "
+        "T= %f\n",totCi,Gamma,stmdi,Hist[stmdi],T);
+
+  // Histogram Update
+  AddedEHis(stmdi);
+  CountH++;
+
+  // Add to Histogram for production run
+  if (STG >= 3) {
+    PROH[stmdi]++;
+    CountPH++;
+  }
+
+  tally_sample(istep,stmdi,sampledE);
+
+  // Production Run if STG >= 3
+  // STG3 START: Check histogram and further reduce f until cutoff
+  if (STG >= 3) {
+    int m = istep % TSC2;
+
+    // STMD, reduce f based on histogram flatness (original form)
+    if (m == 0) {
+      debug("  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
+
+      // Reduction based on histogram flatness
+      if (f_flag == 1) {
+        HCHK(); // Check flatness
+        debug("  STMD: SWfold= %i  SWf= %i\n",SWfold,SWf);
+        debug("  STMD: f= %f  SWchk= %i\n",f,SWchk);
+        if (SWfold != SWf) {
+          if (STG == 3) // dont reduce if STG4
+            f = sqrt(f); // reduce f
+          df = log(f) * 0.5 / bin;
+          debug("  STMD f-UPDATE: f= %f  SWf= %i  df= %f\n",f,SWf,df);
+          SWchk = 1;
+          // Histogram reset
+          ResetPH();
+          CountH = 0;
+        }
+        else {
+          SWchk++;
+          debug("  STMD: f= %f  Swchk= %i T= %f\n",f,SWchk,T);
+        }
+      } // if (f_flag == 1)
+
+      if ((f_flag > 1) && (f_flag < 5)) {
+        debug("  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
+        if (STG == 3) // dont reduce if STG4
+          f = sqrt(f);
+        df = log(f) * 0.5 / bin;
+        debug("  STMD f-UPDATE: f= %f  df= %f\n",f,df);
+
+        // Histogram reset
+        ResetPH();
+        CountH = 0;
+      } // if (f_flag > 1)
+
+      // 1/t reduction: stop once Ts has stopped changing
+      if (f_flag == 5) {
+        TSCHANGE();
+        debug("  STMD 1/t: f= %f  df= %g  dTs/step= %g\n",f,df,ts_change);
+        if ((ts_tol > 0.0) && (ts_change < ts_tol) && (STG == 3)) {
+          STG = 4;
+          message("  STMD: Ts converged at step %i, dTs/step= %g, STG= 4\n",
+                  istep,ts_change);
+        }
+      } else TSCHANGE();
+
+      // Check stage 3
+      if (f <= finFval) STG = 4;
+    } // if ((m == 0)
+  } // if (STG >= 3)
+
+  // STG2 START: Check histogram and modify f value on STG2
+  // If STMD, run until histogram is flat, then reduce f value
+  // else if RESTMD, reduce every TSC2 steps
+  if (STG == 2) {
+
+    int m = istep % TSC2;
+    if (m == 0) {
+      debug("  STMD: istep= %i  TSC2= %i\n",istep,TSC2);
+
+      // No f-reduction, simulate at initf only!
+      if (f_flag == 0) {
+        ResetPH();
+        CountH = 0;
+      }
+
+      // Standard f-reduction as HCHK() every m steps
+      if (f_flag == 1) {
+        HCHK();
+        debug("  STMD: SWfold= %i SWf= %i\n",SWfold,SWf);
+        // f value update
+        if (SWfold != SWf) {
+          f = sqrt(f);
+          df = log(f) * 0.5 / bin;
+          debug("  STMD f-UPDATE: f= %f  SWf= %i  df= %f\n",f,SWf,df);
+          SWchk = 1;
+          ResetPH();
+          CountH = 0;
+        }
+        else SWchk++;
+
+        debug("  STMD RESULTS: totCi= %i  f= %f  SWf= %i  SWchk= %i  "
+              "STG= %i\n",totCi,f,SWf,SWchk,STG);
+        if (f <= pfinFval) {
+          STG = 3;
+          CountPH = 0;
+          SWchk = 1;
+          ResetPH();
+          CountH = 0;
+        }
+      } // if (f_flag == 1)
+
+      if (f_flag == 2) {
+      // Reduce as sqrtf every m steps
+        if (istep != 0) {
+          f = sqrt(f);
+          df = log(f) * 0.5 / bin;
+        }
+
+        ResetPH();
+        CountH = 0;
+      } // if (f_flag == 2)
+
+      // Reduce f by constant every m steps
+      // otherwise, reduce by sqrt(f) if too small
+      if (f_flag == 3) {
+        double reduce_val = 0.1;
+        if (istep != 0) {
+          if (f > (1+(2*reduce_val)))
+            f = f - (reduce_val*f);
+          else f = sqrt(f);
+        }
+        df = log(f) * 0.5 / bin;
+        ResetPH();
+        CountH = 0;
+      } // if (f_flag == 3)
+
+      // Reduce df by constant every m steps
+      if (f_flag == 4) {
+        double reduce_val = 0.01; // 1% reduction
+        if (istep != 0) {
+          df = df - (df * reduce_val);
+          f = exp(2 * bin * df);
+        }
+      } // if (f_flag == 4)
+
+      if (f <= 1.0) return STMD_F_UNITY;
+
+      if (f_flag > 1) debug("  STMD f-UPDATE: f= %f  df= %f\n",f,df);
+
+      if ((f <= pfinFval) && (f_flag > 1) && (f_flag < 5)) {
+        STG = 3;
+        CountPH = 0;
+      }
+
+      // Flatness-driven reduction until ln(f) drops below N/t,
+      // then hand over to the 1/t schedule in STG3
+      if (f_flag == 5) {
+        HCHK();
+        if (SWfold != SWf) {
+          f = sqrt(f);
+          df = log(f) * 0.5 / bin;
+          SWchk = 1;
+          ResetPH();
+          CountH = 0;
+        } else SWchk++;
+
+        if ((log(f) <= double(N) / double(totCi)) || (f <= pfinFval)) {
+          STG = 3;
+          invt_flag = 1;
+          CountPH = 0;
+          SWchk = 1;
+          ResetPH();
+          CountH = 0;
+          message("  STMD: switching to 1/t reduction at step %i, f= %f\n",istep,f);
+        }
+      }
+
+      TSCHANGE();
+
+    } // if (m == 0)
+  } // if (STG == 2)
+
+  // STG1 START: Digging and chk stage on STG1
+  // Run until lowest temperature sampled
+  if (STG == 1) {
+    int m = istep % TSC1;
+    if ((m == 0) && (istep != 0)) {
+      message("  STMD DIG: istep=%i  TSC1=%i Tlow=%f\n",istep,TSC1,T);
+
+      if (dig_flag) dig();
+      TCHK();
+
+      // Histogram reset
+      if (STG > 1) {
+        ResetPH();
+        CountH = 0;
+      }
+    } // if (m == 0)
+  } // if (STG == 1)
+
+  debug("STMD NEXT STG= %i\n",STG);
+
+  return STMD_OK;
+}
+
+}
+
+#endif
@@ -0,0 +1,117 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   ST-WHAM solve shared by temper/stmd and tools/stwham.cpp
+
+   CITE: http://dx.doi.org/10.1063/1.3626150
+   Kim, J., Keyes, T., & Straub, J. E. (2011)
+
+   Histograms hist[i*nrep+l] and scaled sampling temperatures
+   ts[i*nrep+l] of set temp l on one common grid of nbin bins.
+   Needs nothing from LAMMPS.
+------------------------------------------------------------------------- */
+
+#ifndef LMP_STWHAM_SOLVE_H
+#define LMP_STWHAM_SOLVE_H
+
+#include <cmath>
+
+namespace LAMMPS_NS {
+
+class StwhamSolve {
+ public:
+  int nbin,nrep;            // bins of the common grid, set temps
+  double bin;               // binsize
+  double kb;                // Boltzmann constant in the units of E
+  double T0;                // kinetic temperature that scales ts
+  double limit;             // checkLIMIT, smallest fraction of samples per bin
+
+  // samples per bin in htot, returns all samples
+
+  double totals(const double *hist, double *htot) const
+  {
+    double ntot = 0.0;
+    for (int i = 0; i < nbin; i++) {
+      htot[i] = 0.0;
+      for (int l = 0; l < nrep; l++) htot[i] += hist[i*nrep+l];
+      ntot += htot[i];
+    }
+    return ntot;
+  }
+
+  // throw out edge data under checkLIMIT, bins [bstart,bstop) are kept,
+  // bstart or bstop is -1 if the low or high end has no such bin
+
+  void edges(const double *htot, double ntot, int &bstart, int &bstop) const
+  {
+    bstart = bstop = -1;
+    if (ntot <= 0.0) return;
+    for (int i = 0; i < nbin; i++)
+      if (htot[i]/ntot > limit) {
+        bstart = i + 3;
+        break;
+      }
+    if (bstart < 0) return;
+    for (int i = nbin-1; i > bstart; i--)
+      if (htot[i]/ntot > limit) {
+        bstop = i - 3;
+        break;
+      }
+  }
+
+  // Ts(H) in [bstart,bstop) from the combined histogram and the sampling
+  // weights, S(H) by linear interpolation of Ts(H) as a running sum;
+  // returns the number of non-positive ts that were replaced by 0.001
+
+  int solve(const double *hist, const double *htot, double ntot,
+            const double *ts, int bstart, int bstop,
+            double *TH, double *Ent, double *betaH, double *betaW) const
+  {
+    int nneg = 0;
+    for (int i = 0; i < nbin; i++)
+      TH[i] = Ent[i] = betaH[i] = betaW[i] = 0.0;
+
+    for (int i = bstart; i < bstop; i++) {
+      if ((htot[i+1]/ntot > limit) && (htot[i-1]/ntot > limit))
+        betaH[i] = log(htot[i+1]/htot[i-1]) / (2.0*bin/kb);
+
+      if (htot[i] > 0.0)
+        for (int l = 0; l < nrep; l++) {
+          const double h = hist[i*nrep+l];
+          if (h == 0.0) continue;
+          const double y2 = ts[i*nrep+l];
+          double beta;
+          if (y2 <= 0.0) {
+            beta = 1.0/0.001;
+            nneg++;
+          } else beta = 1.0/(y2*T0);
+          betaW[i] += h/htot[i] * beta;
+        }
+      TH[i] = 1.0/(betaH[i] + betaW[i]);
+    }
+
+    for (int i = bstart+2; i < bstop; i++) {
+      const int k = i-1;
+      double dS;
+      if (TH[k] == TH[k-1]) dS = bin/TH[k];
+      else dS = bin/(TH[k]-TH[k-1])*log(TH[k]/TH[k-1]);
+      Ent[i] = Ent[i-1] + dS;
+    }
+    return nneg;
+  }
+};
+
+}
+
+#endif
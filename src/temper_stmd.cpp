@@ -20,6 +20,9 @@
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <vector>
 #include "temper_stmd.h"
 #include "universe.h"
 #include "domain.h"
@@ -39,9 +42,19 @@
 #include "error.h"
 #include <fstream>
 #include "fix_stmd.h"
+#include "stwham_solve.h"
 
 using namespace LAMMPS_NS;
 
+#define NHEADER 5
+#define TUNE_GAIN 0.25
+#define EXLOG_CHECK 1024
+#define AGG_HEADER 4
+#define FRAME_HEADER (sizeof(bigint) + sizeof(int) + 6*sizeof(double))
+
+#define MIN(A,B) ((A) < (B) ? (A) : (B))
+#define MAX(A,B) ((A) > (B) ? (A) : (B))
+
 //#define TEMPER_DEBUG 1
 
 /* ---------------------------------------------------------------------- */
@@ -59,6 +72,12 @@ TemperStmd::~TemperStmd()
   delete [] temp2world;
   delete [] world2temp;
   delete [] world2root;
+  delete [] set_press;
+  delete [] exlog_file;
+  delete [] frame_prefix;
+  delete [] agg_prefix;
+  delete [] ckpt_file;
+  delete [] resume_file;
   delete [] id_nh;
 }
 
@@ -72,7 +91,7 @@ void TemperStmd::command(int narg, char **arg )
     error->all(FLERR,"Must have more than one processor partition to temper");
   if (domain->box_exist == 0)
     error->all(FLERR,"Temper command before simulation box is defined");
-  if (narg != 7 && narg != 8)
+  if (narg < 7)
     error->universe_all(FLERR,"Illegal temper command");
 
   int nsteps = force->inumeric(FLERR,arg[0]);
@@ -95,11 +114,14 @@ void TemperStmd::command(int narg, char **arg )
   Fix *nh = modify->fix[ifix];
 
   // find out if npt or nvt
+  // barostat targets are kept to reset them when pressures are swapped
   double pressref = 0;
-  int pressflag = fix_stmd->pressflag;
+  pressflag = fix_stmd->pressflag;
+  nh_pstart = nh_pstop = NULL;
   if (pressflag) {
-    double *p_start = (double *) nh->extract("p_start",ifix);
-    pressref = p_start[0];
+    nh_pstart = (double *) nh->extract("p_start",ifix);
+    nh_pstop = (double *) nh->extract("p_stop",ifix);
+    pressref = nh_pstart[0];
   }
 
   double *temp = (double *) nh->extract("t_start",ifix);
@@ -108,16 +130,91 @@ void TemperStmd::command(int narg, char **arg )
   seed_boltz = force->inumeric(FLERR,arg[5]);
 
   // Exchange flag, 0 if swap off (run many replicas without exchange)
-  // 1 if swap on.
+  // 1 if swap on, 2 to turn swaps on once all replicas leave STG1
   if (strcmp(arg[6],"off") == 0)
     EX_flag = 0;
   else if (strcmp(arg[6],"on") == 0)
     EX_flag = 1;
+  else if (strcmp(arg[6],"auto") == 0)
+    EX_flag = 2;
   else
     error->all(FLERR,"RESTMD: illegal exchange option");
 
+  // optional walker index, then keywords
   my_set_temp = universe->iworld;
-  if (narg == 8) my_set_temp = force->inumeric(FLERR,arg[7]);
+  int iarg = 7;
+  if ((narg > 7) && isdigit(arg[7][0])) {
+    my_set_temp = force->inumeric(FLERR,arg[7]);
+    iarg = 8;
+  }
+
+  tune_every = tune_stop = 0;
+  nP = 1;
+  exlog_file = frame_prefix = agg_prefix = NULL;
+  ckpt_file = resume_file = NULL;
+  frame_every = frame_natoms = 0;
+  nframe = 0;
+  stwham_flag = stwham_every = 0;
+  stwham_limit = 0.0;
+  while (iarg < narg) {
+    if (strcmp(arg[iarg],"tune") == 0) {
+      if (iarg+3 > narg) error->universe_all(FLERR,"Illegal temper command");
+      tune_every = force->inumeric(FLERR,arg[iarg+1]);
+      tune_stop = force->inumeric(FLERR,arg[iarg+2]);
+      if ((tune_every <= 0) || (tune_stop < 0))
+        error->universe_all(FLERR,"Illegal temper command");
+      iarg += 3;
+    } else if (strcmp(arg[iarg],"press") == 0) {
+      if (iarg+2 > narg) error->universe_all(FLERR,"Illegal temper command");
+      nP = force->inumeric(FLERR,arg[iarg+1]);
+      if ((nP < 1) || (universe->nworlds % nP != 0))
+        error->universe_all(FLERR,"Illegal temper command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg],"exlog") == 0) {
+      if (iarg+2 > narg) error->universe_all(FLERR,"Illegal temper command");
+      delete [] exlog_file;
+      exlog_file = new char[strlen(arg[iarg+1])+1];
+      strcpy(exlog_file,arg[iarg+1]);
+      iarg += 2;
+    } else if (strcmp(arg[iarg],"frames") == 0) {
+      if (iarg+3 > narg) error->universe_all(FLERR,"Illegal temper command");
+      frame_every = force->inumeric(FLERR,arg[iarg+1]);
+      if (frame_every <= 0) error->universe_all(FLERR,"Illegal temper command");
+#ifndef STMD_MPIIO
+      error->universe_all(FLERR,"RESTMD frames require MPI-IO");
+#endif
+      delete [] frame_prefix;
+      frame_prefix = new char[strlen(arg[iarg+2])+1];
+      strcpy(frame_prefix,arg[iarg+2]);
+      iarg += 3;
+    } else if (strcmp(arg[iarg],"checkpoint") == 0) {
+      if (iarg+2 > narg) error->universe_all(FLERR,"Illegal temper command");
+      delete [] ckpt_file;
+      ckpt_file = new char[strlen(arg[iarg+1])+1];
+      strcpy(ckpt_file,arg[iarg+1]);
+      iarg += 2;
+    } else if (strcmp(arg[iarg],"resume") == 0) {
+      if (iarg+2 > narg) error->universe_all(FLERR,"Illegal temper command");
+      delete [] resume_file;
+      resume_file = new char[strlen(arg[iarg+1])+1];
+      strcpy(resume_file,arg[iarg+1]);
+      iarg += 2;
+    } else if (strcmp(arg[iarg],"aggregate") == 0) {
+      if (iarg+2 > narg) error->universe_all(FLERR,"Illegal temper command");
+      delete [] agg_prefix;
+      agg_prefix = new char[strlen(arg[iarg+1])+1];
+      strcpy(agg_prefix,arg[iarg+1]);
+      iarg += 2;
+    } else if (strcmp(arg[iarg],"stwham") == 0) {
+      if (iarg+3 > narg) error->universe_all(FLERR,"Illegal temper command");
+      stwham_flag = 1;
+      stwham_every = force->inumeric(FLERR,arg[iarg+1]);
+      stwham_limit = force->numeric(FLERR,arg[iarg+2]);
+      if ((stwham_every < 0) || (stwham_limit < 0.0))
+        error->universe_all(FLERR,"Illegal temper command");
+      iarg += 3;
+    } else error->universe_all(FLERR,"Illegal temper command");
+  }
 
   // swap frequency must evenly divide total # of timesteps
   if (nevery == 0)
@@ -129,6 +226,22 @@ void TemperStmd::command(int narg, char **arg )
   // fix style must be appropriate for temperature control
   if ((strcmp(modify->fix[whichfix]->style,"stmd") != 0)) 
     error->universe_all(FLERR,"Must use with fix STMD, fix is not valid");
+  if (fix_stmd->shared_flag)
+    error->universe_all(FLERR,"Cannot use temper/stmd with fix stmd shared_ts");
+  if (fix_stmd->mol_flag)
+    error->universe_all(FLERR,"Cannot use temper/stmd with fix stmd molecule");
+  if (fix_stmd->vol_flag)
+    error->universe_all(FLERR,"Cannot use temper/stmd with fix stmd volume");
+  if ((nP > 1) && !pressflag)
+    error->universe_all(FLERR,"RESTMD: press requires fix npt in every replica");
+  if ((nP > 1) && tune_every)
+    error->universe_all(FLERR,"RESTMD: tune is only supported for a 1D ladder");
+  if ((nP > 1) && stwham_flag)
+    error->universe_all(FLERR,"RESTMD: stwham is only supported for a 1D ladder");
+  nT = universe->nworlds / nP;
+
+  // the fix opens no per walker output files in aggregated mode
+  if (agg_prefix) fix_stmd->aggregate_flag = 1;
 
   // setup for long tempering run
   update->whichflag = 1;
@@ -147,12 +260,17 @@ void TemperStmd::command(int narg, char **arg )
   iworld = universe->iworld;
   boltz = force->boltz;
 
+  // energy grid of my fix stmd, may differ between replicas
+  int dim;
+  Emin = *((double *) fix_stmd->extract("Emin",dim));
+  Emax = *((double *) fix_stmd->extract("Emax",dim));
+  bin = *((double *) fix_stmd->extract("bin",dim));
+
   // Setup Swap information
-  int nlocal_values = fix_stmd->N + 2; // length of Y2 array + {TL and TH} + extra?
-  int nglobal_values = nlocal_values * (nworlds);
-  double *local_values = global_values = NULL;
+  // {N, E of bin 0, bin, TL, TH} header followed by the Y2 array
+  int nlocal_values = fix_stmd->N + NHEADER;
+  local_values = global_values = NULL;
   memory->create(local_values,nlocal_values,"temper/stmd:local_values");
-  memory->create(global_values,nglobal_values,"temper/stmd:global_values");
 
   // pe_compute = ptr to thermo_pe compute
   // notify compute it will be called at first swap
@@ -167,6 +285,60 @@ void TemperStmd::command(int narg, char **arg )
   else color = 1;
   MPI_Comm_split(universe->uworld,color,0,&roots);
 
+  // aggregated output restores the walkers before anything reads them
+  if (agg_prefix) setup_aggregate();
+
+  // replicas may carry different grids, so gather the payload sizes
+  memory->create(value_counts,nworlds,"temper/stmd:value_counts");
+  memory->create(value_displs,nworlds,"temper/stmd:value_displs");
+  if (me == 0)
+    MPI_Allgather(&nlocal_values,1,MPI_INT,value_counts,1,MPI_INT,roots);
+  MPI_Bcast(value_counts,nworlds,MPI_INT,0,world);
+  int nglobal_values = 0;
+  for (int i = 0; i < nworlds; i++) {
+    value_displs[i] = nglobal_values;
+    nglobal_values += value_counts[i];
+  }
+  memory->create(global_values,nglobal_values,"temper/stmd:global_values");
+
+  // common energy grid for in-situ ST-WHAM, spanning all replica grids
+  // histograms are only kept on root procs
+  stwham_offset = proh_last = NULL;
+  stwham_hist = NULL;
+  if (stwham_flag && (me == 0)) {
+    double mine_grid[2],*grids;
+    mine_grid[0] = fix_stmd->bin_energy(0);
+    mine_grid[1] = bin;
+    memory->create(grids,2*nworlds,"temper/stmd:grids");
+    MPI_Allgather(mine_grid,2,MPI_DOUBLE,grids,2,MPI_DOUBLE,roots);
+    stwham_emin = grids[0];
+    int ntop = 0;
+    for (int i = 0; i < nworlds; i++) {
+      if (fabs(grids[2*i+1] - bin) > 1.0e-10*bin)
+        error->one(FLERR,"RESTMD: stwham requires the same bin size in all replicas");
+      stwham_emin = MIN(stwham_emin,grids[2*i]);
+    }
+    memory->create(stwham_offset,nworlds,"temper/stmd:stwham_offset");
+    for (int i = 0; i < nworlds; i++) {
+      const double x = (grids[2*i]-stwham_emin)/bin;
+      if (fabs(x - round(x)) > 1.0e-6)
+        error->one(FLERR,"RESTMD: stwham requires energy grids aligned "
+                   "on a common bin");
+      stwham_offset[i] = static_cast<int> (round(x));
+      ntop = MAX(ntop,stwham_offset[i] + value_counts[i] - NHEADER);
+    }
+    stwham_nbin = ntop;
+    memory->destroy(grids);
+
+    memory->create(stwham_hist,stwham_nbin*nworlds,"temper/stmd:stwham_hist");
+    for (int i = 0; i < stwham_nbin*nworlds; i++) stwham_hist[i] = 0.0;
+
+    // production before this run is not attributed to any set temp
+    const int *proh = (int *) fix_stmd->extract("PROH",dim);
+    memory->create(proh_last,fix_stmd->N,"temper/stmd:proh_last");
+    for (int i = 0; i < fix_stmd->N; i++) proh_last[i] = proh[i];
+  }
+
   // RNGs for swaps and Boltzmann test
   // warm up Boltzmann RNG
   if (seed_swap) ranswap = new RanPark(lmp,seed_swap);
@@ -200,6 +372,54 @@ void TemperStmd::command(int narg, char **arg )
   }
   MPI_Bcast(temp2world,nworlds,MPI_INT,0,world);
 
+  // static list of reference pressures by set temp
+  // set temp s sits at (s % nT, s / nT) of the nT x nP grid
+  set_press = new double[nworlds];
+  if (me == 0) {
+    double *byworld = new double[nworlds];
+    MPI_Allgather(&pressref,1,MPI_DOUBLE,byworld,1,MPI_DOUBLE,roots);
+    for (int i = 0; i < nworlds; i++) set_press[world2temp[i]] = byworld[i];
+    delete [] byworld;
+  }
+  MPI_Bcast(set_press,nworlds,MPI_DOUBLE,0,world);
+
+  // per-pair swap statistics for ladder tuning
+  // pair k is between set temps k and k+1
+  memory->create(pair_attempt,nworlds,"temper/stmd:pair_attempt");
+  memory->create(pair_accept,nworlds,"temper/stmd:pair_accept");
+  for (int i = 0; i < nworlds; i++) pair_attempt[i] = pair_accept[i] = 0;
+
+  // continue a previous temper/stmd run exactly where it stopped
+  swap_base = 0;
+  if (resume_file) read_checkpoint();
+
+  // checkpoints follow the oREST output of world 0, all roots write together
+  int rstfrq = *((int *) fix_stmd->extract("RSTFRQ",dim));
+  MPI_Bcast(&rstfrq,1,MPI_INT,0,universe->uworld);
+
+  // binary exchange log and its checkpoint index, universe root only
+  fp_exlog = fp_exidx = NULL;
+  exlog_count = 0;
+  prev_world2temp = NULL;
+  if (exlog_file && (me_universe == 0)) {
+    char filename[512];
+    fp_exlog = fopen(exlog_file,"wb");
+    snprintf(filename,512,"%s.idx",exlog_file);
+    fp_exidx = fopen(filename,"wb");
+    if ((fp_exlog == NULL) || (fp_exidx == NULL))
+      error->one(FLERR,"Cannot open RESTMD exchange log");
+    fwrite("RESTMDX1",sizeof(char),8,fp_exlog);
+    fwrite(&nworlds,sizeof(int),1,fp_exlog);
+    fwrite("RESTMDI1",sizeof(char),8,fp_exidx);
+    fwrite(&nworlds,sizeof(int),1,fp_exidx);
+    prev_world2temp = new int[nworlds];
+    for (int i = 0; i < nworlds; i++) prev_world2temp[i] = world2temp[i];
+    write_exlog_checkpoint();
+  }
+
+  // per set temp frame files, open for the whole run
+  if (frame_every) open_frames();
+
   // if restarting tempering, reset temp target of Fix to current my_set_temp
   // This should be handled by fix_stmd
   /*
@@ -209,9 +429,14 @@ void TemperStmd::command(int narg, char **arg )
   }
   */
 
+  // {set temp, STG} of every world for automatic exchanges
+  memory->create(world_stg,2*nworlds,"temper/stmd:world_stg");
+
   // setup tempering runs
-  int which,partner,swap,partner_set_temp,partner_world,dim;
+  int which,partner,swap,partner_set_temp,partner_world;
+  int dimP,icoord,ncoord,partner_coord;
   double pe,pe_partner,boltz_factor;
+  double mine[9],theirs[9],wmine[2],wtheirs[2];
   double* sampled;
 
   int stg_flag = 0;
@@ -220,7 +445,8 @@ void TemperStmd::command(int narg, char **arg )
 
   MPI_Reduce(&stg_flag_me,&stg_flag,1,MPI_INT,MPI_SUM,0,universe->uworld);
 
-  if ((me_universe == 0) && (stg_flag > (universe->nprocs - nworlds)))
+  if ((me_universe == 0) && (EX_flag == 1) &&
+      (stg_flag > (universe->nprocs - nworlds)))
     error->universe_warn(FLERR,"RESTMD still in STAGE1, ensure exchanges "
         "turned off");
 
@@ -263,18 +489,37 @@ void TemperStmd::command(int narg, char **arg )
     current_STG = fix_stmd->STG;
     T_me = (fix_stmd->T)*(fix_stmd->ST);
 
+    // production since the last exchange belongs to my current set temp
+    if (stwham_flag && (me == 0)) stwham_accumulate();
+
+    // so does the configuration at the exchange step
+    if (frame_every && ((iswap+1) % frame_every == 0)) write_frame();
+
+    // with pressures, swaps alternate between the T and the P direction
+    // the phase counts swaps of all resumed runs
+    const bigint nswap = swap_base + iswap;
+    dimP = (nP > 1) ? static_cast<int> (nswap % 2) : 0;
+    const bigint sweep = (nP > 1) ? (nswap / 2) : nswap;
+
     // which = which of 2 kinds of swaps to do (0,1)
-    if (!ranswap) which = iswap % 2;
+    if (!ranswap) which = static_cast<int> (sweep % 2);
     else if (ranswap->uniform() < 0.5) which = 0;
     else which = 1;
 
     // partner_set_temp = which set temp I am partnering with for this swap
+    icoord = dimP ? (my_set_temp / nT) : (my_set_temp % nT);
+    ncoord = dimP ? nP : nT;
     if (which == 0) {
-      if (my_set_temp % 2 == 0) partner_set_temp = my_set_temp + 1;
-      else partner_set_temp = my_set_temp - 1;
+      if (icoord % 2 == 0) partner_coord = icoord + 1;
+      else partner_coord = icoord - 1;
     } else {
-      if (my_set_temp % 2 == 1) partner_set_temp = my_set_temp + 1;
-      else partner_set_temp = my_set_temp - 1;
+      if (icoord % 2 == 1) partner_coord = icoord + 1;
+      else partner_coord = icoord - 1;
+    }
+    partner_set_temp = -1;
+    if ((partner_coord >= 0) && (partner_coord < ncoord)) {
+      if (dimP) partner_set_temp = partner_coord*nT + (my_set_temp % nT);
+      else partner_set_temp = (my_set_temp / nT)*nT + partner_coord;
     }
 
     // partner = proc ID to swap with
@@ -289,19 +534,55 @@ void TemperStmd::command(int narg, char **arg )
     // RESTMD Acceptance Criteria
     swap = 0;
     if (partner != -1) {
-      if (me_universe > partner) {
-        MPI_Send(&pe,1,MPI_DOUBLE,partner,0,universe->uworld);
-        MPI_Send(&T_me,1,MPI_DOUBLE,partner,0,universe->uworld);
-      }
-      else {
-        MPI_Recv(&pe_partner,1,MPI_DOUBLE,partner,0,universe->uworld,MPI_STATUS_IGNORE);
-        MPI_Recv(&T_partner,1,MPI_DOUBLE,partner,0,universe->uworld,MPI_STATUS_IGNORE);
-      }
-
+      // energy, Ts, energies of the end bins, potential energy and
+      // volume of each replica
+      mine[0] = pe;
+      mine[1] = T_me;
+      mine[2] = fix_stmd->bin_energy(0);
+      mine[3] = fix_stmd->bin_energy(fix_stmd->N-1);
+      mine[4] = *((double *) fix_stmd->extract("sampledU",dim));
+      mine[5] = *((double *) fix_stmd->extract("sampledV",dim));
+      ts_window(&mine[6]);
+      MPI_Sendrecv(mine,9,MPI_DOUBLE,partner,0,theirs,9,MPI_DOUBLE,partner,0,
+                   universe->uworld,MPI_STATUS_IGNORE);
+      pe_partner = theirs[0];
+      T_partner = theirs[1];
+
+      // exact change of my weight S/k when my Ts moves to the partner
+      // configuration, S integrated from my piecewise linear Ts(E);
+      // for a pressure swap the partner enthalpy is taken at my pressure
+      const double h_new = dimP ? theirs[4] +
+        set_press[my_set_temp]*theirs[5]/force->nktv2p : pe_partner;
+      wmine[0] = fix_stmd->in_range(h_new) ? 1.0 : 0.0;
+      wmine[1] = wmine[0] ?
+        fix_stmd->entropy_at(h_new) - fix_stmd->entropy_at(pe) : 0.0;
+      if (me_universe > partner)
+        MPI_Send(wmine,2,MPI_DOUBLE,partner,0,universe->uworld);
+      else
+        MPI_Recv(wtheirs,2,MPI_DOUBLE,partner,0,universe->uworld,
+                 MPI_STATUS_IGNORE);
+
+      // Ts windows are only known on the grid they were learned on:
+      // both configurations must lie on the incoming grid, and each
+      // window, saturated at T1 and T2 on its own grid, must fit inside
+      // the grid it moves to, so mapping holds Ts at valid end values;
+      // replicas with the same end bins need no extrapolation
       if (me_universe < partner) {
-        boltz_factor = (pe_partner - pe)*(1.0/(boltz*T_partner) - 1.0/(boltz*T_me));
-        if (boltz_factor >= 0.0) swap = 1;
+        const int same = (theirs[2] == mine[2]) && (theirs[3] == mine[3]);
+        const int covered = same ||
+          ((mine[8] != 0.0) && (theirs[8] != 0.0) &&
+           (theirs[6] >= mine[2]) && (theirs[7] <= mine[3]) &&
+           (mine[6] >= theirs[2]) && (mine[7] <= theirs[3]));
+        boltz_factor = -(wmine[1] + wtheirs[1]);
+        if (!covered || (wmine[0] == 0.0) || (wtheirs[0] == 0.0)) swap = 0;
+        else if (boltz_factor >= 0.0) swap = 1;
         else if (ranboltz->uniform() < exp(boltz_factor)) swap = 1;
+
+        if (!dimP) {
+          const int ipair = MIN(my_set_temp,partner_set_temp);
+          pair_attempt[ipair]++;
+          if (swap) pair_accept[ipair]++;
+        }
       }
 
       // Check what stage, if STG1, no swap
@@ -312,7 +593,7 @@ void TemperStmd::command(int narg, char **arg )
       else
         MPI_Recv(&swap,1,MPI_INT,partner,0,universe->uworld,MPI_STATUS_IGNORE);
 
-      if (EX_flag == 0) swap = 0; //If 0, exchanges turned off
+      if (EX_flag != 1) swap = 0; //If 0 or still waiting, exchanges turned off
 
 #ifdef TEMPER_DEBUG
       if ((me_universe < partner) && (universe->uscreen)) {
@@ -323,43 +604,77 @@ void TemperStmd::command(int narg, char **arg )
 
     }
 
-    // bcast swap result to other procs in my world
+    // bcast swap result and partner to other procs in my world
     MPI_Bcast(&swap,1,MPI_INT,0,world);
+    if (swap) MPI_Bcast(&partner_world,1,MPI_INT,0,world);
 
     // get information that is being swapped, pack into local_values, gather
     // then bcast to all worlds. All procs pack values for walker into local array
+    local_values[0] = fix_stmd->N;
+    local_values[1] = fix_stmd->bin_energy(0);
+    local_values[2] = bin;
+    local_values[3] = fix_stmd->T1; //TLOW
+    local_values[4] = fix_stmd->T2; //THIGH
     for (int i=0; i<fix_stmd->N; i++) 
-      local_values[i] = fix_stmd->Y2[i];
-    local_values[fix_stmd->N] = fix_stmd->T1; //TLOW
-    local_values[fix_stmd->N+1] = fix_stmd->T2; //THIGH
+      local_values[NHEADER+i] = fix_stmd->Y2[i];
 
     // Gather all local_values from replicas
     if (me == 0) 
-      MPI_Allgather(local_values,nlocal_values,MPI_DOUBLE,\
-          global_values,nlocal_values,MPI_DOUBLE,roots);
+      MPI_Allgatherv(local_values,nlocal_values,MPI_DOUBLE,global_values,
+          value_counts,value_displs,MPI_DOUBLE,roots);
 
     // Share global_values with universe
     MPI_Bcast(global_values,nglobal_values,MPI_DOUBLE,0,world);
 
     // if my world swapped, all procs in world reset variables in fix_stmd
     if (swap) {
-      // Swap values and unpack from global_values
-      const int indx = partner_world*nlocal_values;
-      memcpy(&local_values[0],&global_values[indx],nlocal_values*sizeof(double));
-      // update fix_stmd with swapped values
-      for (int i=0; i<fix_stmd->N; i++) 
-        fix_stmd->Y2[i] = local_values[i];
-      fix_stmd->T1 = local_values[fix_stmd->N];
-      fix_stmd->T2 = local_values[fix_stmd->N+1];
+      // Unpack partner values and map its Ts onto my grid
+      const double *partner_values = &global_values[value_displs[partner_world]];
+      const int npartner = static_cast<int> (partner_values[0]);
+      fix_stmd->map_temperature(&partner_values[NHEADER],npartner,
+                                partner_values[1],partner_values[2]);
+      fix_stmd->T1 = partner_values[3];
+      fix_stmd->T2 = partner_values[4];
+
+      // take over the reference pressure of the partner set temp
+      const double p_new = set_press[partner_set_temp];
+      if (pressflag && (p_new != set_press[my_set_temp])) {
+        fix_stmd->set_pressure(p_new);
+        for (int i = 0; i < 3; i++) nh_pstart[i] = nh_pstop[i] = p_new;
+      }
     } // if swap
 
     // update my_set_temp and temp2world on every proc
     // root procs update their value if swap took place
     // allgather across root procs
     // bcast within my world
+    // in auto mode the STMD stage of each world rides along,
+    // swaps are enabled once no replica is left in STG1
     if (swap) my_set_temp = partner_set_temp;
     if (me == 0) {
-      MPI_Allgather(&my_set_temp,1,MPI_INT,world2temp,1,MPI_INT,roots);
+      if (EX_flag == 2) {
+        int mine_stg[2];
+        mine_stg[0] = my_set_temp;
+        mine_stg[1] = fix_stmd->STG;
+        MPI_Allgather(mine_stg,2,MPI_INT,world_stg,2,MPI_INT,roots);
+        int min_stg = world_stg[1];
+        for (int i=0; i<nworlds; i++) {
+          world2temp[i] = world_stg[2*i];
+          min_stg = MIN(min_stg,world_stg[2*i+1]);
+        }
+        if (min_stg >= 2) {
+          EX_flag = 1;
+          if (me_universe == 0) {
+            if (universe->uscreen)
+              fprintf(universe->uscreen,"RESTMD: all replicas left STG1, "
+                      "exchanges on at step " BIGINT_FORMAT "\n",update->ntimestep);
+            if (universe->ulogfile)
+              fprintf(universe->ulogfile,"RESTMD: all replicas left STG1, "
+                      "exchanges on at step " BIGINT_FORMAT "\n",update->ntimestep);
+          }
+        }
+      } else
+        MPI_Allgather(&my_set_temp,1,MPI_INT,world2temp,1,MPI_INT,roots);
       for (int i=0; i<nworlds; i++) temp2world[world2temp[i]] = i;
     }
     MPI_Bcast(temp2world,nworlds,MPI_INT,0,world);
@@ -369,13 +684,65 @@ void TemperStmd::command(int narg, char **arg )
 
     // write stmd restart files after swap
     fix_stmd->write_orest();
+    if (agg_prefix) write_aggregate();
+    if (ckpt_file && (update->ntimestep % rstfrq == 0))
+      write_checkpoint(swap_base + iswap + 1);
+
+    // print out current swap status, the exchange log records it
+    // instead and prints the permutation with each of its checkpoints
+    if ((me_universe == 0) && !exlog_file) print_status();
+    if (fp_exlog) write_exlog();
 
-    // print out current swap status
-    if (me_universe == 0) print_status();
+    // adapt the Ts windows toward uniform acceptance
+    if (tune_every && (iswap+1 <= tune_stop) && ((iswap+1) % tune_every == 0))
+      tune_ladder(iswap+1 == tune_stop);
+
+    if (stwham_flag && stwham_every && ((iswap+1) % stwham_every == 0) &&
+        (iswap+1 < nswaps) && (me == 0)) stwham_analyze();
   }
 
   timer->barrier_stop();
 
+  if (ckpt_file) write_checkpoint(swap_base + nswaps);
+
+  // final ST-WHAM analysis, results are ready when the run ends
+  if (stwham_flag && (me == 0)) stwham_analyze();
+
+  memory->destroy(local_values);
+  memory->destroy(global_values);
+  memory->destroy(value_counts);
+  memory->destroy(value_displs);
+  memory->destroy(pair_attempt);
+  memory->destroy(pair_accept);
+  memory->destroy(world_stg);
+  memory->destroy(stwham_offset);
+  memory->destroy(stwham_hist);
+  memory->destroy(proh_last);
+
+  if (fp_exlog) {
+    fclose(fp_exlog);
+    fclose(fp_exidx);
+    fp_exlog = fp_exidx = NULL;
+  }
+  if (frame_every) close_frames();
+  delete [] prev_world2temp;
+  prev_world2temp = NULL;
+
+  if (agg_prefix) {
+    if (fp_agg_wt) {
+      fclose(fp_agg_wt);
+      fclose(fp_agg_wh);
+      fclose(fp_agg_idx);
+      fclose(fp_agg_rest);
+    }
+    fp_agg_wt = fp_agg_wh = fp_agg_idx = fp_agg_rest = NULL;
+    memory->destroy(agg_local);
+    memory->destroy(agg_global);
+    memory->destroy(agg_counts);
+    memory->destroy(agg_displs);
+    fix_stmd->aggregate_flag = 0;
+  }
+
   update->integrate->cleanup();
 
   Finish finish(lmp);
@@ -386,6 +753,799 @@ void TemperStmd::command(int narg, char **arg )
   update->beginstep = update->endstep = 0;
 }
 
+/* ----------------------------------------------------------------------
+   move the Ts windows [TL,TH] of neighbouring set temps toward uniform
+   acceptance: the overlap of pair k grows when its acceptance is below
+   the ladder average and shrinks when above, by at most TUNE_GAIN of the
+   narrower window; the outer ends of the ladder stay fixed
+   windows travel with the set temp, so the new window of my set temp
+   is applied to my fix stmd and reaches oREST with the next write
+------------------------------------------------------------------------- */
+
+void TemperStmd::tune_ladder(int freeze)
+{
+  double *window;
+  int *attempt,*accept;
+  memory->create(window,2*nworlds,"temper/stmd:window");
+  memory->create(attempt,nworlds,"temper/stmd:attempt");
+  memory->create(accept,nworlds,"temper/stmd:accept");
+
+  if (me == 0) {
+    double mine[2];
+    mine[0] = fix_stmd->T1;
+    mine[1] = fix_stmd->T2;
+    double *byworld;
+    memory->create(byworld,2*nworlds,"temper/stmd:byworld");
+    MPI_Allgather(mine,2,MPI_DOUBLE,byworld,2,MPI_DOUBLE,roots);
+    for (int i = 0; i < nworlds; i++) {
+      window[2*world2temp[i]] = byworld[2*i];
+      window[2*world2temp[i]+1] = byworld[2*i+1];
+    }
+    memory->destroy(byworld);
+
+    MPI_Allreduce(pair_attempt,attempt,nworlds,MPI_INT,MPI_SUM,roots);
+    MPI_Allreduce(pair_accept,accept,nworlds,MPI_INT,MPI_SUM,roots);
+
+    // average acceptance over pairs that were attempted
+    double target = 0.0;
+    int npair = 0;
+    for (int k = 0; k < nworlds-1; k++)
+      if (attempt[k] > 0) {
+        target += double(accept[k]) / attempt[k];
+        npair++;
+      }
+    if (npair) target /= npair;
+
+    for (int k = 0; k < nworlds-1; k++) {
+      if (attempt[k] == 0) continue;
+      double *lo = &window[2*k];
+      double *hi = &window[2*(k+1)];
+      const double rate = double(accept[k]) / attempt[k];
+      const double width = MIN(lo[1]-lo[0],hi[1]-hi[0]);
+      double shift = TUNE_GAIN * (target - rate) * width;
+
+      // keep windows ordered and non-empty
+      shift = MIN(shift,0.5*(hi[1]-lo[1]));
+      shift = MIN(shift,0.5*(hi[0]-lo[0]));
+      shift = MAX(shift,-0.5*(lo[1]-lo[0]));
+      shift = MAX(shift,-0.5*(hi[1]-hi[0]));
+      lo[1] += shift;
+      hi[0] -= shift;
+    }
+  }
+  MPI_Bcast(window,2*nworlds,MPI_DOUBLE,0,world);
+
+  fix_stmd->set_window(window[2*my_set_temp],window[2*my_set_temp+1]);
+
+  if (me_universe == 0) {
+    const double ST = fix_stmd->ST;
+    if (universe->uscreen) {
+      fprintf(universe->uscreen,"RESTMD ladder " BIGINT_FORMAT ":",update->ntimestep);
+      for (int i = 0; i < nworlds; i++)
+        fprintf(universe->uscreen," %g-%g",window[2*i]*ST,window[2*i+1]*ST);
+      fprintf(universe->uscreen,freeze ? " (frozen)\n" : "\n");
+    }
+    if (universe->ulogfile) {
+      fprintf(universe->ulogfile,"RESTMD ladder " BIGINT_FORMAT ":",update->ntimestep);
+      for (int i = 0; i < nworlds-1; i++)
+        if (attempt[i] > 0)
+          fprintf(universe->ulogfile," %d:%g",i,double(accept[i])/attempt[i]);
+      fprintf(universe->ulogfile,"\n");
+      for (int i = 0; i < nworlds; i++)
+        fprintf(universe->ulogfile," %g-%g",window[2*i]*ST,window[2*i+1]*ST);
+      fprintf(universe->ulogfile,freeze ? " (frozen)\n" : "\n");
+    }
+  }
+
+  // statistics restart for the next interval
+  for (int i = 0; i < nworlds; i++) pair_attempt[i] = pair_accept[i] = 0;
+
+  memory->destroy(window);
+  memory->destroy(attempt);
+  memory->destroy(accept);
+}
+
+/* ----------------------------------------------------------------------
+   add the PROH increments of my fix stmd since the last exchange to the
+   histogram of my set temp on the common grid
+   called by world root procs only
+------------------------------------------------------------------------- */
+
+void TemperStmd::stwham_accumulate()
+{
+  int dim;
+  const int *proh = (int *) fix_stmd->extract("PROH",dim);
+  const int n = fix_stmd->N;
+  double *hist = &stwham_hist[stwham_offset[iworld]*nworlds + my_set_temp];
+
+  for (int i = 0; i < n; i++) {
+    int delta = proh[i] - proh_last[i];
+    if (delta < 0) delta = proh[i];       // PROH was reset
+    hist[i*nworlds] += delta;
+    proh_last[i] = proh[i];
+  }
+}
+
+/* ----------------------------------------------------------------------
+   ST-WHAM of the production histograms of all set temps, solved by
+   StwhamSolve as in tools/stwham.cpp, with the current Ts of each set
+   temp as its sampling weight
+   Ts_stwham.dat:    E Ts(E) S(E) betaH(E) betaW(E)
+   fract_stwham.dat: E fraction of samples at E from each set temp
+   called by world root procs only, written by universe root
+------------------------------------------------------------------------- */
+
+void TemperStmd::stwham_analyze()
+{
+  const int nbin = stwham_nbin;
+  double *hist = NULL;
+  double *ts = NULL;
+  int *counts = NULL;
+  int *displs = NULL;
+  int *settemp = NULL;
+
+  int root = (me_universe == 0);
+  if (root) {
+    memory->create(hist,nbin*nworlds,"temper/stmd:hist");
+    memory->create(counts,nworlds,"temper/stmd:counts");
+    memory->create(displs,nworlds,"temper/stmd:displs");
+    memory->create(settemp,nworlds,"temper/stmd:settemp");
+    int ntotal = 0;
+    for (int i = 0; i < nworlds; i++) {
+      counts[i] = value_counts[i] - NHEADER;
+      displs[i] = ntotal;
+      ntotal += counts[i];
+    }
+    memory->create(ts,ntotal,"temper/stmd:ts");
+  }
+
+  // histograms summed over worlds, Y2 and set temp of every world
+  MPI_Reduce(stwham_hist,hist,nbin*nworlds,MPI_DOUBLE,MPI_SUM,0,roots);
+  MPI_Gather(&my_set_temp,1,MPI_INT,settemp,1,MPI_INT,0,roots);
+  MPI_Gatherv(fix_stmd->Y2,fix_stmd->N,MPI_DOUBLE,ts,counts,displs,
+              MPI_DOUBLE,0,roots);
+
+  if (!root) return;
+
+  // world holding each set temp
+  int *t2w;
+  memory->create(t2w,nworlds,"temper/stmd:t2w");
+  for (int i = 0; i < nworlds; i++) t2w[settemp[i]] = i;
+
+  // Ts of each set temp on the common grid, 0 outside of its own grid
+  double *tsg,*htot,*TH,*ent,*betaH,*betaW;
+  memory->create(tsg,nbin*nworlds,"temper/stmd:tsg");
+  memory->create(htot,nbin,"temper/stmd:htot");
+  memory->create(TH,nbin,"temper/stmd:TH");
+  memory->create(ent,nbin,"temper/stmd:ent");
+  memory->create(betaH,nbin,"temper/stmd:betaH");
+  memory->create(betaW,nbin,"temper/stmd:betaW");
+  for (int i = 0; i < nbin; i++)
+    for (int l = 0; l < nworlds; l++) {
+      const int w = t2w[l];
+      const int j = i - stwham_offset[w];
+      tsg[i*nworlds+l] = ((j < 0) || (j >= counts[w])) ? 0.0 : ts[displs[w]+j];
+    }
+
+  StwhamSolve st;
+  st.nbin = nbin;
+  st.nrep = nworlds;
+  st.bin = bin;
+  st.kb = boltz;
+  st.T0 = fix_stmd->ST;
+  st.limit = stwham_limit;
+
+  int bstart,bstop;
+  const double ntot = st.totals(hist,htot);
+  st.edges(htot,ntot,bstart,bstop);
+
+  if ((bstart < 1) || (bstop <= bstart) || (bstop > nbin-1)) {
+    error->warning(FLERR,"ST-WHAM: no sampled bins above checkLIMIT, output skipped");
+  } else {
+    if (st.solve(hist,htot,ntot,tsg,bstart,bstop,TH,ent,betaH,betaW))
+      error->warning(FLERR,"ST-WHAM: negative temperature detected");
+
+    FILE *fp = fopen("fract_stwham.dat","w");
+    if (fp == NULL) error->one(FLERR,"Cannot open fract_stwham.dat");
+    for (int l = 0; l < nworlds; l++) {
+      for (int i = bstart; i < bstop; i++) {
+        const double frac = (htot[i] > 0.0) ? hist[i*nworlds+l]/htot[i] : 0.0;
+        fprintf(fp,"%f %f\n",stwham_emin+(i*bin),frac);
+      }
+      fprintf(fp,"\n");
+    }
+    fclose(fp);
+
+    fp = fopen("Ts_stwham.dat","w");
+    if (fp == NULL) error->one(FLERR,"Cannot open Ts_stwham.dat");
+    for (int i = bstart; i < bstop; i++)
+      fprintf(fp,"%f %f %f %f %f\n",stwham_emin+(i*bin),TH[i],ent[i],
+              betaH[i],betaW[i]);
+    fclose(fp);
+
+    if (universe->uscreen)
+      fprintf(universe->uscreen,"RESTMD: ST-WHAM written at step "
+              BIGINT_FORMAT "\n",update->ntimestep);
+    if (universe->ulogfile)
+      fprintf(universe->ulogfile,"RESTMD: ST-WHAM written at step "
+              BIGINT_FORMAT "\n",update->ntimestep);
+  }
+
+  memory->destroy(hist);
+  memory->destroy(ts);
+  memory->destroy(counts);
+  memory->destroy(displs);
+  memory->destroy(settemp);
+  memory->destroy(t2w);
+  memory->destroy(tsg);
+  memory->destroy(htot);
+  memory->destroy(TH);
+  memory->destroy(ent);
+  memory->destroy(betaH);
+  memory->destroy(betaW);
+}
+
+/* ----------------------------------------------------------------------
+   checkpoint of the tempering state, written by universe root
+   "RESTMDC1", int nworlds nT nP, bigint step, bigint # of swaps done,
+   int EX_flag, int ranswap flag and state, then per world or set temp
+   int world2temp, int ranboltz state of the world root,
+   double set_press, int pair_attempt, int pair_accept
+   written to file.tmp and renamed, so a killed job leaves the previous
+   checkpoint intact
+------------------------------------------------------------------------- */
+
+void TemperStmd::write_checkpoint(bigint nswap)
+{
+  if (me != 0) return;
+
+  int *boltz_state = NULL;
+  int *attempt = NULL;
+  int *accept = NULL;
+  if (me_universe == 0) {
+    boltz_state = new int[nworlds];
+    attempt = new int[nworlds];
+    accept = new int[nworlds];
+  }
+  int state = ranboltz->state();
+  MPI_Gather(&state,1,MPI_INT,boltz_state,1,MPI_INT,0,roots);
+  MPI_Reduce(pair_attempt,attempt,nworlds,MPI_INT,MPI_SUM,0,roots);
+  MPI_Reduce(pair_accept,accept,nworlds,MPI_INT,MPI_SUM,0,roots);
+  if (me_universe != 0) return;
+
+  char filename[512];
+  snprintf(filename,512,"%s.tmp",ckpt_file);
+  FILE *fp = fopen(filename,"wb");
+  if (fp == NULL) error->one(FLERR,"Cannot open RESTMD checkpoint file");
+
+  const bigint step = update->ntimestep;
+  int header[3],rng[2];
+  header[0] = nworlds;
+  header[1] = nT;
+  header[2] = nP;
+  rng[0] = ranswap ? 1 : 0;
+  rng[1] = ranswap ? ranswap->state() : 0;
+  fwrite("RESTMDC1",sizeof(char),8,fp);
+  fwrite(header,sizeof(int),3,fp);
+  fwrite(&step,sizeof(bigint),1,fp);
+  fwrite(&nswap,sizeof(bigint),1,fp);
+  fwrite(&EX_flag,sizeof(int),1,fp);
+  fwrite(rng,sizeof(int),2,fp);
+  fwrite(world2temp,sizeof(int),nworlds,fp);
+  fwrite(boltz_state,sizeof(int),nworlds,fp);
+  fwrite(set_press,sizeof(double),nworlds,fp);
+  fwrite(attempt,sizeof(int),nworlds,fp);
+  fwrite(accept,sizeof(int),nworlds,fp);
+  fclose(fp);
+  if (rename(filename,ckpt_file) != 0)
+    error->one(FLERR,"Cannot open RESTMD checkpoint file");
+
+  delete [] boltz_state;
+  delete [] attempt;
+  delete [] accept;
+}
+
+/* ----------------------------------------------------------------------
+   restore permutation, RNG states and swap counters from a checkpoint
+   universe root reads, all procs take over their part
+------------------------------------------------------------------------- */
+
+void TemperStmd::read_checkpoint()
+{
+  int flag = 0;
+  bigint step = 0;
+  int header[3],rng[2],exflag = 0;
+  int *boltz_state = new int[nworlds];
+  int *attempt = new int[nworlds];
+  int *accept = new int[nworlds];
+
+  if (me_universe == 0) {
+    FILE *fp = fopen(resume_file,"rb");
+    if (fp == NULL) flag = 1;
+    else {
+      char magic[8];
+      if ((fread(magic,sizeof(char),8,fp) != 8) ||
+          (strncmp(magic,"RESTMDC1",8) != 0) ||
+          (fread(header,sizeof(int),3,fp) != 3)) flag = 2;
+      else if ((header[0] != nworlds) || (header[1] != nT) ||
+               (header[2] != nP)) flag = 3;
+      else if ((fread(&step,sizeof(bigint),1,fp) != 1) ||
+               (fread(&swap_base,sizeof(bigint),1,fp) != 1) ||
+               (fread(&exflag,sizeof(int),1,fp) != 1) ||
+               (fread(rng,sizeof(int),2,fp) != 2) ||
+               ((int) fread(world2temp,sizeof(int),nworlds,fp) != nworlds) ||
+               ((int) fread(boltz_state,sizeof(int),nworlds,fp) != nworlds) ||
+               ((int) fread(set_press,sizeof(double),nworlds,fp) != nworlds) ||
+               ((int) fread(attempt,sizeof(int),nworlds,fp) != nworlds) ||
+               ((int) fread(accept,sizeof(int),nworlds,fp) != nworlds))
+        flag = 2;
+      fclose(fp);
+    }
+  }
+  MPI_Bcast(&flag,1,MPI_INT,0,universe->uworld);
+  if (flag == 1)
+    error->universe_all(FLERR,"Cannot open RESTMD checkpoint file");
+  if (flag == 2)
+    error->universe_all(FLERR,"Invalid RESTMD checkpoint file");
+  if (flag == 3)
+    error->universe_all(FLERR,"RESTMD checkpoint file does not match "
+                        "the replica grid");
+
+  MPI_Bcast(&step,1,MPI_LMP_BIGINT,0,universe->uworld);
+  MPI_Bcast(&swap_base,1,MPI_LMP_BIGINT,0,universe->uworld);
+  MPI_Bcast(&exflag,1,MPI_INT,0,universe->uworld);
+  MPI_Bcast(rng,2,MPI_INT,0,universe->uworld);
+  MPI_Bcast(world2temp,nworlds,MPI_INT,0,universe->uworld);
+  MPI_Bcast(boltz_state,nworlds,MPI_INT,0,universe->uworld);
+  MPI_Bcast(set_press,nworlds,MPI_DOUBLE,0,universe->uworld);
+
+  if ((me_universe == 0) && (step != update->ntimestep))
+    error->universe_warn(FLERR,"RESTMD checkpoint was written at a "
+                         "different step than the current one");
+
+  // permutation and the reference pressure of my set temp
+  my_set_temp = world2temp[iworld];
+  for (int i = 0; i < nworlds; i++) temp2world[world2temp[i]] = i;
+  if (pressflag && (nh_pstart[0] != set_press[my_set_temp])) {
+    fix_stmd->set_pressure(set_press[my_set_temp]);
+    for (int i = 0; i < 3; i++)
+      nh_pstart[i] = nh_pstop[i] = set_press[my_set_temp];
+  }
+
+  // RNG streams continue, only world roots draw Boltzmann numbers
+  if (ranswap && rng[0]) ranswap->reset(rng[1]);
+  if (me == 0) ranboltz->reset(boltz_state[iworld]);
+
+  // exchanges that auto mode already switched on stay on
+  if ((EX_flag == 2) && (exflag == 1)) EX_flag = 1;
+
+  // swap statistics are sums over the roots, keep them on one
+  if (me_universe == 0)
+    for (int i = 0; i < nworlds; i++) {
+      pair_attempt[i] = attempt[i];
+      pair_accept[i] = accept[i];
+    }
+
+  delete [] boltz_state;
+  delete [] attempt;
+  delete [] accept;
+}
+
+/* ----------------------------------------------------------------------
+   aggregated WT, WH and oREST output of all worlds
+   world roots send one record {N, Emin, bin, ST, oREST, Hist} per world
+   to the universe root, which is the only proc touching the files:
+     prefix.WT.d   Ts(E) blocks of all worlds, same layout as WT.N.d
+     prefix.WH.d   histogram blocks of all worlds, same layout as WH.N.d
+     prefix.idx    one line per world and snapshot: step world WT WH offsets
+     prefix.rest   "RESTMDA1", bigint step, int slot, then two slots of
+                   {bigint step, int nworlds, int len[nworlds], records}
+   oREST snapshots alternate between the slots, the header is only
+   updated once a slot is complete, so an interrupted write leaves the
+   previous snapshot intact
+------------------------------------------------------------------------- */
+
+void TemperStmd::setup_aggregate()
+{
+  int dim;
+  const int nrest = fix_stmd->orest_size();
+  const int rstfrq = *((int *) fix_stmd->extract("RSTFRQ",dim));
+  const int orest = *((int *) fix_stmd->extract("OREST",dim));
+
+  agg_nlocal = AGG_HEADER + nrest + fix_stmd->N;
+  agg_counts = agg_displs = NULL;
+  agg_local = agg_global = NULL;
+  fp_agg_wt = fp_agg_wh = fp_agg_idx = fp_agg_rest = NULL;
+  memory->create(agg_local,agg_nlocal,"temper/stmd:agg_local");
+
+  // all worlds must reach the output steps together
+  int flag = 0;
+  if (me == 0) {
+    int lo,hi;
+    MPI_Allreduce(&rstfrq,&lo,1,MPI_INT,MPI_MIN,roots);
+    MPI_Allreduce(&rstfrq,&hi,1,MPI_INT,MPI_MAX,roots);
+    if (lo != hi) flag = 1;
+  }
+  MPI_Bcast(&flag,1,MPI_INT,0,world);
+  if (flag)
+    error->universe_all(FLERR,"RESTMD aggregate requires the same RSTFRQ "
+                        "in all replicas");
+
+  agg_total = 0;
+  if (me_universe == 0) {
+    memory->create(agg_counts,nworlds,"temper/stmd:agg_counts");
+    memory->create(agg_displs,nworlds,"temper/stmd:agg_displs");
+  }
+  if (me == 0)
+    MPI_Gather(&agg_nlocal,1,MPI_INT,agg_counts,1,MPI_INT,0,roots);
+  if (me_universe == 0) {
+    agg_displs[0] = 0;
+    for (int i = 1; i < nworlds; i++)
+      agg_displs[i] = agg_displs[i-1] + agg_counts[i-1];
+    agg_total = agg_displs[nworlds-1] + agg_counts[nworlds-1];
+    memory->create(agg_global,agg_total,"temper/stmd:agg_global");
+  }
+  agg_slotsize = sizeof(bigint) + (bigint) (nworlds+1)*sizeof(int) +
+    (bigint) agg_total*sizeof(double);
+
+  // restart all worlds from the last complete oREST snapshot
+  agg_slot = 0;
+  if (me_universe == 0) {
+    char filename[512];
+    snprintf(filename,512,"%s.rest",agg_prefix);
+    if (orest) {
+      fp_agg_rest = fopen(filename,"r+b");
+      if (fp_agg_rest == NULL)
+        error->one(FLERR,"Cannot open RESTMD aggregate restart file");
+      char magic[8];
+      bigint step;
+      int nw,ok = 1;
+      if (fread(magic,sizeof(char),8,fp_agg_rest) != 8) ok = 0;
+      if (ok && (strncmp(magic,"RESTMDA1",8) != 0)) ok = 0;
+      if (ok && (fread(&step,sizeof(bigint),1,fp_agg_rest) != 1)) ok = 0;
+      if (ok && (fread(&agg_slot,sizeof(int),1,fp_agg_rest) != 1)) ok = 0;
+      if (ok) fseek(fp_agg_rest,agg_header() + agg_slot*agg_slotsize,SEEK_SET);
+      if (ok && (fread(&step,sizeof(bigint),1,fp_agg_rest) != 1)) ok = 0;
+      if (ok && (fread(&nw,sizeof(int),1,fp_agg_rest) != 1)) ok = 0;
+      if (ok && (nw != nworlds)) ok = 0;
+      int *len = new int[nworlds];
+      if (ok && ((int) fread(len,sizeof(int),nworlds,fp_agg_rest) != nworlds))
+        ok = 0;
+      for (int i = 0; ok && (i < nworlds); i++)
+        if (len[i] != agg_counts[i]) ok = 0;
+      delete [] len;
+      if (ok && ((int) fread(agg_global,sizeof(double),agg_total,fp_agg_rest)
+                 != agg_total)) ok = 0;
+      if (!ok)
+        error->one(FLERR,"RESTMD aggregate restart file does not match "
+                   "the replicas");
+      agg_slot = 1 - agg_slot;
+    } else {
+      fp_agg_rest = fopen(filename,"w+b");
+      if (fp_agg_rest == NULL)
+        error->one(FLERR,"Cannot open RESTMD aggregate restart file");
+    }
+
+    snprintf(filename,512,"%s.WT.d",agg_prefix);
+    fp_agg_wt = fopen(filename,"w");
+    snprintf(filename,512,"%s.WH.d",agg_prefix);
+    fp_agg_wh = fopen(filename,"w");
+    snprintf(filename,512,"%s.idx",agg_prefix);
+    fp_agg_idx = fopen(filename,"w");
+    if ((fp_agg_wt == NULL) || (fp_agg_wh == NULL) || (fp_agg_idx == NULL))
+      error->one(FLERR,"Cannot open RESTMD aggregate output file");
+    fprintf(fp_agg_idx,"# step world WT_offset WH_offset\n");
+  }
+
+  if (orest) {
+    if (me == 0)
+      MPI_Scatterv(agg_global,agg_counts,agg_displs,MPI_DOUBLE,
+                   agg_local,agg_nlocal,MPI_DOUBLE,0,roots);
+    fix_stmd->restore_orest(&agg_local[AGG_HEADER]);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   byte offset of the first oREST slot in the aggregate restart file
+------------------------------------------------------------------------- */
+
+bigint TemperStmd::agg_header()
+{
+  return 8*sizeof(char) + sizeof(bigint) + sizeof(int);
+}
+
+/* ----------------------------------------------------------------------
+   gather the records of all worlds and write them, every RSTFRQ steps
+------------------------------------------------------------------------- */
+
+void TemperStmd::write_aggregate()
+{
+  int dim;
+  const int rstfrq = *((int *) fix_stmd->extract("RSTFRQ",dim));
+  if (update->ntimestep % rstfrq) return;
+  if (me != 0) return;
+
+  const int n = fix_stmd->N;
+  const int nrest = fix_stmd->orest_size();
+  const int *hist = (int *) fix_stmd->extract("Hist",dim);
+  agg_local[0] = n;
+  agg_local[1] = Emin;
+  agg_local[2] = bin;
+  agg_local[3] = fix_stmd->ST;
+  fix_stmd->pack_orest(&agg_local[AGG_HEADER]);
+  for (int i = 0; i < n; i++) agg_local[AGG_HEADER+nrest+i] = hist[i];
+
+  MPI_Gatherv(agg_local,agg_nlocal,MPI_DOUBLE,agg_global,agg_counts,
+              agg_displs,MPI_DOUBLE,0,roots);
+  if (me_universe != 0) return;
+
+  const bigint step = update->ntimestep;
+  for (int w = 0; w < nworlds; w++) {
+    const double *rec = &agg_global[agg_displs[w]];
+    const int nw = static_cast<int> (rec[0]);
+    const double emin = rec[1];
+    const double ebin = rec[2];
+    const double st = rec[3];
+    const double *y2 = &rec[AGG_HEADER+13];
+    const double *htot = y2 + nw;
+    const double *proh = htot + nw;
+    const double *h = proh + nw;
+
+    fprintf(fp_agg_idx,BIGINT_FORMAT " %d %ld %ld\n",step,w,
+            ftell(fp_agg_wt),ftell(fp_agg_wh));
+    fprintf(fp_agg_wt,"### STMD Step " BIGINT_FORMAT " world %d: bin E Ts(E)\n",
+            step,w);
+    for (int i = 0; i < nw; i++)
+      fprintf(fp_agg_wt,"%i %f %f\n",i,(i*ebin)+emin,y2[i]*st);
+    fprintf(fp_agg_wt,"\n\n");
+    fprintf(fp_agg_wh,"### STMD Step=" BIGINT_FORMAT " world %d: "
+            "bin E hist thist phist\n",step,w);
+    for (int i = 0; i < nw; i++)
+      fprintf(fp_agg_wh,"%i %f %i %i %i\n",i,(i*ebin)+emin,
+              static_cast<int> (h[i]),static_cast<int> (htot[i]),
+              static_cast<int> (proh[i]));
+    fprintf(fp_agg_wh,"\n\n");
+  }
+  fflush(fp_agg_wt);
+  fflush(fp_agg_wh);
+  fflush(fp_agg_idx);
+
+  // fill the inactive slot, then point the header at it
+  fseek(fp_agg_rest,agg_header() + agg_slot*agg_slotsize,SEEK_SET);
+  fwrite(&step,sizeof(bigint),1,fp_agg_rest);
+  fwrite(&nworlds,sizeof(int),1,fp_agg_rest);
+  fwrite(agg_counts,sizeof(int),nworlds,fp_agg_rest);
+  fwrite(agg_global,sizeof(double),agg_total,fp_agg_rest);
+  fflush(fp_agg_rest);
+  fseek(fp_agg_rest,0,SEEK_SET);
+  fwrite("RESTMDA1",sizeof(char),8,fp_agg_rest);
+  fwrite(&step,sizeof(bigint),1,fp_agg_rest);
+  fwrite(&agg_slot,sizeof(int),1,fp_agg_rest);
+  fflush(fp_agg_rest);
+  agg_slot = 1 - agg_slot;
+}
+
+/* ----------------------------------------------------------------------
+   binary exchange log, written by universe root
+   log:   "RESTMDX1", int nworlds, then one record per accepted swap
+          {bigint step, int set temp a, int set temp b}, a < b
+   index: "RESTMDI1", int nworlds, then after each step in which the
+          record count passed a multiple of EXLOG_CHECK
+          {bigint step, bigint byte offset of the next log record,
+           int world2temp[nworlds] after that step}
+   the permutation at any step follows from the last checkpoint before
+   it by swapping the worlds holding a and b for each later record
+------------------------------------------------------------------------- */
+
+void TemperStmd::write_exlog()
+{
+  const bigint step = update->ntimestep;
+  const bigint count_old = exlog_count;
+  for (int i = 0; i < nworlds; i++) {
+    const int a = prev_world2temp[i];
+    const int b = world2temp[i];
+    if (a < b) {
+      fwrite(&step,sizeof(bigint),1,fp_exlog);
+      fwrite(&a,sizeof(int),1,fp_exlog);
+      fwrite(&b,sizeof(int),1,fp_exlog);
+      exlog_count++;
+    }
+  }
+  for (int i = 0; i < nworlds; i++) prev_world2temp[i] = world2temp[i];
+
+  // only at a step boundary, checkpoint and offset then match
+  if (exlog_count / EXLOG_CHECK > count_old / EXLOG_CHECK) {
+    write_exlog_checkpoint();
+    print_status();
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+void TemperStmd::write_exlog_checkpoint()
+{
+  const bigint step = update->ntimestep;
+  const bigint offset = ftell(fp_exlog);
+  fwrite(&step,sizeof(bigint),1,fp_exidx);
+  fwrite(&offset,sizeof(bigint),1,fp_exidx);
+  fwrite(prev_world2temp,sizeof(int),nworlds,fp_exidx);
+  fflush(fp_exlog);
+  fflush(fp_exidx);
+}
+
+/* ----------------------------------------------------------------------
+   per set temp frame files start empty and stay open for the run
+   every proc may come to write into any of them, so each proc opens
+   all .bin files on its own, world roots also the .idx files
+------------------------------------------------------------------------- */
+
+void TemperStmd::open_frames()
+{
+#ifdef STMD_MPIIO
+  if (atom->natoms > MAXSMALLINT)
+    error->all(FLERR,"Too many atoms for RESTMD frames");
+  frame_natoms = static_cast<int> (atom->natoms);
+  nframe = 0;
+
+  char filename[512];
+  if (me_universe == 0) {
+    for (int i = 0; i < nworlds; i++) {
+      snprintf(filename,512,"%s.%d.bin",frame_prefix,i);
+      FILE *fp = fopen(filename,"wb");
+      if (fp == NULL) error->one(FLERR,"Cannot open RESTMD frame file");
+      fclose(fp);
+      snprintf(filename,512,"%s.%d.idx",frame_prefix,i);
+      fp = fopen(filename,"wb");
+      if (fp == NULL) error->one(FLERR,"Cannot open RESTMD frame file");
+      fclose(fp);
+    }
+  }
+  MPI_Barrier(universe->uworld);
+
+  fh_frame = new MPI_File[nworlds];
+  fh_frame_idx = new MPI_File[nworlds];
+  int flag = 0;
+  for (int i = 0; i < nworlds; i++) {
+    snprintf(filename,512,"%s.%d.bin",frame_prefix,i);
+    if (MPI_File_open(MPI_COMM_SELF,filename,MPI_MODE_WRONLY,MPI_INFO_NULL,
+                      &fh_frame[i]) != MPI_SUCCESS) flag = 1;
+    fh_frame_idx[i] = MPI_FILE_NULL;
+    if (me != 0) continue;
+    snprintf(filename,512,"%s.%d.idx",frame_prefix,i);
+    if (MPI_File_open(MPI_COMM_SELF,filename,MPI_MODE_WRONLY,MPI_INFO_NULL,
+                      &fh_frame_idx[i]) != MPI_SUCCESS) flag = 1;
+  }
+  if (flag) error->one(FLERR,"Cannot open RESTMD frame file");
+#endif
+}
+
+/* ---------------------------------------------------------------------- */
+
+void TemperStmd::close_frames()
+{
+#ifdef STMD_MPIIO
+  for (int i = 0; i < nworlds; i++) {
+    MPI_File_close(&fh_frame[i]);
+    if (fh_frame_idx[i] != MPI_FILE_NULL) MPI_File_close(&fh_frame_idx[i]);
+  }
+  delete [] fh_frame;
+  delete [] fh_frame_idx;
+#endif
+}
+
+/* ----------------------------------------------------------------------
+   add the current configuration to the frame file of my set temp
+   frame: {bigint step, int natoms, double box[6], double x[natoms][3]}
+   with unwrapped coordinates ordered by atom ID
+   index: {bigint step, bigint byte offset of the frame}
+   every set temp gets a frame at the same exchanges and all frames have
+   the same size, so frame k starts at k times that size; each proc
+   writes its own atoms through a file view at their ID positions,
+   nothing is gathered, exactly one world holds each set temp
+------------------------------------------------------------------------- */
+
+void TemperStmd::write_frame()
+{
+#ifdef STMD_MPIIO
+  if (atom->natoms != frame_natoms)
+    error->all(FLERR,"RESTMD frames require a constant number of atoms");
+  const int natoms = frame_natoms;
+  const int nlocal = atom->nlocal;
+  double **x = atom->x;
+  imageint *image = atom->image;
+  tagint *tag = atom->tag;
+
+  // my atoms in ID order, file views must be monotonic
+  std::vector< std::pair<tagint,int> > order(nlocal);
+  for (int i = 0; i < nlocal; i++) order[i] = std::make_pair(tag[i],i);
+  std::sort(order.begin(),order.end());
+
+  double *xs;
+  int *disp;
+  memory->create(xs,3*nlocal+1,"temper/stmd:xs");
+  memory->create(disp,nlocal+1,"temper/stmd:disp");
+  int flag = 0;
+  for (int k = 0; k < nlocal; k++) {
+    const tagint m = order[k].first - 1;
+    const int i = order[k].second;
+    if ((m < 0) || (m >= natoms)) flag = 1;
+    disp[k] = static_cast<int> (m);
+    domain->unmap(x[i],image[i],&xs[3*k]);
+  }
+  int flagall;
+  MPI_Allreduce(&flag,&flagall,1,MPI_INT,MPI_MAX,world);
+  if (flagall) error->all(FLERR,"RESTMD frames require consecutive atom IDs");
+
+  MPI_File fh = fh_frame[my_set_temp];
+  const MPI_Offset framesize = FRAME_HEADER + 3*sizeof(double)*natoms;
+  const MPI_Offset offset = nframe * framesize;
+  const bigint step = update->ntimestep;
+
+  if (me == 0) {
+    double box[6];
+    box[0] = domain->boxlo[0]; box[1] = domain->boxhi[0];
+    box[2] = domain->boxlo[1]; box[3] = domain->boxhi[1];
+    box[4] = domain->boxlo[2]; box[5] = domain->boxhi[2];
+    MPI_Offset off = offset;
+    MPI_File_write_at(fh,off,(void *) &step,sizeof(bigint),MPI_BYTE,
+                      MPI_STATUS_IGNORE);
+    off += sizeof(bigint);
+    MPI_File_write_at(fh,off,(void *) &natoms,sizeof(int),MPI_BYTE,
+                      MPI_STATUS_IGNORE);
+    off += sizeof(int);
+    MPI_File_write_at(fh,off,box,6*sizeof(double),MPI_BYTE,
+                      MPI_STATUS_IGNORE);
+
+    bigint rec[2];
+    rec[0] = step;
+    rec[1] = offset;
+    MPI_File_write_at(fh_frame_idx[my_set_temp],nframe*2*sizeof(bigint),
+                      rec,2*sizeof(bigint),MPI_BYTE,MPI_STATUS_IGNORE);
+  }
+
+  MPI_Datatype xyz,filetype;
+  MPI_Type_contiguous(3,MPI_DOUBLE,&xyz);
+  MPI_Type_commit(&xyz);
+  MPI_Type_create_indexed_block(nlocal,1,disp,xyz,&filetype);
+  MPI_Type_commit(&filetype);
+  MPI_File_set_view(fh,offset+FRAME_HEADER,xyz,filetype,(char *) "native",
+                    MPI_INFO_NULL);
+  MPI_File_write(fh,xs,nlocal,xyz,MPI_STATUS_IGNORE);
+  MPI_File_set_view(fh,0,MPI_BYTE,MPI_BYTE,(char *) "native",MPI_INFO_NULL);
+  MPI_Type_free(&filetype);
+  MPI_Type_free(&xyz);
+
+  memory->destroy(xs);
+  memory->destroy(disp);
+#endif
+  nframe++;
+}
+
+/* ----------------------------------------------------------------------
+   energy window of my Ts estimate, root procs only
+   w[0] = highest energy still at T1 from the bottom of the grid,
+   w[1] = lowest energy already at T2 from the top of the grid,
+   w[2] = 1 if Ts is saturated at both ends, so that holding the end
+          values beyond the grid is a valid estimate
+------------------------------------------------------------------------- */
+
+void TemperStmd::ts_window(double *w)
+{
+  const double *y2 = fix_stmd->Y2;
+  const int n = fix_stmd->N;
+  const double t1 = fix_stmd->T1;
+  const double t2 = fix_stmd->T2;
+
+  int lo = 0;
+  while ((lo < n-1) && (y2[lo+1] <= t1)) lo++;
+  int hi = n-1;
+  while ((hi > 0) && (y2[hi-1] >= t2)) hi--;
+
+  w[0] = fix_stmd->bin_energy(lo);
+  w[1] = fix_stmd->bin_energy(hi);
+  w[2] = ((y2[0] <= t1) && (y2[n-1] >= t2)) ? 1.0 : 0.0;
+}
+
 /* ----------------------------------------------------------------------
    proc 0 prints current tempering status
 ------------------------------------------------------------------------- */
@@ -22,6 +22,11 @@ CommandStyle(temper/stmd,TemperStmd)
 
 #include "pointers.h"
 
+// frames are written with MPI-IO, the serial STUBS library has none
+#if defined(MPI_VERSION) && (MPI_VERSION >= 2)
+#define STMD_MPIIO
+#endif
+
 namespace LAMMPS_NS {
 
 class TemperStmd : protected Pointers {
@@ -42,20 +47,78 @@ class TemperStmd : protected Pointers {
   int seed_boltz;              // seed for Boltz factor comparison
   int whichfix;                // index of temperature fix to use
   int fixstyle;                // what kind of temperature fix is used
-  int bin, Emin, Emax, BinMin, BinMax;
+  double Emin, Emax, bin;      // energy grid of my fix stmd
   double T_me,T_partner;       // latest sampled temperture
   int current_STG;             // current STMD stage
-  int EX_flag;                 // controls if swap is turned OFF/ON (0/1)
+  int EX_flag;                 // controls if swap is turned OFF/ON/AUTO (0/1/2)
+  int *world_stg;              // {set temp, STG} per world, auto mode only
+  int tune_every;              // # of swaps between ladder adaptations
+  int tune_stop;               // swap after which the ladder is frozen
+  int *pair_attempt;           // swap attempts between set temps k and k+1
+  int *pair_accept;            // accepted swaps between set temps k and k+1
+  int stwham_flag;             // 1 if ST-WHAM is done in-situ
+  int stwham_every;            // # of swaps between ST-WHAM analyses, 0 = end only
+  double stwham_limit;         // checkLIMIT of the ST-WHAM edge cut
+  int stwham_nbin;             // # of bins of the common energy grid
+  double stwham_emin;          // lowest energy of the common grid
+  int *stwham_offset;          // offset of each world's grid in the common grid
+  double *stwham_hist;         // production histogram per common bin and set temp
+  int *proh_last;              // PROH of my fix stmd at the last exchange
 
   int my_set_temp;             // which set temp I am simulating
   double *set_temp;            // static list of replica set kinetic temperatures
-  double *local_values;        // list of Y2, Emin and Emax
+  int nT,nP;                   // set temps form an nT x nP grid of Ts windows and pressures
+  double *set_press;           // static list of reference pressures by set temp
+  double *nh_pstart,*nh_pstop; // barostat targets of my npt fix
+  char *exlog_file;            // binary exchange log, NULL if off
+  FILE *fp_exlog,*fp_exidx;    // exchange log and its checkpoint index
+  bigint exlog_count;          // # of swap records written
+  int *prev_world2temp;        // world2temp as of the last logged exchange
+  int frame_every;             // # of swaps between per set temp frames, 0 = off
+  char *frame_prefix;          // frame files are prefix.N.bin and prefix.N.idx
+  int frame_natoms;            // atom count of every frame
+  bigint nframe;               // # of frames in each frame file
+#ifdef STMD_MPIIO
+  MPI_File *fh_frame;          // frame file of each set temp, open for the run
+  MPI_File *fh_frame_idx;      // their indices, world roots only
+#endif
+  char *ckpt_file;             // tempering checkpoint written, NULL if off
+  char *resume_file;           // tempering checkpoint read, NULL if off
+  bigint swap_base;            // # of swaps done by resumed runs
+  char *agg_prefix;            // aggregated WT/WH/oREST output, NULL if off
+  FILE *fp_agg_wt,*fp_agg_wh;  // aggregated Ts and histogram output
+  FILE *fp_agg_idx;            // offsets of each world's blocks
+  FILE *fp_agg_rest;           // double-buffered oREST of all worlds
+  int agg_nlocal;              // length of my aggregate record
+  int agg_total;               // length of all records together
+  int *agg_counts,*agg_displs; // record length and offset of each world
+  double *agg_local;           // record of my world
+  double *agg_global;          // records of all worlds, universe root only
+  int agg_slot;                // restart slot written next
+  bigint agg_slotsize;         // bytes per restart slot
+  double *local_values;        // grid header and Y2 of my replica
   double *global_values;       // global list of all local_values
+  int *value_counts;           // length of local_values in each world
+  int *value_displs;           // offset of each world in global_values
   int *temp2world;             // temp2world[i] = world simulating set temp i
   int *world2temp;             // world2temp[i] = temp simulated by world i
   int *world2root;             // world2root[i] = root proc of world i
 
   void print_status();
+  void tune_ladder(int);
+  void ts_window(double *);
+  void stwham_accumulate();
+  void stwham_analyze();
+  void write_exlog();
+  void write_exlog_checkpoint();
+  void open_frames();
+  void close_frames();
+  void write_frame();
+  void write_checkpoint(bigint);
+  void read_checkpoint();
+  void setup_aggregate();
+  bigint agg_header();
+  void write_aggregate();
 
   class FixStmd * fix_stmd;
 
@@ -112,6 +175,94 @@ E: Tempering temperature fix is not valid
 The fix specified by the temper command is not one that controls
 temperature (nvt or langevin).
 
+E: RESTMD: illegal exchange option
+
+The exchange flag must be "on", "off" or "auto".
+
+E: Cannot open RESTMD exchange log
+
+The universe root proc could not open the exlog file or its .idx
+index.
+
+E: Cannot open RESTMD checkpoint file
+
+The universe root proc could not read the resume file or write the
+checkpoint file.
+
+E: Invalid RESTMD checkpoint file
+
+The resume file is not a temper/stmd checkpoint or is truncated.
+
+E: RESTMD checkpoint file does not match the replica grid
+
+The checkpoint was written for a different number of replicas or a
+different temperature x pressure grid.
+
+W: RESTMD checkpoint was written at a different step than the current one
+
+The resumed permutation and RNG states belong to another step than the
+restart file the replicas were read from, so the run does not continue
+exactly.
+
+E: RESTMD aggregate requires the same RSTFRQ in all replicas
+
+Aggregated output is gathered from all worlds at once, so every fix
+stmd must use the same output frequency.
+
+E: Cannot open RESTMD aggregate restart file
+
+The universe root proc could not open prefix.rest.  When fix stmd
+restarts (OREST = yes) the file must exist from a previous run.
+
+E: RESTMD aggregate restart file does not match the replicas
+
+The header of prefix.rest is invalid or its last complete snapshot
+was written for a different number of replicas or energy grids.
+
+E: Cannot open RESTMD aggregate output file
+
+The universe root proc could not open the aggregated WT, WH or index
+file.
+
+E: RESTMD frames require MPI-IO
+
+Every proc writes its own atoms into the frame files with MPI-IO,
+which the serial STUBS library does not provide.
+
+E: Cannot open RESTMD frame file
+
+A proc could not create or open a per set temp frame file or its
+index.
+
+E: Too many atoms for RESTMD frames
+
+Frames store the atom count as a 32-bit integer.
+
+E: RESTMD frames require a constant number of atoms
+
+All frames of a file have the same size, so that each world can
+compute the offset of the next frame without communication.
+
+E: RESTMD frames require consecutive atom IDs
+
+Frames are ordered by atom ID, which must run from 1 to the number of
+atoms.
+
+E: RESTMD: press requires fix npt in every replica
+
+Exchanges in pressure reset the barostat targets, so every replica
+must run fix stmd with an npt fix.
+
+E: RESTMD: tune is only supported for a 1D ladder
+
+Ladder tuning adjusts neighbouring Ts windows along a single
+temperature direction and cannot be combined with the press keyword.
+
+E: RESTMD: stwham is only supported for a 1D ladder
+
+ST-WHAM combines the Ts windows of all set temps at one pressure, the
+replicas of a press grid sample different enthalpies.
+
 E: Must use with fix STMD, fix is not valid
 
 Self-explanatory.
@@ -125,8 +276,40 @@ E: Tempering could not find thermo_pe compute
 This compute is created by the thermo command.  It must have been
 explicitly deleted by a uncompute command.
 
+E: RESTMD: stwham requires the same bin size in all replicas
+
+The in-situ ST-WHAM histograms are combined on one energy grid, so
+every fix stmd must use the same binsize.
+
+E: RESTMD: stwham requires energy grids aligned on a common bin
+
+The lowest bin energy of every fix stmd must differ from the others by
+a whole number of bins, otherwise its histogram would be shifted when
+it is combined on the common grid.
+
+E: Cannot open fract_stwham.dat
+
+The universe root proc could not open the ST-WHAM output file in the
+current directory.
+
+E: Cannot open Ts_stwham.dat
+
+Same as above for the Ts(E) output file.
+
+W: ST-WHAM: negative temperature detected
+
+A replica's Ts is not positive inside the analyzed energy range, its
+sampling weight is replaced by 1/0.001 as in st-wham_RESTMD.py.
+
+W: ST-WHAM: no sampled bins above checkLIMIT, output skipped
+
+The combined production histogram does not exceed checkLIMIT away
+from the edges of the energy grid.  Either the run is too short or the
+energy range or checkLIMIT is too small.
+
 W: RESTMD still in STAGE1, ensure exchanges turned off
 
-Replica exchange must be turned off during STG1, use EX_FLAG
+Replica exchange must be turned off during STG1, use EX_FLAG.
+With "auto" exchanges are turned on once every replica reached STG2.
 
 */
@@ -0,0 +1,513 @@
+/* ----------------------------------------------------------------------
+   Offline replay of the STMD update for parameter tuning
+
+   Runs the Ts(E) update of fix stmd (StmdCore in src/stmd_core.h, the
+   same code FixStmd::MAIN() runs) outside of LAMMPS for a grid of
+   parameter sets, one set per thread, and reports when each stage is reached, the final
+   f, the Ts(E) error against a reference and the histogram flatness.
+
+   WARNING: ONLY for use with RESTMD/STMD!
+
+   Build:
+     g++ -O3 -fopenmp -std=c++11 -I../src -o stmd_replay stmd_replay.cpp
+
+   Usage:
+     stmd_replay [options]
+
+     -e file     energy trace, a LAMMPS log (thermo blocks) or a plain
+                 column file; replayed open loop, Ts does not act back
+     -c column   column of the trace, by name in a log or 0-based index
+                 (default 0)
+     -m a b      instead of a trace, sample a model with the exact
+                 Ts(E) = a + b E by a Metropolis walk in E under the
+                 current STMD weight (closed loop)
+     -M dE       largest Metropolis move of the model in energy units
+                 (default one bin)
+     -r file     reference Ts(E) as E Ts columns, e.g. Ts_stwham.dat;
+                 the model is its own reference
+     -E lo hi    energy range Elo Ehi of fix stmd
+     -T lo hi    temperature range Tlo Thi of fix stmd
+     -S ST       thermostat temperature ST of fix stmd
+     -k kb       Boltzmann constant in the units of E and T (default 1)
+     -n nsteps   number of updates (default: length of the trace)
+     -s seed     seed of the model walks (default 12345)
+     -o file     write the results to file instead of the screen
+     -K style w  Ts update kernel gaussian or epanechnikov of width w
+                 bins, as fix_modify kernel (default: none)
+     -H          monotone Hermite Gamma(E), as fix_modify gamma_interp hermite
+     -t tol      Ts change per step that ends inv_t, as fix_modify ts_tol
+                 (default 0, f-tolerance only)
+
+     parameter lists, comma separated, every combination is replayed
+     -b bins     binsize
+     -1 tsc1     TSC1, dig frequency
+     -2 tsc2     TSC2, f-reduction frequency
+     -f initf    initial delta f
+     -x schemes  none, hchk, sqrt, constant_f, constant_df, inv_t
+
+   Output, one row per parameter set:
+     bin TSC1 TSC2 initf scheme step_STG2 step_STG3 step_STG4 f
+     Ts_rms flatness status
+   step_STGn is -1 if the stage was not reached, Ts_rms is the rms of
+   Ts - Tref over bins inside [Tlo,Thi] of the reference, flatness is
+   max |H - <H>| / <H> over the bins used by HCHK, from PROH once in
+   production and from Hist before.
+------------------------------------------------------------------------- */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "stmd_core.h"
+
+typedef long long bigint;
+
+static void die(const char *msg, const char *arg = NULL)
+{
+  if (arg) fprintf(stderr,"Err: %s %s\n",msg,arg);
+  else fprintf(stderr,"Err: %s\n",msg);
+  exit(1);
+}
+
+/* ----------------------------------------------------------------------
+   split a line into whitespace separated tokens
+------------------------------------------------------------------------- */
+
+static void tokenize(char *line, std::vector<char *> &tok)
+{
+  tok.clear();
+  for (char *p = strtok(line," \t\r\n"); p; p = strtok(NULL," \t\r\n"))
+    tok.push_back(p);
+}
+
+static bool to_double(const char *p, double &val)
+{
+  char *stop;
+  val = strtod(p,&stop);
+  return (stop != p) && (*stop == '\0');
+}
+
+/* ----------------------------------------------------------------------
+   energy trace from the thermo blocks of a log or from a column file
+------------------------------------------------------------------------- */
+
+static void read_trace(const char *path, const std::string &column,
+                       std::vector<double> &trace)
+{
+  FILE *fp = fopen(path,"r");
+  if (!fp) die("Cannot open file",path);
+
+  char *stop;
+  long icol = strtol(column.c_str(),&stop,10);
+  const bool byindex = (*stop == '\0');
+  bool logfile = false;
+  int col = byindex ? icol : -1;
+
+  std::vector<char *> tok;
+  char line[8192];
+  while (fgets(line,sizeof(line),fp)) {
+    tokenize(line,tok);
+    if (tok.empty()) continue;
+    if (!strcmp(tok[0],"Step")) {
+      logfile = true;
+      col = byindex ? icol : -1;
+      for (size_t i = 0; !byindex && i < tok.size(); i++)
+        if (column == tok[i]) col = i;
+      if (col < 0) die("Thermo column not found in",path);
+    } else if (!strcmp(tok[0],"Loop")) {
+      col = -1;
+    } else if ((col >= 0) && ((int) tok.size() > col)) {
+      double val,first;
+      if (logfile && !to_double(tok[0],first)) continue;
+      if (to_double(tok[col],val)) trace.push_back(val);
+    }
+  }
+  fclose(fp);
+  if (!logfile && !byindex) die("Column names need a LAMMPS log:",path);
+}
+
+/* ----------------------------------------------------------------------
+   reference Ts(E) as E Ts columns, Ts <= 0 rows skipped
+------------------------------------------------------------------------- */
+
+static void read_reference(const char *path, std::vector<double> &eref,
+                           std::vector<double> &tref)
+{
+  FILE *fp = fopen(path,"r");
+  if (!fp) die("Cannot open file",path);
+  std::vector<char *> tok;
+  char line[8192];
+  while (fgets(line,sizeof(line),fp)) {
+    if (line[0] == '#') continue;
+    tokenize(line,tok);
+    double e,t;
+    if ((tok.size() < 2) || !to_double(tok[0],e) || !to_double(tok[1],t))
+      continue;
+    if (!(t > 0.0)) continue;
+    eref.push_back(e);
+    tref.push_back(t);
+  }
+  fclose(fp);
+  if (eref.size() < 2) die("Reference needs at least 2 points:",path);
+  for (size_t j = 1; j < eref.size(); j++)
+    if (eref[j] <= eref[j-1]) die("Reference energies not increasing:",path);
+}
+
+static double interpolate(const std::vector<double> &x,
+                          const std::vector<double> &y, double e)
+{
+  if (e <= x.front()) return y.front();
+  if (e >= x.back()) return y.back();
+  size_t j = std::upper_bound(x.begin(),x.end(),e) - x.begin() - 1;
+  const double t = (e - x[j]) / (x[j+1] - x[j]);
+  return (1.0-t)*y[j] + t*y[j+1];
+}
+
+static void split_list(const char *s, std::vector<std::string> &out)
+{
+  out.clear();
+  std::string cur;
+  for (const char *p = s; ; p++) {
+    if (*p == ',' || *p == '\0') {
+      if (!cur.empty()) out.push_back(cur);
+      cur.clear();
+      if (*p == '\0') break;
+    } else cur += *p;
+  }
+  if (out.empty()) die("Empty parameter list",s);
+}
+
+/* ----------------------------------------------------------------------
+   one STMD walker, the update is StmdCore as used by FixStmd
+------------------------------------------------------------------------- */
+
+struct Walker : public LAMMPS_NS::StmdCore {
+  double Emin,Emax;
+
+  // storage behind the StmdCore pointers
+  std::vector<double> y2,y2old,kwbuf,hbuf;
+  std::vector<double *> hrow;
+  std::vector<int> hist,htot,proh;
+
+  // replay bookkeeping
+  bigint stage_step[5];
+  bool failed;
+
+  void init(double TL, double TH, double initf, double cut) {
+    BinMin = (int) round(Emin / bin);
+    const int BinMax = (int) round(Emax / bin);
+    N = BinMax - BinMin + 1;
+
+    const double dFval3 = 0.000020;
+    const double dFval4 = dFval3 / 10.;
+    pfinFval = exp(dFval3 * 2 * bin);
+    finFval = exp(dFval4 * 2 * bin);
+    HCKtol = 0.2;
+
+    STG = 1;
+    SWf = SWfold = SWchk = 1;
+    Gamma = 1.0;
+    Count = CountH = CountPH = totCi = 0;
+    T = ST;
+    f = exp(initf * 2 * bin);
+    df = log(f) * 0.5 / bin;
+    T1 = TL / ST;
+    T2 = TH / ST;
+    CTmin = (TL + cut) / ST;
+    CTmax = (TH - cut) / ST;
+    invt_flag = 0;
+    ts_change = 0.0;
+
+    y2.assign(N,T2);
+    y2old.assign(N,T2);
+    hist.assign(N,0);
+    htot.assign(N,0);
+    proh.assign(N,0);
+    Y2 = &y2[0];
+    Y2old = &y2old[0];
+    Hist = &hist[0];
+    Htot = &htot[0];
+    PROH = &proh[0];
+
+    if (interp_flag) {
+      hbuf.assign(4*N,0.0);
+      hrow.resize(N);
+      for (int i = 0; i < N; i++) hrow[i] = &hbuf[4*i];
+      hcoef = &hrow[0];
+      dirty_lo = 0;
+      dirty_hi = N-1;
+    }
+    if (kernel_flag) {
+      kwbuf.assign(kernel_size()+1,0.0);
+      kw = &kwbuf[0];
+      kernel_weights();
+    }
+
+    for (int s = 0; s < 5; s++) stage_step[s] = -1;
+    stage_step[1] = 0;
+    failed = false;
+  }
+
+  // StmdCore::advance() without the shared Ts of FixStmd::MAIN()
+  void MAIN(bigint istep, double sampledE) {
+    if (advance((int) istep,sampledE) != STMD_OK) {
+      failed = true;
+      return;
+    }
+    for (int s = 2; s <= STG; s++)
+      if (stage_step[s] < 0) stage_step[s] = istep;
+  }
+
+  // S/k difference of the STMD weight between two energies,
+  // trapezoid of 1/(k ST Ts) with Ts interpolated as in GammaE
+  double weight_delta(double e0, double e1, double kb) {
+    const double t0 = ts_at(e0);
+    const double t1 = ts_at(e1);
+    return (e1 - e0) * 0.5 * (1.0/t0 + 1.0/t1) / (kb * ST);
+  }
+
+  double ts_at(double e) {
+    double x = e / bin - BinMin + 1;
+    int j = (int) floor(x);
+    if (j < 0) return Y2[0];
+    if (j >= N-1) return Y2[N-1];
+    const double t = x - j;
+    if (interp_flag) {
+      refresh_hermite();
+      const double *c = hcoef[j];
+      return ((c[3]*t + c[2])*t + c[1])*t + c[0];
+    }
+    return (1.0-t)*Y2[j] + t*Y2[j+1];
+  }
+
+  double flatness() {
+    const int *h = (STG >= 3) ? PROH : Hist;
+    double ave = 0.0;
+    int icnt = 0;
+    for (int i = 0; i < N; i++)
+      if ((Y2[i] > CTmin) && (Y2[i] < CTmax)) {
+        ave += h[i];
+        icnt++;
+      }
+    if ((icnt == 0) || (ave == 0.0)) return -1.0;
+    ave /= icnt;
+    double worst = 0.0;
+    for (int i = 0; i < N; i++)
+      if ((Y2[i] > CTmin) && (Y2[i] < CTmax))
+        worst = std::max(worst,fabs(h[i] - ave) / ave);
+    return worst;
+  }
+};
+
+struct Combo {
+  double bin,initf;
+  int tsc1,tsc2,scheme;
+  bigint stage_step[5];
+  double f,rms,flat;
+  bool failed;
+};
+
+static const char *scheme_names[] =
+  {"none","hchk","sqrt","constant_f","constant_df","inv_t"};
+
+/* ---------------------------------------------------------------------- */
+
+int main(int narg, char **arg)
+{
+  std::string tracefile,reffile,outfile;
+  std::string column = "0";
+  bool model = false;
+  double ma = 0.0, mb = 0.0, mstep = 0.0;
+  double Elo = 0.0, Ehi = 0.0, Tlo = 0.0, Thi = 0.0, ST = 0.0;
+  double kb = 1.0, cut = 50.0;
+  int kernel = 0, hermite = 0;
+  double kwidth = 0.0, tstol = 0.0;
+  bigint nsteps = 0;
+  unsigned long seed = 12345;
+  std::vector<std::string> lbin,ltsc1,ltsc2,linitf,lscheme;
+
+  for (int iarg = 1; iarg < narg; iarg++) {
+    const char *a = arg[iarg];
+    bool more = iarg+1 < narg;
+    bool more2 = iarg+2 < narg;
+    if (!strcmp(a,"-e") && more) tracefile = arg[++iarg];
+    else if (!strcmp(a,"-c") && more) column = arg[++iarg];
+    else if (!strcmp(a,"-m") && more2) {
+      model = true;
+      ma = atof(arg[++iarg]);
+      mb = atof(arg[++iarg]);
+    }
+    else if (!strcmp(a,"-M") && more) mstep = atof(arg[++iarg]);
+    else if (!strcmp(a,"-r") && more) reffile = arg[++iarg];
+    else if (!strcmp(a,"-E") && more2) {
+      Elo = atof(arg[++iarg]);
+      Ehi = atof(arg[++iarg]);
+    }
+    else if (!strcmp(a,"-T") && more2) {
+      Tlo = atof(arg[++iarg]);
+      Thi = atof(arg[++iarg]);
+    }
+    else if (!strcmp(a,"-S") && more) ST = atof(arg[++iarg]);
+    else if (!strcmp(a,"-k") && more) kb = atof(arg[++iarg]);
+    else if (!strcmp(a,"-C") && more) cut = atof(arg[++iarg]);
+    else if (!strcmp(a,"-n") && more) nsteps = atoll(arg[++iarg]);
+    else if (!strcmp(a,"-s") && more) seed = strtoul(arg[++iarg],NULL,10);
+    else if (!strcmp(a,"-o") && more) outfile = arg[++iarg];
+    else if (!strcmp(a,"-K") && more2) {
+      const char *style = arg[++iarg];
+      if (!strcmp(style,"gaussian")) kernel = 1;
+      else if (!strcmp(style,"epanechnikov")) kernel = 2;
+      else die("Unknown kernel style",style);
+      kwidth = atof(arg[++iarg]);
+      if (kwidth <= 0.0) die("Kernel width must be positive");
+    }
+    else if (!strcmp(a,"-H")) hermite = 1;
+    else if (!strcmp(a,"-t") && more) tstol = atof(arg[++iarg]);
+    else if (!strcmp(a,"-b") && more) split_list(arg[++iarg],lbin);
+    else if (!strcmp(a,"-1") && more) split_list(arg[++iarg],ltsc1);
+    else if (!strcmp(a,"-2") && more) split_list(arg[++iarg],ltsc2);
+    else if (!strcmp(a,"-f") && more) split_list(arg[++iarg],linitf);
+    else if (!strcmp(a,"-x") && more) split_list(arg[++iarg],lscheme);
+    else die("Unknown or incomplete option",a);
+  }
+
+  if (model == !tracefile.empty()) die("Need either -e trace or -m model");
+  if ((Ehi <= Elo) || (Thi <= Tlo) || (Tlo <= 0.0) || (ST <= 0.0))
+    die("Need -E Elo Ehi, -T Tlo Thi and -S ST");
+  if (lbin.empty() || ltsc1.empty() || ltsc2.empty() || linitf.empty() ||
+      lscheme.empty())
+    die("Need parameter lists -b -1 -2 -f -x");
+  if (model && (ma + mb*Elo <= 0.0 || ma + mb*Ehi <= 0.0))
+    die("Model Ts(E) must be positive on [Elo,Ehi]");
+
+  std::vector<double> trace;
+  if (!model) {
+    read_trace(tracefile.c_str(),column,trace);
+    if (trace.empty()) die("No energies read from",tracefile.c_str());
+    if (nsteps <= 0) nsteps = trace.size();
+  } else if (nsteps <= 0) die("Need -n nsteps with -m");
+
+  std::vector<double> eref,tref;
+  if (!reffile.empty()) read_reference(reffile.c_str(),eref,tref);
+
+  // every combination of the parameter lists
+
+  std::vector<Combo> combos;
+  for (size_t ib = 0; ib < lbin.size(); ib++)
+    for (size_t i1 = 0; i1 < ltsc1.size(); i1++)
+      for (size_t i2 = 0; i2 < ltsc2.size(); i2++)
+        for (size_t jf = 0; jf < linitf.size(); jf++)
+          for (size_t ix = 0; ix < lscheme.size(); ix++) {
+            Combo c;
+            c.bin = atof(lbin[ib].c_str());
+            c.tsc1 = atoi(ltsc1[i1].c_str());
+            c.tsc2 = atoi(ltsc2[i2].c_str());
+            c.initf = atof(linitf[jf].c_str());
+            c.scheme = -1;
+            for (int s = 0; s < 6; s++)
+              if (lscheme[ix] == scheme_names[s]) c.scheme = s;
+            if (c.scheme < 0) die("Unknown f-reduction scheme",lscheme[ix].c_str());
+            if ((c.bin <= 0.0) || (c.tsc1 < 1) || (c.tsc2 < 1) ||
+                (c.initf <= 0.0) || (c.initf > 1.0))
+              die("Invalid parameter set");
+            combos.push_back(c);
+          }
+
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  printf("STMD replay: %d parameter sets, %lld updates each, %d threads\n",
+         (int) combos.size(),nsteps,nthreads);
+
+  // one walker per parameter set, independent of all others
+
+#pragma omp parallel for schedule(dynamic,1)
+  for (int ic = 0; ic < (int) combos.size(); ic++) {
+    Combo &c = combos[ic];
+    Walker w;
+    w.f_flag = c.scheme;
+    w.TSC1 = c.tsc1;
+    w.TSC2 = c.tsc2;
+    w.bin = c.bin;
+    w.Emin = Elo;
+    w.Emax = Ehi;
+    w.ST = ST;
+    w.kernel_flag = kernel;
+    w.kernel_width = kwidth;
+    w.interp_flag = hermite;
+    w.ts_tol = tstol;
+    w.init(Tlo,Thi,c.initf,cut);
+
+    if (!model) {
+      for (bigint istep = 0; istep < nsteps && !w.failed; istep++)
+        w.MAIN(istep,trace[istep % trace.size()]);
+    } else {
+      // Metropolis walk in E: true weight g(E) = exp(S(E)/k) with
+      // S/k = ln(a + b E)/(k b), STMD weight exp(-int dE/(k ST Ts))
+      std::mt19937_64 rng(seed + ic);
+      std::uniform_real_distribution<double> uni(0.0,1.0);
+      const double dmax = (mstep > 0.0) ? mstep : c.bin;
+      const double elo = (w.BinMin + 0.5) * c.bin;
+      const double ehi = (w.BinMin + w.N - 2.5) * c.bin;
+      double e = 0.5 * (elo + ehi);
+      for (bigint istep = 0; istep < nsteps && !w.failed; istep++) {
+        w.MAIN(istep,e);
+        const double enew = e + (2.0*uni(rng) - 1.0) * dmax;
+        if ((enew < elo) || (enew > ehi)) continue;
+        const double ds = (fabs(mb) > 0.0) ?
+          log((ma + mb*enew) / (ma + mb*e)) / (kb * mb) :
+          (enew - e) / (kb * ma);
+        const double arg = ds - w.weight_delta(e,enew,kb);
+        if ((arg >= 0.0) || (uni(rng) < exp(arg))) e = enew;
+      }
+    }
+
+    for (int s = 0; s < 5; s++) c.stage_step[s] = w.stage_step[s];
+    c.f = w.f;
+    c.failed = w.failed;
+    c.flat = w.flatness();
+
+    // Ts error over the bins inside the window of the reference
+    c.rms = -1.0;
+    if (model || !eref.empty()) {
+      double sum = 0.0;
+      int cnt = 0;
+      for (int i = 0; i < w.N; i++) {
+        const double ebin = (i - 1 + w.BinMin) * c.bin;
+        const double ref = model ? ma + mb*ebin : interpolate(eref,tref,ebin);
+        if ((ref <= Tlo) || (ref >= Thi)) continue;
+        if (!model && ((ebin < eref.front()) || (ebin > eref.back()))) continue;
+        const double d = w.Y2[i]*ST - ref;
+        sum += d*d;
+        cnt++;
+      }
+      if (cnt) c.rms = sqrt(sum / cnt);
+    }
+  }
+
+  FILE *fp = stdout;
+  if (!outfile.empty()) {
+    fp = fopen(outfile.c_str(),"w");
+    if (!fp) die("Cannot open file",outfile.c_str());
+  }
+  fprintf(fp,"# bin TSC1 TSC2 initf scheme step_STG2 step_STG3 step_STG4 "
+          "f Ts_rms flatness status\n");
+  for (size_t ic = 0; ic < combos.size(); ic++) {
+    const Combo &c = combos[ic];
+    fprintf(fp,"%g %d %d %g %s %lld %lld %lld %.10f %g %g %s\n",
+            c.bin,c.tsc1,c.tsc2,c.initf,scheme_names[c.scheme],
+            c.stage_step[2],c.stage_step[3],c.stage_step[4],c.f,c.rms,
+            c.flat,c.failed ? "failed" : "ok");
+  }
+  if (fp != stdout) fclose(fp);
+
+  return 0;
+}
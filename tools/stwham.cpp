@@ -0,0 +1,612 @@
+/* ----------------------------------------------------------------------
+   ST-WHAM and histogram demux for (RE)STMD
+
+   Compiled replacement for st-wham_RESTMD.py and get-hist-enthalpies.py.
+
+   CITE: http://dx.doi.org/10.1063/1.3626150
+   Kim, J., Keyes, T., & Straub, J. E. (2011)
+
+   WARNING: ONLY for use with RESTMD/STMD!
+
+   Build:
+     g++ -O3 -fopenmp -std=c++11 -I../src -o stwham stwham.cpp
+
+   Usage:
+     stwham [options]
+
+     -i file     ST-WHAM input, same 8 lines as inp.stwham (default inp.stwham)
+     -x file     universe log with the exchange permutation (log.lammps),
+                 repeat once per restarted segment, in order
+     -w pattern  walker log of one segment, %d is replaced by the walker
+                 index (e.g. %d/log.lammps.%d-3), repeat per segment, in
+                 the same order as -x
+     -c column   thermo column holding the energy/enthalpy, by name or
+                 0-based index (default 2, PotEng as in get-hist-enthalpies.py)
+     -k kb       Boltzmann constant in the energy units of the data
+                 (default 0.0019872041, kcal/mol/K)
+     -b nboot    number of bootstrap resamples for error bars (default 0)
+     -B block    bootstrap block length in samples (default 1)
+     -s seed     bootstrap seed (default 12345)
+     -d          also write replica-N.dat, walker-N.dat, exchange_list.dat
+
+   Without -w the energies are read from Path_to_data/replica-N.dat, as
+   written by get-hist-enthalpies.py or by -d.
+
+   Output:
+     Ts_stwham.dat       E Ts(E) S(E) betaH(E) betaW(E)
+     fract_stwham.dat    E fraction of samples at E, one block per replica
+     Ts_stwham_err.dat   E dTs(E) dS(E), only with -b
+
+   Logs are memory mapped and parsed one file per thread.  The thermo
+   output of each walker is parsed from every "Step ..." header up to
+   "Loop time", a step printed twice at the seam of two runs is counted
+   once, and the sample at an exchange step belongs to the permutation
+   before the exchange.
+------------------------------------------------------------------------- */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "stwham_solve.h"
+
+typedef long long bigint;
+
+static void die(const char *msg, const char *arg = NULL)
+{
+  if (arg) fprintf(stderr,"Err: %s %s\n",msg,arg);
+  else fprintf(stderr,"Err: %s\n",msg);
+  exit(1);
+}
+
+/* ----------------------------------------------------------------------
+   read-only memory map of a whole file
+------------------------------------------------------------------------- */
+
+struct MappedFile {
+  const char *data;
+  size_t size;
+
+  explicit MappedFile(const char *path) : data(NULL), size(0) {
+    int fd = open(path,O_RDONLY);
+    if (fd < 0) die("Cannot open file",path);
+    struct stat st;
+    if (fstat(fd,&st) < 0) die("Cannot stat file",path);
+    size = st.st_size;
+    if (size > 0) {
+      void *p = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+      if (p == MAP_FAILED) die("Cannot map file",path);
+      madvise(p,size,MADV_SEQUENTIAL);
+      data = (const char *) p;
+    }
+    close(fd);
+  }
+  ~MappedFile() { if (data) munmap((void *) data,size); }
+};
+
+/* ----------------------------------------------------------------------
+   split one line [p,end) into whitespace separated tokens
+------------------------------------------------------------------------- */
+
+static int tokenize(const char *p, const char *end,
+                    std::vector<std::pair<const char *, const char *> > &tok)
+{
+  tok.clear();
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p >= end) break;
+    const char *q = p;
+    while (q < end && *q != ' ' && *q != '\t' && *q != '\r') q++;
+    tok.push_back(std::make_pair(p,q));
+    p = q;
+  }
+  return tok.size();
+}
+
+static bool to_double(const char *p, const char *q, double &val)
+{
+  char buf[64];
+  size_t n = q - p;
+  if (n == 0 || n >= sizeof(buf)) return false;
+  memcpy(buf,p,n);
+  buf[n] = '\0';
+  char *stop;
+  val = strtod(buf,&stop);
+  return stop == buf + n;
+}
+
+/* ----------------------------------------------------------------------
+   thermo samples (step, value of column) of one walker log segment
+------------------------------------------------------------------------- */
+
+static void parse_thermo(const char *path, const std::string &column,
+                         std::vector<bigint> &steps, std::vector<double> &vals)
+{
+  MappedFile f(path);
+  std::vector<std::pair<const char *, const char *> > tok;
+
+  const char *p = f.data;
+  const char *end = f.data + f.size;
+  int col = -1;
+
+  while (p < end) {
+    const char *eol = (const char *) memchr(p,'\n',end-p);
+    if (!eol) eol = end;
+    int n = tokenize(p,eol,tok);
+
+    if (n > 0) {
+      size_t len = tok[0].second - tok[0].first;
+      if (len == 4 && strncmp(tok[0].first,"Step",4) == 0) {
+        col = -1;
+        char *stop;
+        long icol = strtol(column.c_str(),&stop,10);
+        if (*stop == '\0') col = icol;
+        else
+          for (int i = 0; i < n; i++)
+            if (column.size() == size_t(tok[i].second - tok[i].first) &&
+                strncmp(tok[i].first,column.c_str(),column.size()) == 0) col = i;
+        if (col < 0) die("Thermo column not found in",path);
+      } else if (len == 4 && strncmp(tok[0].first,"Loop",4) == 0) {
+        col = -1;
+      } else if (col >= 0 && n > col) {
+        double step,val;
+        if (to_double(tok[0].first,tok[0].second,step) &&
+            to_double(tok[col].first,tok[col].second,val)) {
+          bigint istep = (bigint) step;
+          if (steps.empty() || istep > steps.back()) {
+            steps.push_back(istep);
+            vals.push_back(val);
+          }
+        }
+      }
+    }
+    p = eol + 1;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   exchange permutation rows: step followed by the set temp of each walker
+------------------------------------------------------------------------- */
+
+static void parse_exchange(const char *path, int nrep,
+                           std::vector<bigint> &steps, std::vector<int> &perm)
+{
+  MappedFile f(path);
+  std::vector<std::pair<const char *, const char *> > tok;
+
+  const char *p = f.data;
+  const char *end = f.data + f.size;
+  bool header = false;
+
+  while (p < end) {
+    const char *eol = (const char *) memchr(p,'\n',end-p);
+    if (!eol) eol = end;
+    int n = tokenize(p,eol,tok);
+
+    if (n > 0 && size_t(tok[0].second - tok[0].first) == 4 &&
+        strncmp(tok[0].first,"Step",4) == 0) header = true;
+    else if (header && n == nrep+1) {
+      std::vector<double> row(nrep+1);
+      bool ok = true;
+      for (int i = 0; i <= nrep && ok; i++)
+        ok = to_double(tok[i].first,tok[i].second,row[i]);
+      if (ok) {
+        bigint istep = (bigint) row[0];
+        // a restarted segment repeats the last row of the previous one
+        if (!steps.empty() && istep <= steps.back()) {
+          if (istep < steps.back()) { p = eol + 1; continue; }
+          steps.pop_back();
+          perm.resize(perm.size()-nrep);
+        }
+        steps.push_back(istep);
+        for (int i = 1; i <= nrep; i++) perm.push_back((int) row[i]);
+      }
+    }
+    p = eol + 1;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   plain text column of numbers (replica-N.dat)
+------------------------------------------------------------------------- */
+
+static void parse_column(const char *path, std::vector<double> &vals)
+{
+  MappedFile f(path);
+  const char *p = f.data;
+  const char *end = f.data + f.size;
+  std::vector<std::pair<const char *, const char *> > tok;
+
+  while (p < end) {
+    const char *eol = (const char *) memchr(p,'\n',end-p);
+    if (!eol) eol = end;
+    double val;
+    if (tokenize(p,eol,tok) > 0 && to_double(tok[0].first,tok[0].second,val))
+      vals.push_back(val);
+    p = eol + 1;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   sampling weight Y2 of a replica, line 14 of oREST.N.d
+------------------------------------------------------------------------- */
+
+static void read_orest(const char *path, int nbin, std::vector<double> &y2)
+{
+  FILE *fp = fopen(path,"r");
+  if (!fp) die("Cannot open file",path);
+  std::string line;
+  int c,nline = 0;
+  while (nline < 13 && (c = fgetc(fp)) != EOF)
+    if (c == '\n') nline++;
+  while ((c = fgetc(fp)) != EOF && c != '\n') line.push_back((char) c);
+  fclose(fp);
+
+  y2.clear();
+  const char *p = line.c_str();
+  char *stop;
+  while (true) {
+    double val = strtod(p,&stop);
+    if (stop == p) break;
+    y2.push_back(val);
+    p = stop;
+  }
+  if ((int) y2.size() != nbin) {
+    fprintf(stderr,"WARNING: %s has %d bins, expected %d\n",
+            path,(int) y2.size(),nbin);
+    y2.resize(nbin,0.0);
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+int main(int narg, char **arg)
+{
+  std::string inpfile = "inp.stwham";
+  std::string column = "2";
+  std::vector<std::string> xfiles,wpatterns;
+  double kb = 0.0019872041;
+  int nboot = 0;
+  int block = 1;
+  unsigned long seed = 12345;
+  bool demux_out = false;
+
+  for (int iarg = 1; iarg < narg; iarg++) {
+    const char *a = arg[iarg];
+    bool more = iarg+1 < narg;
+    if (!strcmp(a,"-i") && more) inpfile = arg[++iarg];
+    else if (!strcmp(a,"-x") && more) xfiles.push_back(arg[++iarg]);
+    else if (!strcmp(a,"-w") && more) wpatterns.push_back(arg[++iarg]);
+    else if (!strcmp(a,"-c") && more) column = arg[++iarg];
+    else if (!strcmp(a,"-k") && more) kb = atof(arg[++iarg]);
+    else if (!strcmp(a,"-b") && more) nboot = atoi(arg[++iarg]);
+    else if (!strcmp(a,"-B") && more) block = atoi(arg[++iarg]);
+    else if (!strcmp(a,"-s") && more) seed = strtoul(arg[++iarg],NULL,10);
+    else if (!strcmp(a,"-d")) demux_out = true;
+    else die("Unknown or incomplete option",a);
+  }
+  if (nboot < 0 || block < 1) die("Invalid bootstrap options");
+  if (!wpatterns.empty() && wpatterns.size() != xfiles.size())
+    die("Need one -x exchange log per -w walker log segment");
+
+  printf("ST-WHAM for (RE)STMD\n\n");
+
+  // input parameters, same layout as for st-wham_RESTMD.py
+
+  std::vector<std::string> lines;
+  {
+    FILE *fp = fopen(inpfile.c_str(),"r");
+    if (!fp) die("Cannot open file",inpfile.c_str());
+    char buf[4096];
+    while (fgets(buf,sizeof(buf),fp)) {
+      std::string s(buf);
+      while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) s.pop_back();
+      lines.push_back(s);
+    }
+    fclose(fp);
+  }
+  if (lines.size() != 8)
+    die("Invalid input: Incorrect parameters, Should be:\n"
+        "  binsize\n  Elow\n  Ehigh\n  T0\n  List_of_Tlow\n"
+        "  List_of_Thigh\n  Path_to_data\n  checkLIMIT");
+
+  const double binsize = atof(lines[0].c_str());
+  const double Emin = atof(lines[1].c_str());
+  const double Emax = atof(lines[2].c_str());
+  const double T0 = atof(lines[3].c_str());
+  std::vector<double> T1s,T2s;
+  {
+    std::vector<double> *lists[2] = {&T1s,&T2s};
+    for (int k = 0; k < 2; k++) {
+      const char *p = lines[4+k].c_str();
+      char *stop;
+      while (true) {
+        double v = strtod(p,&stop);
+        if (stop == p) break;
+        lists[k]->push_back(v);
+        p = stop;
+      }
+    }
+  }
+  std::string workdir = lines[6];
+  while (!workdir.empty() && workdir.back() == ' ') workdir.pop_back();
+  const double checklimit = atof(lines[7].c_str());
+
+  const double bmin = round(Emin/binsize);
+  const double bmax = round(Emax/binsize);
+  const int nbin = (int) (bmax - bmin + 1);
+  const int nrep = T1s.size();
+
+  if (nbin < 0) die("Emin must be smaller than Emax.");
+  if (nrep < 1) die("Must supply list of Tlo and Thi for each replica.");
+  if (T1s.size() != T2s.size()) die("Must have Tlo and Thi for all replicas.");
+
+#ifdef _OPENMP
+  printf("Threads: %d\n",omp_get_max_threads());
+#endif
+
+  // energies per replica, in time order
+
+  std::vector<std::vector<double> > repE(nrep);
+  char path[4096];
+
+  if (wpatterns.empty()) {
+    printf("Reading replica-N.dat from %s\n",workdir.c_str());
+#pragma omp parallel for schedule(dynamic) private(path)
+    for (int l = 0; l < nrep; l++) {
+      snprintf(path,sizeof(path),"%sreplica-%d.dat",workdir.c_str(),l);
+      parse_column(path,repE[l]);
+    }
+  } else {
+    const int nseg = wpatterns.size();
+    printf("Reading %d log segment(s) of %d walkers\n",nseg,nrep);
+
+    std::vector<std::vector<bigint> > wsteps(nrep*nseg);
+    std::vector<std::vector<double> > wvals(nrep*nseg);
+#pragma omp parallel for schedule(dynamic) private(path)
+    for (int k = 0; k < nrep*nseg; k++) {
+      const int w = k / nseg;
+      const int iseg = k % nseg;
+      std::string pat = wpatterns[iseg];
+      std::string name;
+      for (size_t c = 0; c < pat.size(); c++) {
+        if (pat[c] == '%' && c+1 < pat.size() && pat[c+1] == 'd') {
+          snprintf(path,sizeof(path),"%d",w);
+          name += path;
+          c++;
+        } else name.push_back(pat[c]);
+      }
+      parse_thermo(name.c_str(),column,wsteps[k],wvals[k]);
+    }
+
+    std::vector<bigint> xsteps;
+    std::vector<int> perm;
+    for (size_t i = 0; i < xfiles.size(); i++)
+      parse_exchange(xfiles[i].c_str(),nrep,xsteps,perm);
+    if (xsteps.empty()) die("No exchange rows found in exchange log");
+
+    // concatenate segments, drop steps repeated at the seams
+    std::vector<std::vector<bigint> > steps(nrep);
+    std::vector<std::vector<double> > walkE(nrep);
+#pragma omp parallel for schedule(dynamic)
+    for (int w = 0; w < nrep; w++)
+      for (int iseg = 0; iseg < nseg; iseg++) {
+        const std::vector<bigint> &s = wsteps[w*nseg+iseg];
+        const std::vector<double> &v = wvals[w*nseg+iseg];
+        for (size_t i = 0; i < s.size(); i++)
+          if (steps[w].empty() || s[i] > steps[w].back()) {
+            steps[w].push_back(s[i]);
+            walkE[w].push_back(v[i]);
+          }
+      }
+    wsteps.clear();
+    wvals.clear();
+
+    size_t nsample = steps[0].size();
+    for (int w = 1; w < nrep; w++)
+      if (steps[w].size() != nsample) {
+        fprintf(stderr,"WARNING: walker %d has %d samples, walker 0 has %d, "
+                "truncating\n",w,(int) steps[w].size(),(int) nsample);
+        nsample = std::min(nsample,steps[w].size());
+      }
+
+    for (int w = 0; w < nrep; w++) {
+      printf("Walker: %d  Step start: %lld  Step end: %lld\n",w,
+             nsample ? steps[w][0] : 0LL,nsample ? steps[w][nsample-1] : 0LL);
+      repE[w].resize(nsample);
+    }
+
+    // demux: sample at step s belongs to the last exchange before s
+    std::vector<int> rowof(nsample);
+    bool aligned = true;
+#pragma omp parallel for reduction(&&:aligned)
+    for (size_t k = 0; k < nsample; k++) {
+      const bigint s = steps[0][k];
+      for (int w = 1; w < nrep; w++) aligned = aligned && (steps[w][k] == s);
+      long row = std::lower_bound(xsteps.begin(),xsteps.end(),s) - xsteps.begin() - 1;
+      rowof[k] = row < 0 ? 0 : (int) row;
+      for (int w = 0; w < nrep; w++) {
+        const int l = perm[rowof[k]*nrep + w];
+        if (l >= 0 && l < nrep) repE[l][k] = walkE[w][k];
+      }
+    }
+    if (!aligned) die("Walker thermo output is not on common timesteps");
+
+    if (demux_out) {
+      printf("\nSaving outputs...\n");
+      for (int l = 0; l < nrep; l++) {
+        snprintf(path,sizeof(path),"replica-%d.dat",l);
+        FILE *fp = fopen(path,"w");
+        if (!fp) die("Cannot open file",path);
+        for (size_t k = 0; k < nsample; k++) fprintf(fp,"%.18e\n",repE[l][k]);
+        fclose(fp);
+        snprintf(path,sizeof(path),"walker-%d.dat",l);
+        fp = fopen(path,"w");
+        if (!fp) die("Cannot open file",path);
+        for (size_t k = 0; k < nsample; k++) fprintf(fp,"%.18e\n",walkE[l][k]);
+        fclose(fp);
+      }
+      FILE *fp = fopen("exchange_list.dat","w");
+      if (!fp) die("Cannot open file","exchange_list.dat");
+      for (size_t k = 0; k < nsample; k++) {
+        fprintf(fp,"%lld",steps[0][k]);
+        for (int w = 0; w < nrep; w++) fprintf(fp," %d",perm[rowof[k]*nrep+w]);
+        fprintf(fp,"\n");
+      }
+      fclose(fp);
+    }
+  }
+
+  // bin index of every sample, histogramdd binning over [Emin,Emax]
+
+  const double width = (Emax - Emin) / nbin;
+  std::vector<std::vector<int> > repbin(nrep);
+  for (int l = 0; l < nrep; l++) {
+    const std::vector<double> &e = repE[l];
+    std::vector<int> &b = repbin[l];
+    b.resize(e.size());
+#pragma omp parallel for
+    for (size_t k = 0; k < e.size(); k++) {
+      int i = -1;
+      if (e[k] >= Emin && e[k] <= Emax) {
+        i = (int) ((e[k] - Emin) / width);
+        if (i >= nbin) i = nbin-1;
+      }
+      b[k] = i;
+    }
+    std::vector<double>().swap(repE[l]);
+  }
+
+  std::vector<double> hist(nbin*nrep,0.0);
+  for (int l = 0; l < nrep; l++) {
+    const std::vector<int> &b = repbin[l];
+#pragma omp parallel
+    {
+      std::vector<double> mine(nbin,0.0);
+#pragma omp for nowait
+      for (size_t k = 0; k < b.size(); k++)
+        if (b[k] >= 0) mine[b[k]] += 1.0;
+#pragma omp critical
+      for (int i = 0; i < nbin; i++) hist[i*nrep+l] += mine[i];
+    }
+  }
+
+  // sampling weights, Ts of replica l at bin i
+
+  std::vector<double> ts(nbin*nrep);
+  for (int l = 0; l < nrep; l++) {
+    std::vector<double> y2;
+    snprintf(path,sizeof(path),"%soREST.%d.d",workdir.c_str(),l);
+    read_orest(path,nbin,y2);
+    for (int i = 0; i < nbin; i++) ts[i*nrep+l] = y2[i];
+  }
+
+  LAMMPS_NS::StwhamSolve st;
+  st.nbin = nbin;
+  st.nrep = nrep;
+  st.bin = binsize;
+  st.kb = kb;
+  st.T0 = T0;
+  st.limit = checklimit;
+
+  // throw out edge data under checklimit
+
+  std::vector<double> htot(nbin);
+  const double ntot = st.totals(&hist[0],&htot[0]);
+  if (ntot == 0.0) die("No samples inside [Elow,Ehigh].");
+
+  int bstart,bstop;
+  st.edges(&htot[0],ntot,bstart,bstop);
+  if (bstart < 0) die("Energy range not large enough, decrease Emin.");
+  if (bstop < 0) die("Energy range not large enough, increase Emax.");
+
+  std::vector<double> TH(nbin),Ent(nbin),betaH(nbin),betaW(nbin);
+  if (st.solve(&hist[0],&htot[0],ntot,&ts[0],bstart,bstop,
+               &TH[0],&Ent[0],&betaH[0],&betaW[0]))
+    fprintf(stderr,"WARNING: Negative Temperature detected...\n");
+
+  FILE *fp = fopen("fract_stwham.dat","w");
+  if (!fp) die("Cannot open file","fract_stwham.dat");
+  for (int l = 0; l < nrep; l++) {
+    for (int i = bstart; i < bstop; i++)
+      fprintf(fp,"%f %f\n",Emin+(i*binsize),
+              htot[i] > 0.0 ? hist[i*nrep+l]/htot[i] : 0.0);
+    fprintf(fp,"\n");
+  }
+  fclose(fp);
+
+  fp = fopen("Ts_stwham.dat","w");
+  if (!fp) die("Cannot open file","Ts_stwham.dat");
+  for (int i = bstart; i < bstop; i++)
+    fprintf(fp,"%f %f %f %f %f\n",Emin+(i*binsize),TH[i],Ent[i],betaH[i],betaW[i]);
+  fclose(fp);
+
+  // block bootstrap of each replica's time series, same edge cut
+
+  if (nboot > 0) {
+    printf("Bootstrap: %d resamples, block length %d\n",nboot,block);
+    std::vector<double> sT(nbin,0.0),sT2(nbin,0.0),sS(nbin,0.0),sS2(nbin,0.0);
+
+#pragma omp parallel
+    {
+      std::vector<double> h(nbin*nrep),ht(nbin);
+      std::vector<double> th(nbin),ent(nbin),bh(nbin),bw(nbin);
+      std::vector<double> mT(nbin,0.0),mT2(nbin,0.0),mS(nbin,0.0),mS2(nbin,0.0);
+
+#pragma omp for schedule(dynamic)
+      for (int ib = 0; ib < nboot; ib++) {
+        std::mt19937_64 rng(seed + 7919UL*ib);
+        std::fill(h.begin(),h.end(),0.0);
+        for (int l = 0; l < nrep; l++) {
+          const std::vector<int> &b = repbin[l];
+          const size_t n = b.size();
+          if (n == 0) continue;
+          const size_t len = std::min((size_t) block,n);
+          std::uniform_int_distribution<size_t> pick(0,n-len);
+          for (size_t drawn = 0; drawn < n; drawn += len) {
+            const size_t k0 = pick(rng);
+            for (size_t k = k0; k < k0+len; k++)
+              if (b[k] >= 0) h[b[k]*nrep+l] += 1.0;
+          }
+        }
+        const double nt = st.totals(&h[0],&ht[0]);
+        st.solve(&h[0],&ht[0],nt,&ts[0],bstart,bstop,&th[0],&ent[0],&bh[0],&bw[0]);
+        for (int i = bstart; i < bstop; i++) {
+          mT[i] += th[i]; mT2[i] += th[i]*th[i];
+          mS[i] += ent[i]; mS2[i] += ent[i]*ent[i];
+        }
+      }
+
+#pragma omp critical
+      for (int i = 0; i < nbin; i++) {
+        sT[i] += mT[i]; sT2[i] += mT2[i];
+        sS[i] += mS[i]; sS2[i] += mS2[i];
+      }
+    }
+
+    fp = fopen("Ts_stwham_err.dat","w");
+    if (!fp) die("Cannot open file","Ts_stwham_err.dat");
+    for (int i = bstart; i < bstop; i++) {
+      const double aT = sT[i]/nboot;
+      const double aS = sS[i]/nboot;
+      const double dT = sqrt(std::max(0.0,sT2[i]/nboot - aT*aT));
+      const double dS = sqrt(std::max(0.0,sS2[i]/nboot - aS*aS));
+      fprintf(fp,"%f %f %f\n",Emin+(i*binsize),dT,dS);
+    }
+    fclose(fp);
+  }
+
+  printf("Done: bins %d to %d of %d\n",bstart,bstop,nbin);
+  return 0;
+}